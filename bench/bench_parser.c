@@ -0,0 +1,238 @@
+#include "khttp.h"
+#include "log.h"
+#include <stdarg.h>
+#include <time.h>
+
+/*
+ * Response parsing microbenchmark. Each corpus entry is parsed by the bare
+ * http_parser and by the khttp callback chain, fed in KHTTP_NETWORK_BUF
+ * pieces as recv() would hand them over. The corpus is generated and the
+ * table has a fixed order and width so two runs diff cleanly. Best of
+ * BENCH_RUNS, allocations are counted through the khttp allocator hooks.
+ *
+ *   ./bench_parser.exe [case]
+ */
+#define BENCH_RUNS      5
+#define BENCH_BYTES     (64 * 1024 * 1024)     //Bytes parsed per run and case
+#define BENCH_MIN_MSG   1000
+
+typedef struct {
+    const char      *name;
+    char            *data;
+    size_t          len;
+} bench_case;
+
+static unsigned long bench_allocs = 0;
+
+static void *bench_malloc(size_t size, void *userdata)
+{
+    bench_allocs++;
+    return malloc(size);
+}
+
+static void *bench_realloc(void *ptr, size_t size, void *userdata)
+{
+    bench_allocs++;
+    return realloc(ptr, size);
+}
+
+static void bench_free(void *ptr, void *userdata)
+{
+    free(ptr);
+}
+
+static unsigned long long bench_now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+typedef struct {
+    char            *buf;
+    size_t          len;
+    size_t          cap;
+} bench_buf;
+
+static void bench_append(bench_buf *b, const char *fmt, ...)
+{
+    va_list ap;
+    for(;;){
+        va_start(ap, fmt);
+        int n = vsnprintf(b->buf + b->len, b->cap - b->len, fmt, ap);
+        va_end(ap);
+        if(b->len + n < b->cap){
+            b->len += n;
+            return;
+        }
+        b->cap = (b->cap + n) * 2;
+        b->buf = realloc(b->buf, b->cap);
+    }
+}
+
+static void bench_fill(bench_buf *b, size_t len)
+{
+    size_t i = 0;
+    if(b->len + len + 1 > b->cap){
+        b->cap = (b->len + len + 1) * 2;
+        b->buf = realloc(b->buf, b->cap);
+    }
+    for(i = 0; i < len; i++) b->buf[b->len + i] = 'a' + i % 26;
+    b->len += len;
+    b->buf[b->len] = 0;
+}
+
+static void bench_chunked(bench_buf *b, size_t total, size_t chunk)
+{
+    bench_append(b, "HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\n"
+            "Transfer-Encoding: chunked\r\n\r\n");
+    while(total > 0){
+        size_t n = total < chunk ? total : chunk;
+        bench_append(b, "%zx\r\n", n);
+        bench_fill(b, n);
+        bench_append(b, "\r\n");
+        total -= n;
+    }
+    bench_append(b, "0\r\n\r\n");
+}
+
+static int bench_corpus(bench_case *cases)
+{
+    bench_buf b;
+    int n = 0;
+    int i = 0;
+    const char *json = "{\"id\":1234,\"name\":\"khttp\",\"tags\":[\"http\",\"client\",\"c\"],"
+            "\"ok\":true,\"ratio\":0.75,\"owner\":{\"login\":\"wyrover\",\"id\":42}}";
+
+    memset(&b, 0, sizeof(b));
+    bench_append(&b, "HTTP/1.1 200 OK\r\nServer: nginx\r\nDate: Sat, 17 Oct 2026 00:00:00 GMT\r\n"
+            "Content-Type: application/json; charset=utf-8\r\nConnection: keep-alive\r\n"
+            "Content-Length: %zu\r\n\r\n%s", strlen(json), json);
+    cases[n++] = (bench_case){"json_small", b.buf, b.len};
+
+    memset(&b, 0, sizeof(b));
+    bench_append(&b, "HTTP/1.1 200 OK\r\n");
+    for(i = 0; i < 128; i++){
+        bench_append(&b, "X-Bench-Header-%03d: value-%d-0123456789abcdef\r\n", i, i);
+    }
+    bench_append(&b, "Content-Length: 2\r\n\r\nok");
+    cases[n++] = (bench_case){"headers_128", b.buf, b.len};
+
+    memset(&b, 0, sizeof(b));
+    bench_chunked(&b, 64 * 1024, 4096);
+    cases[n++] = (bench_case){"chunked_64k", b.buf, b.len};
+
+    memset(&b, 0, sizeof(b));
+    bench_append(&b, "HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\n"
+            "Content-Length: %d\r\n\r\n", 1000 * 1000);
+    bench_fill(&b, 1000 * 1000);
+    cases[n++] = (bench_case){"length_1m", b.buf, b.len};
+
+    memset(&b, 0, sizeof(b));
+    bench_chunked(&b, 16 * 1024, 8);
+    cases[n++] = (bench_case){"tiny_chunks", b.buf, b.len};
+    return n;
+}
+
+// Bare parser, callbacks only touch the data so they are not optimized away
+static size_t bench_sink = 0;
+static int bench_complete = 0;
+
+static int bench_data_cb(http_parser *hp, const char *at, size_t len)
+{
+    bench_sink += len + (unsigned char)at[0];
+    return 0;
+}
+
+static int bench_complete_cb(http_parser *hp)
+{
+    bench_complete = 1;
+    return 0;
+}
+
+static http_parser_settings bench_settings =
+{
+    .on_url                 = bench_data_cb
+    ,.on_status             = bench_data_cb
+    ,.on_header_field       = bench_data_cb
+    ,.on_header_value       = bench_data_cb
+    ,.on_body               = bench_data_cb
+    ,.on_message_complete   = bench_complete_cb
+};
+
+static int bench_parser_msg(void *arg, const char *buf, size_t len)
+{
+    http_parser *hp = arg;
+    size_t off = 0;
+    http_parser_init(hp, HTTP_RESPONSE);
+    bench_complete = 0;
+    while(off < len){
+        size_t n = len - off > KHTTP_NETWORK_BUF ? KHTTP_NETWORK_BUF : len - off;
+        if(http_parser_execute(hp, &bench_settings, buf + off, n) != n) return -1;
+        off += n;
+    }
+    return bench_complete ? 0 : -1;
+}
+
+// Full chain, headers stored and body copied into ctx->body
+static int bench_khttp_msg(void *arg, const char *buf, size_t len)
+{
+    khttp_ctx *ctx = arg;
+    size_t off = 0;
+    int ret = 0;
+    while(off < len && ret == 0){
+        size_t n = len - off > KHTTP_NETWORK_BUF ? KHTTP_NETWORK_BUF : len - off;
+        ret = khttp_feed_response(ctx, buf + off, n);
+        off += n;
+    }
+    return ret == 1 && ctx->hp.status_code == 200 ? 0 : -1;
+}
+
+static int bench_run(const char *mode, bench_case *c, int (*fn)(void *, const char *, size_t), void *arg)
+{
+    unsigned long msgs = BENCH_BYTES / c->len;
+    unsigned long long best = 0;
+    unsigned long allocs = 0;
+    unsigned long i = 0;
+    int run = 0;
+    if(msgs < BENCH_MIN_MSG) msgs = BENCH_MIN_MSG;
+    // Warm up, first message sizes the buffers
+    if(fn(arg, c->data, c->len) != 0){
+        printf("%-12s %-6s parse error\n", c->name, mode);
+        return -1;
+    }
+    for(run = 0; run < BENCH_RUNS; run++){
+        bench_allocs = 0;
+        unsigned long long start = bench_now_ns();
+        for(i = 0; i < msgs; i++){
+            if(fn(arg, c->data, c->len) != 0) return -1;
+        }
+        unsigned long long ns = bench_now_ns() - start;
+        if(best == 0 || ns < best) best = ns;
+        allocs = bench_allocs;
+    }
+    printf("%-12s %-6s %8zu %10.1f %10.1f %8.2f\n", c->name, mode, c->len,
+            (double)c->len * msgs / best * 1000.0, (double)best / msgs, (double)allocs / msgs);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    bench_case cases[8];
+    http_parser hp;
+    int fail = 0;
+    int i = 0;
+    log_set_level(ERROR);
+    khttp_set_allocator(bench_malloc, bench_realloc, bench_free, NULL);
+    int n = bench_corpus(cases);
+    khttp_ctx *ctx = khttp_new();
+    printf("%-12s %-6s %8s %10s %10s %8s\n", "case", "mode", "bytes", "MB/s", "ns/msg", "allocs");
+    for(i = 0; i < n; i++){
+        if(argc > 1 && strcmp(argv[1], cases[i].name) != 0) continue;
+        fail |= bench_run("parser", &cases[i], bench_parser_msg, &hp) != 0;
+        fail |= bench_run("khttp", &cases[i], bench_khttp_msg, ctx) != 0;
+    }
+    khttp_destroy(ctx);
+    for(i = 0; i < n; i++) free(cases[i].data);
+    return fail;
+}
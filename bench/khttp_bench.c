@@ -0,0 +1,267 @@
+#include "khttp.h"
+#include "log.h"
+#include <ctype.h>
+#include <pthread.h>
+
+/*
+ * wrk style load generator. Every thread drives its share of the connections
+ * through one khttp_multi, each connection is a ctx reused with khttp_reset.
+ *
+ * With -R every connection follows a fixed schedule and latency is measured
+ * from the time a request was due, not from when it could be sent, so a
+ * stalled server shows up in the percentiles (coordinated omission). Without
+ * -R requests go back to back and both figures are the service time.
+ *
+ *   ./khttp-bench -t 2 -c 32 -d 10 -R 20000 http://127.0.0.1:8888/ping
+ */
+#define BENCH_MAX_HEADERS   32
+#define BENCH_SPIN_US       1000                //Busy poll this close to a due request
+
+typedef struct {
+    khttp_ctx       *ctx;
+    uint64_t        due;                        //When the next request is due, us
+    uint64_t        start;                      //When it was sent, us
+    int             busy;
+} bench_conn;
+
+typedef struct {
+    pthread_t       tid;
+    int             conns;
+    uint64_t        interval;                   //Per connection, us, 0 without -R
+    khttp_hist      latency;                    //From due time
+    khttp_hist      service;                    //From send time
+    uint64_t        requests;
+    uint64_t        bytes_recv;
+    uint64_t        bytes_sent;
+    uint64_t        non2xx;
+    uint64_t        errors[KHTTP_ERR_UNKNOWN + 1];
+} bench_thread;
+
+static char *bench_uri = NULL;
+static int bench_method = KHTTP_GET;
+static char *bench_body = NULL;
+static char *bench_header[BENCH_MAX_HEADERS][2];
+static int bench_headers = 0;
+static int bench_insecure = 0;
+static uint64_t bench_start = 0;
+static uint64_t bench_end = 0;
+
+static int bench_request(bench_conn *c)
+{
+    int i = 0;
+    khttp_reset(c->ctx);
+    if(bench_method != KHTTP_GET) khttp_set_method(c->ctx, bench_method);
+    if(bench_body && khttp_set_post_data(c->ctx, bench_body) != KHTTP_ERR_OK) return -1;
+    for(i = 0; i < bench_headers; i++){
+        if(khttp_add_header(c->ctx, bench_header[i][0], bench_header[i][1]) != KHTTP_ERR_OK) return -1;
+    }
+    return 0;
+}
+
+static void *bench_run(void *arg)
+{
+    bench_thread *t = arg;
+    bench_conn *conn = calloc(t->conns, sizeof(bench_conn));
+    khttp_multi *m = khttp_multi_new();
+    khttp_ctx *done = NULL;
+    int result = 0;
+    int inflight = 0;
+    int i = 0;
+    if(conn == NULL || m == NULL){
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    for(i = 0; i < t->conns; i++){
+        conn[i].ctx = khttp_new();
+        if(conn[i].ctx == NULL || khttp_set_uri(conn[i].ctx, bench_uri) != KHTTP_ERR_OK){
+            fprintf(stderr, "bad uri %s\n", bench_uri);
+            exit(1);
+        }
+        if(bench_insecure) khttp_ssl_skip_auth(conn[i].ctx);
+        // Spread the first requests over one interval
+        conn[i].due = bench_start + t->interval * i / t->conns;
+    }
+    for(;;){
+        uint64_t now = khttp_now_us();
+        uint64_t wake = bench_end;
+        if(now >= bench_end) break;
+        for(i = 0; i < t->conns; i++){
+            bench_conn *c = &conn[i];
+            if(c->busy) continue;
+            if(c->due > now){
+                if(c->due < wake) wake = c->due;
+                continue;
+            }
+            if(bench_request(c) != 0){
+                fprintf(stderr, "request setup failure\n");
+                exit(1);
+            }
+            c->start = now;
+            c->busy = 1;
+            inflight++;
+            khttp_multi_add(m, c->ctx);
+        }
+        int timeout = wake - now <= BENCH_SPIN_US ? 0 : (wake - now - BENCH_SPIN_US) / 1000;
+        if(inflight > 0){
+            khttp_multi_poll(m, timeout);
+        }else if(timeout > 0){
+            // Poll returns at once without transfers
+            usleep(wake - now - BENCH_SPIN_US);
+        }
+        while((done = khttp_multi_done(m, &result)) != NULL){
+            bench_conn *c = conn;
+            const khttp_timings *tm = khttp_get_timings(done);
+            while(c->ctx != done) c++;
+            now = khttp_now_us();
+            c->busy = 0;
+            inflight--;
+            if(now >= bench_end) continue;
+            t->bytes_recv += tm->bytes_recv;
+            t->bytes_sent += tm->bytes_sent;
+            if(result != KHTTP_ERR_OK){
+                t->errors[result < 0 ? -result : result]++;
+            }else{
+                t->requests++;
+                if(done->hp.status_code < 200 || done->hp.status_code >= 400) t->non2xx++;
+                khttp_hist_record(&t->latency, now - (t->interval ? c->due : c->start));
+                khttp_hist_record(&t->service, now - c->start);
+            }
+            c->due = t->interval ? c->due + t->interval : now;
+        }
+    }
+    // Requests still in flight at the end are not counted
+    khttp_multi_destroy(m);
+    for(i = 0; i < t->conns; i++) khttp_destroy(conn[i].ctx);
+    free(conn);
+    return NULL;
+}
+
+static void bench_size(char *buf, size_t len, double bytes)
+{
+    const char *unit[] = {"B", "KB", "MB", "GB", "TB"};
+    int i = 0;
+    while(bytes >= 1024 && i < 4){
+        bytes /= 1024;
+        i++;
+    }
+    snprintf(buf, len, "%.2f%s", bytes, unit[i]);
+}
+
+static void bench_hist(const char *name, khttp_hist *h)
+{
+    printf("  %-12s %10.2f %10llu %10llu %10llu %10llu %10llu\n", name,
+            h->count ? (double)h->sum / h->count : 0.0,
+            (unsigned long long)khttp_hist_quantile(h, 0.5),
+            (unsigned long long)khttp_hist_quantile(h, 0.9),
+            (unsigned long long)khttp_hist_quantile(h, 0.99),
+            (unsigned long long)khttp_hist_quantile(h, 0.999),
+            (unsigned long long)h->max);
+}
+
+static void bench_usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [options] url\n"
+            "  -t threads       threads (1)\n"
+            "  -c connections   connections in total (10)\n"
+            "  -d seconds       duration (10)\n"
+            "  -R rate          requests/s in total, 0 sends back to back (0)\n"
+            "  -m method        GET, POST, PUT or DELETE (GET)\n"
+            "  -b body          request body\n"
+            "  -H \"name: value\" extra header, repeatable\n"
+            "  -k               skip TLS certificate verification\n", name);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    const char *methods[] = {"GET", "POST", "PUT", "DELETE"};
+    bench_thread *threads = NULL;
+    bench_thread total;
+    int nthread = 1;
+    int nconn = 10;
+    int duration = 10;
+    double rate = 0;
+    int opt = 0;
+    int i = 0;
+    while((opt = getopt(argc, argv, "t:c:d:R:m:b:H:k")) != -1){
+        switch(opt){
+            case 't': nthread = atoi(optarg);       break;
+            case 'c': nconn = atoi(optarg);         break;
+            case 'd': duration = atoi(optarg);      break;
+            case 'R': rate = atof(optarg);          break;
+            case 'b': bench_body = optarg;          break;
+            case 'k': bench_insecure = 1;           break;
+            case 'm':
+                for(i = 0; i < 4 && strcasecmp(optarg, methods[i]) != 0; i++);
+                if(i == 4) bench_usage(argv[0]);
+                bench_method = KHTTP_GET + i;
+                break;
+            case 'H': {
+                char *colon = strchr(optarg, ':');
+                if(colon == NULL || bench_headers == BENCH_MAX_HEADERS) bench_usage(argv[0]);
+                *colon++ = 0;
+                while(*colon == ' ') colon++;
+                bench_header[bench_headers][0] = optarg;
+                bench_header[bench_headers][1] = colon;
+                bench_headers++;
+                break;
+            }
+            default: bench_usage(argv[0]);
+        }
+    }
+    if(optind != argc - 1 || nthread < 1 || nconn < nthread || duration < 1 || rate < 0) bench_usage(argv[0]);
+    bench_uri = argv[optind];
+    // Failures are counted in the report
+    log_set_level(FATAL);
+    // Every connection stays in the pool between its requests
+    khttp_pool_set_limit(nconn, KHTTP_POOL_IDLE_TIMEO);
+    threads = calloc(nthread, sizeof(bench_thread));
+    printf("Running %ds test @ %s\n", duration, bench_uri);
+    printf("  %d threads and %d connections", nthread, nconn);
+    if(rate > 0) printf(", %.0f requests/s", rate);
+    printf("\n");
+    bench_start = khttp_now_us();
+    bench_end = bench_start + duration * 1000000ULL;
+    for(i = 0; i < nthread; i++){
+        threads[i].conns = nconn / nthread + (i < nconn % nthread);
+        threads[i].interval = rate > 0 ? (uint64_t)(1000000.0 * nconn / rate) : 0;
+        pthread_create(&threads[i].tid, NULL, bench_run, &threads[i]);
+    }
+    memset(&total, 0, sizeof(total));
+    for(i = 0; i < nthread; i++){
+        int j = 0;
+        pthread_join(threads[i].tid, NULL);
+        khttp_hist_merge(&total.latency, &threads[i].latency);
+        khttp_hist_merge(&total.service, &threads[i].service);
+        total.requests += threads[i].requests;
+        total.bytes_recv += threads[i].bytes_recv;
+        total.bytes_sent += threads[i].bytes_sent;
+        total.non2xx += threads[i].non2xx;
+        for(j = 0; j <= KHTTP_ERR_UNKNOWN; j++) total.errors[j] += threads[i].errors[j];
+    }
+    double secs = duration;
+    char recv_size[32], sent_size[32], recv_rate[32];
+    bench_size(recv_size, sizeof(recv_size), total.bytes_recv);
+    bench_size(sent_size, sizeof(sent_size), total.bytes_sent);
+    bench_size(recv_rate, sizeof(recv_rate), total.bytes_recv / secs);
+    printf("  %-12s %10s %10s %10s %10s %10s %10s\n", "us", "mean", "p50", "p90", "p99", "p99.9", "max");
+    bench_hist(rate > 0 ? "latency" : "latency*", &total.latency);
+    bench_hist("service", &total.service);
+    if(rate == 0) printf("  * no -R, not corrected for coordinated omission\n");
+    printf("  %llu requests in %.2fs, %s read, %s written\n", (unsigned long long)total.requests,
+            secs, recv_size, sent_size);
+    printf("Requests/sec: %12.2f\n", total.requests / secs);
+    printf("Transfer/sec: %12s\n", recv_rate);
+    if(total.non2xx) printf("Non-2xx or 3xx responses: %llu\n", (unsigned long long)total.non2xx);
+    for(i = 1; i <= KHTTP_ERR_UNKNOWN; i++){
+        char name[32];
+        int j = 0;
+        if(total.errors[i] == 0) continue;
+        snprintf(name, sizeof(name), "%s", khttp_strerror(i));
+        for(j = 0; name[j]; j++) name[j] = toupper((unsigned char)name[j]);
+        printf("Errors KHTTP_ERR_%-10s %llu\n", name, (unsigned long long)total.errors[i]);
+    }
+    khttp_pool_cleanup();
+    free(threads);
+    return 0;
+}
@@ -1,12 +1,30 @@
+#ifdef __linux__
+// splice(), pipe2()
+#define _GNU_SOURCE
+#endif
 #include "khttp.h"
 #include "log.h"
 #include <errno.h>
 #include <time.h>
+#include <pthread.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <ctype.h>
+#include <netinet/tcp.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#endif
 
 int khttp_socket_nonblock(int fd, int enable);
 int khttp_socket_reuseaddr(int fd, int enable);
 int http_socket_sendtimeout(int fd, int timeout);
 int http_socket_recvtimeout(int fd, int timeout);
+static void khttp_race_close(khttp_ctx *ctx, int keep);
+#ifdef OPENSSL
+static khttp_tls_config *khttp_tls_config_ref(khttp_tls_config *cfg);
+#endif
 
 struct {
     char text[8];
@@ -32,33 +50,24 @@ static char base64_encoding_table[] = {'A', 'B', 'C', 'D', 'E', 'F', 'G', 'H',
                                 'o', 'p', 'q', 'r', 's', 't', 'u', 'v',
                                 'w', 'x', 'y', 'z', '0', '1', '2', '3',
                                 '4', '5', '6', '7', '8', '9', '+', '/'};
-static char *base64_decoding_table = NULL;
+// Constant so decoding needs no lazy init shared between threads
+static const unsigned char base64_decoding_table[256] = {
+    ['A'] = 0, ['B'] = 1, ['C'] = 2, ['D'] = 3, ['E'] = 4, ['F'] = 5, ['G'] = 6, ['H'] = 7,
+    ['I'] = 8, ['J'] = 9, ['K'] = 10, ['L'] = 11, ['M'] = 12, ['N'] = 13, ['O'] = 14, ['P'] = 15,
+    ['Q'] = 16, ['R'] = 17, ['S'] = 18, ['T'] = 19, ['U'] = 20, ['V'] = 21, ['W'] = 22, ['X'] = 23,
+    ['Y'] = 24, ['Z'] = 25, ['a'] = 26, ['b'] = 27, ['c'] = 28, ['d'] = 29, ['e'] = 30, ['f'] = 31,
+    ['g'] = 32, ['h'] = 33, ['i'] = 34, ['j'] = 35, ['k'] = 36, ['l'] = 37, ['m'] = 38, ['n'] = 39,
+    ['o'] = 40, ['p'] = 41, ['q'] = 42, ['r'] = 43, ['s'] = 44, ['t'] = 45, ['u'] = 46, ['v'] = 47,
+    ['w'] = 48, ['x'] = 49, ['y'] = 50, ['z'] = 51, ['0'] = 52, ['1'] = 53, ['2'] = 54, ['3'] = 55,
+    ['4'] = 56, ['5'] = 57, ['6'] = 58, ['7'] = 59, ['8'] = 60, ['9'] = 61, ['+'] = 62, ['/'] = 63
+};
 static int mod_table[] = {0, 2, 1};
 
-void build_decoding_table() {
-    if(base64_decoding_table != NULL) return;
-    base64_decoding_table = malloc(256);
-    int i;
-    for (i = 0; i < 64; i++)
-        base64_decoding_table[(unsigned char) base64_encoding_table[i]] = i;
-}
-
-void base64_cleanup() {
-    if(base64_decoding_table){
-        free(base64_decoding_table);
-        base64_decoding_table = NULL;
-    }
-}
-
-char *khttp_base64_encode(const unsigned char *data,
+// Encode into encoded_data, room for 4 * ((input_length + 2) / 3) + 1 bytes
+static void khttp_base64_encode_to(const unsigned char *data,
                     size_t input_length,
-                    size_t *output_length) {
-
-    *output_length = 4 * ((input_length + 2) / 3);
-
-    char *encoded_data = malloc(*output_length+1);
-    if (encoded_data == NULL) return NULL;
-    memset(encoded_data, 0, *output_length);
+                    char *encoded_data) {
+    size_t output_length = 4 * ((input_length + 2) / 3);
     int i,j;
     for (i = 0, j = 0; i < input_length;) {
 
@@ -75,14 +84,32 @@ char *khttp_base64_encode(const unsigned char *data,
     }
 
     for (i = 0; i < mod_table[input_length % 3]; i++)
-        encoded_data[*output_length - 1 - i] = '=';
-    encoded_data[*output_length] = '\0';
+        encoded_data[output_length - 1 - i] = '=';
+    encoded_data[output_length] = '\0';
+}
+
+char *khttp_base64_encode(const unsigned char *data,
+                    size_t input_length,
+                    size_t *output_length) {
+
+    *output_length = 4 * ((input_length + 2) / 3);
+
+    char *encoded_data = khttp_malloc(*output_length+1);
+    if (encoded_data == NULL) return NULL;
+    khttp_base64_encode_to(data, input_length, encoded_data);
+    return encoded_data;
+}
+
+// Base64 that lives until the next request, from the ctx arena
+static char *khttp_base64_arena(khttp_ctx *ctx, const unsigned char *data, size_t input_length)
+{
+    char *encoded_data = khttp_arena_alloc(&ctx->arena, 4 * ((input_length + 2) / 3) + 1);
+    if(encoded_data) khttp_base64_encode_to(data, input_length, encoded_data);
     return encoded_data;
 }
 char *khttp_base64_decode(const char *data,
                     size_t input_length,
                     size_t *output_length) {
-    if (base64_decoding_table == NULL) build_decoding_table();
     unsigned char *ptr = (unsigned char *)data;
     if (input_length % 4 != 0) return NULL;
 
@@ -90,9 +117,9 @@ char *khttp_base64_decode(const char *data,
     if (data[input_length - 1] == '=') (*output_length)--;
     if (data[input_length - 2] == '=') (*output_length)--;
 
-    char *decoded_data = malloc(*output_length + 1);
-    memset(decoded_data , 0, *output_length +1);
+    char *decoded_data = khttp_malloc(*output_length + 1);
     if (decoded_data == NULL) return NULL;
+    memset(decoded_data , 0, *output_length +1);
     int i,j;
     for (i = 0, j = 0; i < input_length;) {
 
@@ -113,17 +140,12 @@ char *khttp_base64_decode(const char *data,
     return decoded_data;
 }
 
-static size_t khttp_file_size(char *file)
+// Size of a regular file, -1 if missing or not a regular file
+static off_t khttp_file_size(char *file)
 {
-    if(!file) return -1;
-    size_t len = -1;
-    FILE *fp = fopen(file, "r");
-    if(fp){
-        fseek(fp, 0, SEEK_END);
-        len = ftell(fp);
-        fclose(fp);
-    }
-    return len;
+    struct stat st;
+    if(!file || stat(file, &st) != 0 || !S_ISREG(st.st_mode)) return -1;
+    return st.st_size;
 }
 
 static char *khttp_auth2str(int type)
@@ -135,74 +157,199 @@ static char *khttp_type2str(int type)
     return method_type[type].text;
 }
 
-int khttp_body_cb (http_parser *p, const char *buf, size_t len)
+static int khttp_body_grow(khttp_ctx *ctx, size_t need)
+{
+    // Keep one spare byte so the body is always NUL terminated
+    if(need + 1 <= ctx->body_cap) return KHTTP_ERR_OK;
+    size_t cap = ctx->body_cap ? ctx->body_cap : KHTTP_BODY_INIT;
+    while(cap < need + 1) cap = cap * 2;
+    char *body = khttp_realloc(ctx->body, cap);
+    if(!body) return -KHTTP_ERR_OOM;
+    ctx->body = body;
+    ctx->body_cap = cap;
+    return KHTTP_ERR_OK;
+}
+
+static int khttp_header_append(khttp_ctx *ctx, const char *buf, size_t len)
+{
+    if(ctx->header_len + len > ctx->header_buf_cap){
+        size_t cap = ctx->header_buf_cap ? ctx->header_buf_cap : KHTTP_HEADER_ARENA;
+        while(cap < ctx->header_len + len) cap = cap * 2;
+        char *tmp = khttp_realloc(ctx->header_buf, cap);
+        if(!tmp) return -KHTTP_ERR_OOM;
+        ctx->header_buf = tmp;
+        ctx->header_buf_cap = cap;
+    }
+    memcpy(ctx->header_buf + ctx->header_len, buf, len);
+    ctx->header_len += len;
+    return KHTTP_ERR_OK;
+}
+
+// Terminate the header being parsed. Field and value are NUL terminated.
+static int khttp_header_end(khttp_ctx *ctx)
+{
+    khttp_header *h = NULL;
+    if(ctx->header_state == KHTTP_HEADER_NONE) return KHTTP_ERR_OK;
+    h = &ctx->headers[ctx->header_count - 1];
+    if(ctx->header_state == KHTTP_HEADER_FIELD){
+        // No value callback for an empty value, point it to the last NUL
+        if(khttp_header_append(ctx, "", 1) != KHTTP_ERR_OK) return -KHTTP_ERR_OOM;
+        h->value = ctx->header_len - 1;
+    }else if(khttp_header_append(ctx, "", 1) != KHTTP_ERR_OK){
+        return -KHTTP_ERR_OOM;
+    }
+    ctx->header_state = KHTTP_HEADER_NONE;
+    return KHTTP_ERR_OK;
+}
+
+void khttp_free_header(khttp_ctx *ctx);
+
+int khttp_message_begin_cb (http_parser *p)
+{
+    khttp_ctx *ctx = p->data;
+    // Interim response (100 Continue) headers must not leak to the final one
+    khttp_free_header(ctx);
+    ctx->body_len = 0;
+    ctx->streaming = 0;
+    ctx->decoding = 0;
+    return 0;
+}
+
+int khttp_headers_complete_cb (http_parser *p)
 {
-    //LOG_DEBUG("\n");
     khttp_ctx *ctx = p->data;
-    char *head = ctx->body;
-    if(ctx->done == 1){ //Parse done copy body
-        int offset = ctx->body_len;
-        //printf("-------------%zu offset %d\n%s\n", len, offset,buf);
-        memcpy(head + offset, buf, len);
+    if(khttp_header_end(ctx) != KHTTP_ERR_OK) return -1;
+    if(p->status_code >= 200) ctx->timings.headers = khttp_now_us();
+    if(ctx->decode && p->status_code >= 200){
+        const char *enc = khttp_find_header(ctx, "Content-Encoding");
+        int ret = enc ? khttp_decode_begin(ctx, enc) : 0;
+        if(ret < 0) return -1;
+        ctx->decoding = ret;
+    }
+    // Authentication challenge answered by another round stays in ctx->body
+    if((ctx->write_cb || ctx->download_fd >= 0) && p->status_code >= 200 &&
+            !(p->status_code == 401 && ctx->count == 0 && ctx->auth_type != KHTTP_AUTH_BASIC)){
+        ctx->streaming = 1;
+        return 0;
+    }
+    // Pre-size body buffer from Content-Length to skip the realloc chain
+    if(!(p->flags & F_CHUNKED) && p->content_length != ULLONG_MAX && p->content_length > 0){
+        size_t hint = p->content_length;
+        if(hint > KHTTP_BODY_PRESIZE_MAX) hint = KHTTP_BODY_PRESIZE_MAX;
+        if(khttp_body_grow(ctx, hint) != KHTTP_ERR_OK) return -1;
     }
-    ctx->body_len += len;
-    //LOG_DEBUG("body callbacked length:%zu\n", len);
     return 0;
 }
 
+static int khttp_write_fd(int fd, const char *buf, size_t len)
+{
+    while(len > 0){
+        ssize_t n = write(fd, buf, len);
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0){
+            LOG_ERROR("khttp write download fd failure %d(%s)\n", errno, strerror(errno));
+            return -KHTTP_ERR_WRITE;
+        }
+        buf += n;
+        len -= n;
+    }
+    return KHTTP_ERR_OK;
+}
+
+// Body bytes as the caller sees them, after decoding
+static int khttp_body_deliver(khttp_ctx *ctx, const char *buf, size_t len)
+{
+    if(ctx->streaming){
+        if(ctx->download_fd >= 0 ? khttp_write_fd(ctx->download_fd, buf, len) != KHTTP_ERR_OK :
+                ctx->write_cb(buf, len, ctx->write_data) != len){
+            ctx->write_abort = 1;
+            return -KHTTP_ERR_WRITE;
+        }
+        return KHTTP_ERR_OK;
+    }
+    if(khttp_body_grow(ctx, ctx->body_len + len) != KHTTP_ERR_OK){
+        LOG_ERROR("khttp body buffer out of memory\n");
+        return -KHTTP_ERR_OOM;
+    }
+    memcpy((char *)ctx->body + ctx->body_len, buf, len);
+    ctx->body_len += len;
+    ((char *)ctx->body)[ctx->body_len] = 0;
+    return KHTTP_ERR_OK;
+}
+
+int khttp_body_cb (http_parser *p, const char *buf, size_t len)
+{
+    khttp_ctx *ctx = p->data;
+    if(ctx->decoding) return khttp_decode(ctx, buf, len, khttp_body_deliver) == KHTTP_ERR_OK ? 0 : -1;
+    return khttp_body_deliver(ctx, buf, len) == KHTTP_ERR_OK ? 0 : -1;
+}
+
 int khttp_response_status_cb (http_parser *p, const char *buf, size_t len)
 {
     //LOG_DEBUG("\n");
 #ifndef KHTTP_DEBUG
     return 0;
 #else
-    char *tmp = malloc(len + 1);
+    char *tmp = khttp_malloc(len + 1);
     if(!tmp) return 0;
     tmp[len] = 0;
     memcpy(tmp, buf, len);
     LOG_DEBUG("khttp status code %s\n", tmp);
-    free(tmp);
+    khttp_free(tmp);
     return 0;
 #endif
 }
 
 int khttp_message_complete_cb (http_parser *p)
 {
-    //LOG_DEBUG("\n");
     khttp_ctx *ctx = p->data;
+    if(ctx->decoding && khttp_decode_end(ctx) != KHTTP_ERR_OK) return -1;
     ctx->done = 1;
+    // Stop here so bytes after this message stay in the receive buffer
+    http_parser_pause(p, 1);
     return 0;
 }
 
 int khttp_header_field_cb (http_parser *p, const char *buf, size_t len)
 {
-    //LOG_DEBUG("\n");
     khttp_ctx *ctx = p->data;
-    if(ctx->done == 1){
-        char *tmp = malloc(len + 1);
-        if(!tmp) return -KHTTP_ERR_OOM;
-        tmp[len] = 0;
-        ctx->header_field[ctx->header_count] = tmp;
-        memcpy(tmp, buf, len);
-        //printf("%d header field: %s ||||| ", ctx->header_count, tmp);
+    // Field straddling two reads ends at the buffer end. Another field right
+    // after one means the previous header had an empty value.
+    int split = ctx->header_state == KHTTP_HEADER_FIELD && ctx->header_split;
+    ctx->header_split = buf + len == ctx->parse_end;
+    if(!split){
+        if(khttp_header_end(ctx) != KHTTP_ERR_OK) return -1;
+        if(ctx->header_count == ctx->header_cap){
+            int cap = ctx->header_cap ? ctx->header_cap * 2 : KHTTP_HEADER_INIT;
+            khttp_header *tmp = khttp_realloc(ctx->headers, cap * sizeof(khttp_header));
+            if(!tmp) return -1;
+            ctx->headers = tmp;
+            ctx->header_cap = cap;
+        }
+        ctx->headers[ctx->header_count].field = ctx->header_len;
+        ctx->headers[ctx->header_count].field_len = 0;
+        ctx->headers[ctx->header_count].value = 0;
+        ctx->headers[ctx->header_count].value_len = 0;
+        ctx->header_count ++;
+        ctx->header_state = KHTTP_HEADER_FIELD;
     }
-    return 0;
+    ctx->headers[ctx->header_count - 1].field_len += len;
+    return khttp_header_append(ctx, buf, len) == KHTTP_ERR_OK ? 0 : -1;
 }
 
 int khttp_header_value_cb (http_parser *p, const char *buf, size_t len)
 {
-    //LOG_DEBUG("\n");
     khttp_ctx *ctx = p->data;
-    if(ctx->done == 1){
-        char *tmp = malloc(len + 1);
-        if(!tmp) return -KHTTP_ERR_OOM;
-        tmp[len] = 0;
-        ctx->header_value[ctx->header_count] = tmp;
-        memcpy(tmp, buf, len);
-        //printf(" header value: %s\n", tmp);
-        ctx->header_count ++;
+    if(ctx->header_count == 0) return 0;
+    khttp_header *h = &ctx->headers[ctx->header_count - 1];
+    if(ctx->header_state == KHTTP_HEADER_FIELD){
+        // Terminate field, value starts right after it
+        if(khttp_header_append(ctx, "", 1) != KHTTP_ERR_OK) return -1;
+        h->value = ctx->header_len;
+        ctx->header_state = KHTTP_HEADER_VALUE;
     }
-    return 0;
+    h->value_len += len;
+    return khttp_header_append(ctx, buf, len) == KHTTP_ERR_OK ? 0 : -1;
 }
 
 void khttp_dump_header(khttp_ctx *ctx)
@@ -210,35 +357,86 @@ void khttp_dump_header(khttp_ctx *ctx)
     if(!ctx) return;
     int i = 0;
     for(i = 0; i < ctx->header_count ; i++){
-        printf("%02d %20s     %s\n", i , ctx->header_field[i], ctx->header_value[i]);
+        printf("%02d %20s     %s\n", i , ctx->header_buf + ctx->headers[i].field,
+                ctx->header_buf + ctx->headers[i].value);
     }
 }
 
-char *khttp_find_header(khttp_ctx *ctx, const char *header)
+static uint32_t khttp_header_hash(const char *name, size_t len)
+{
+    // FNV-1a on lower case name
+    uint32_t h = 2166136261u;
+    size_t i = 0;
+    for(i = 0; i < len; i++){
+        h ^= (unsigned char)tolower((unsigned char)name[i]);
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// Index headers by name, first one wins on duplicate names
+static int khttp_header_index(khttp_ctx *ctx)
 {
-    if(!ctx) return NULL;
+    int cap = 16;
     int i = 0;
-    for(i = 0; i < ctx->header_count ; i++){
-        if(strncmp(header, ctx->header_field[i], strlen(header)) == 0) {
-            //printf("match %02d %20s     %s\n", i , ctx->header_field[i], ctx->header_value[i]);
-            return ctx->header_value[i];
+    while(cap < ctx->header_count * 2) cap = cap * 2;
+    if(cap > ctx->header_hash_cap){
+        int *tmp = khttp_realloc(ctx->header_hash, cap * sizeof(int));
+        if(!tmp) return -KHTTP_ERR_OOM;
+        ctx->header_hash = tmp;
+        ctx->header_hash_cap = cap;
+    }
+    cap = ctx->header_hash_cap;
+    memset(ctx->header_hash, 0, cap * sizeof(int));
+    for(i = 0; i < ctx->header_count; i++){
+        khttp_header *h = &ctx->headers[i];
+        char *name = ctx->header_buf + h->field;
+        uint32_t slot = khttp_header_hash(name, h->field_len) & (cap - 1);
+        while(ctx->header_hash[slot]){
+            khttp_header *o = &ctx->headers[ctx->header_hash[slot] - 1];
+            if(o->field_len == h->field_len &&
+                    strncasecmp(ctx->header_buf + o->field, name, h->field_len) == 0) break;
+            slot = (slot + 1) & (cap - 1);
+        }
+        if(ctx->header_hash[slot] == 0) ctx->header_hash[slot] = i + 1;
+    }
+    ctx->header_indexed = ctx->header_count;
+    return KHTTP_ERR_OK;
+}
+
+/*
+ * Case-insensitive lookup of a response header. Returned value points into
+ * the context header arena and is valid until the next response.
+ */
+char *khttp_find_header(khttp_ctx *ctx, const char *header)
+{
+    if(!ctx || !header || ctx->header_count == 0) return NULL;
+    if(ctx->header_state != KHTTP_HEADER_NONE) return NULL;
+    if(ctx->header_indexed != ctx->header_count && khttp_header_index(ctx) != KHTTP_ERR_OK){
+        return NULL;
+    }
+    size_t len = strlen(header);
+    int mask = ctx->header_hash_cap - 1;
+    uint32_t slot = khttp_header_hash(header, len) & mask;
+    while(ctx->header_hash[slot]){
+        khttp_header *h = &ctx->headers[ctx->header_hash[slot] - 1];
+        if(h->field_len == len && strncasecmp(ctx->header_buf + h->field, header, len) == 0){
+            return ctx->header_buf + h->value;
         }
+        slot = (slot + 1) & mask;
     }
     return NULL;
 }
 
 int khttp_field_copy(char *in, char *out, int len)
 {
-    if(in == NULL || out == NULL) return -1;
+    if(in == NULL || out == NULL || len < 1) return -1;
     int i = 0;
-    for(i = 0; i < strlen(in); i ++ ){
-        if(in[i] != '"') {
-            out[i] = in[i];
-        }else{
-            out[i] = 0;
-            break;
-        }
+    // Copy up to closing quote, truncate what does not fit
+    for(i = 0; i < len - 1 && in[i] != 0 && in[i] != '"'; i ++ ){
+        out[i] = in[i];
     }
+    out[i] = 0;
     return 0;
 }
 
@@ -251,6 +449,11 @@ int khttp_parse_auth(khttp_ctx *ctx, char *value)
     char *ptr = value;
     if(strncmp(ptr, "Digest", 6) == 0){
         ctx->auth_type = KHTTP_AUTH_DIGEST;
+        // Fields missing from this challenge must not survive from the last one
+        ctx->realm[0] = 0;
+        ctx->nonce[0] = 0;
+        ctx->opaque[0] = 0;
+        ctx->qop[0] = 0;
         if((realm = strstr(ptr, "realm")) != NULL){
             realm = realm + strlen("realm:\"");
             khttp_field_copy(realm, ctx->realm, KHTTP_REALM_LEN);
@@ -274,122 +477,205 @@ int khttp_parse_auth(khttp_ctx *ctx, char *value)
     return 0;
 }
 
+// Forget headers of last response. Arena and tables are kept for reuse.
 void khttp_free_header(khttp_ctx *ctx)
 {
     if(!ctx) return;
-    int i = 0;
-    for(i = 0; i < ctx->header_count ; i++){
-        if(ctx->header_field[i]) {
-            free(ctx->header_field[i]);
-            ctx->header_field[i] = NULL;
-        }
-        if(ctx->header_value[i]) {
-            free(ctx->header_value[i]);
-            ctx->header_value[i] = NULL;
-        }
-    }
     ctx->header_count = 0;
+    ctx->header_len = 0;
+    ctx->header_indexed = 0;
+    ctx->header_state = KHTTP_HEADER_NONE;
+    ctx->header_split = 0;
 }
 
 void khttp_free_body(khttp_ctx *ctx)
 {
     if(ctx->body){
-        free(ctx->body);
+        khttp_free(ctx->body);
         ctx->body = NULL;
     }
+    ctx->body_len = 0;
+    ctx->body_cap = 0;
+    ctx->done = 0;
+}
+
+// Forget body of last response, keep a buffer of moderate size for the next one
+static void khttp_body_reset(khttp_ctx *ctx)
+{
+    if(ctx->body_cap > KHTTP_BODY_KEEP){
+        khttp_free_body(ctx);
+        return;
+    }
+    ctx->body_len = 0;
     ctx->done = 0;
 }
 
 static http_parser_settings http_parser_cb =
 {
-    .on_message_begin       = 0
+    .on_message_begin       = khttp_message_begin_cb
     ,.on_header_field       = khttp_header_field_cb
     ,.on_header_value       = khttp_header_value_cb
     ,.on_url                = 0
     ,.on_status             = khttp_response_status_cb
     ,.on_body               = khttp_body_cb
-    ,.on_headers_complete   = 0
+    ,.on_headers_complete   = khttp_headers_complete_cb
     ,.on_message_complete   = khttp_message_complete_cb
 };
 
+// Fill buf with unpredictable bytes for cnonce and boundary. Thread safe.
+static int khttp_random(unsigned char *buf, int len)
+{
+#ifdef OPENSSL
+    if(RAND_bytes(buf, len) == 1) return KHTTP_ERR_OK;
+#endif
+    FILE *fp = fopen("/dev/urandom", "r");
+    if(fp == NULL) return -KHTTP_ERR_UNKNOWN;
+    size_t n = fread(buf, 1, len, fp);
+    fclose(fp);
+    return n == (size_t)len ? KHTTP_ERR_OK : -KHTTP_ERR_UNKNOWN;
+}
+
 khttp_ctx *khttp_new()
 {
     unsigned char rands[8];
-    khttp_ctx *ctx = malloc(sizeof(khttp_ctx));
+    khttp_ctx *ctx = khttp_malloc(sizeof(khttp_ctx));
     if(!ctx){
         LOG_ERROR("khttp context create failure out of memory\n");
         return NULL;
     }
     memset(ctx, 0, sizeof(khttp_ctx));
-#ifdef KHTTP_USE_URANDOM
-    FILE *fp = fopen("/dev/urandom", "r");
-    if(fp){
-        size_t len = fread(rands, 1, 8, fp);
-        sprintf(ctx->boundary, "%02x%02x%02x%02x%02x%02x%02x%02x",
-                rands[0], rands[1], rands[2], rands[3],
-                rands[4], rands[5], rands[6], rands[7]
-                );
-        fclose(fp);
-    }else{
-#else
-    if(1){
-#endif
-        srand (time(NULL));
-        int r = rand();
-        rands[0] = r >> 24;
-        rands[1] = r >> 16;
-        rands[2] = r >> 8;
-        rands[3] = r;
-        srand(r);
-        r = rand();
-        rands[4] = r >> 24;
-        rands[5] = r >> 16;
-        rands[6] = r >> 8;
-        rands[7] = r;
-        sprintf(ctx->boundary, "%02x%02x%02x%02x%02x%02x%02x%02x",
-                rands[0], rands[1], rands[2], rands[3],
-                rands[4], rands[5], rands[6], rands[7]
-                );
-        //TODO random generate boundary
+    ctx->fd = -1;
+    ctx->race_epfd = -1;
+    ctx->form_fd = -1;
+    ctx->download_fd = -1;
+    ctx->splice_pipe[0] = -1;
+    ctx->splice_pipe[1] = -1;
+    ctx->keepalive = KHTTP_ENABLE;
+    ctx->tcp_nodelay = KHTTP_ENABLE;
+    // rand() state is process wide and racy, take the boundary from the CSPRNG
+    if(khttp_random(rands, sizeof(rands)) != KHTTP_ERR_OK){
+        uint64_t t = (uint64_t)time(NULL) ^ (uintptr_t)ctx;
+        memcpy(rands, &t, sizeof(rands));
     }
+    sprintf(ctx->boundary, "%02x%02x%02x%02x%02x%02x%02x%02x",
+            rands[0], rands[1], rands[2], rands[3],
+            rands[4], rands[5], rands[6], rands[7]
+            );
     return ctx;
 }
 
+void khttp_close(khttp_ctx *ctx);
+static void khttp_form_end(khttp_ctx *ctx);
+static void khttp_out_reset(khttp_ctx *ctx);
+
+// Drop request body set by khttp_set_post_data / form / upload
+static void khttp_req_body_free(khttp_ctx *ctx)
+{
+    if(ctx->data) {
+        khttp_free(ctx->data);
+        ctx->data = NULL;
+        ctx->data_len = 0;
+    }
+    khttp_form_end(ctx);
+    while(ctx->form) {
+        khttp_form_part *next = ctx->form->next;
+        khttp_free(ctx->form->head);
+        khttp_free(ctx->form->path);
+        khttp_free(ctx->form);
+        ctx->form = next;
+    }
+    ctx->form_tail = NULL;
+    ctx->form_len = 0;
+    khttp_free(ctx->upload);
+    ctx->upload = NULL;
+}
+
 void khttp_destroy(khttp_ctx *ctx)
 {
     if(!ctx) return;
+    if(ctx->multi) khttp_multi_remove(ctx->multi, ctx);
     khttp_free_header(ctx);
     khttp_free_body(ctx);
+    khttp_close(ctx);
 #ifdef OPENSSL
-    if(ctx->ssl){
-        SSL_set_shutdown(ctx->ssl, 2);
-        SSL_shutdown(ctx->ssl);
-        SSL_free(ctx->ssl);
-        ctx->ssl = NULL;
-        if(ctx->ssl_ctx) SSL_CTX_free(ctx->ssl_ctx);
-    }
+    khttp_tls_config_free(ctx->tls);
+    ctx->tls = NULL;
 #endif
-    if(ctx->fd > 0) close(ctx->fd);
     if(ctx->body) {
-        free(ctx->body);
+        khttp_free(ctx->body);
         ctx->body = NULL;
     }
-    if(ctx->data) {
-        free(ctx->data);
-        ctx->data = NULL;
+    khttp_req_body_free(ctx);
+    khttp_arena_free(&ctx->arena);
+    if(ctx->pending) {
+        khttp_free(ctx->pending);
+        ctx->pending = NULL;
     }
-    if(ctx->form) {
-        free(ctx->form);
-        ctx->form = NULL;
+    if(ctx->out) {
+        khttp_free(ctx->out);
+        ctx->out = NULL;
     }
+    khttp_free(ctx->req_hdr);
+    khttp_free(ctx->req_cache);
+    khttp_free(ctx->headers);
+    khttp_free(ctx->header_buf);
+    khttp_free(ctx->header_hash);
+    khttp_dns_release(ctx);
+    khttp_decode_free(ctx);
+    khttp_encode_free(ctx);
     if(ctx){
-        free(ctx);
+        khttp_free(ctx);
+    }
+}
+
+/*
+ * Make ctx ready for another request. Method, request body, extra headers,
+ * write_cb, download fd and the last response are cleared. URI, credentials
+ * with the digest challenge, TLS and socket options and all buffers are kept,
+ * a finished connection stays in the pool for the next request.
+ */
+void khttp_reset(khttp_ctx *ctx)
+{
+    if(!ctx) return;
+    if(ctx->multi) khttp_multi_remove(ctx->multi, ctx);
+    // Transfer cut in the middle leaves the connection in unknown state
+    if(ctx->state != KHTTP_STATE_INIT && ctx->state != KHTTP_STATE_DONE) khttp_close(ctx);
+    khttp_dns_release(ctx);
+    ctx->addr_count = 0;
+    ctx->addr_next = 0;
+    if(ctx->pending) {
+        khttp_free(ctx->pending);
+        ctx->pending = NULL;
+        ctx->pending_len = 0;
     }
+    khttp_free_header(ctx);
+    khttp_body_reset(ctx);
+    khttp_req_body_free(ctx);
+    khttp_clear_headers(ctx);
+    khttp_out_reset(ctx);
+    khttp_arena_reset(&ctx->arena);
+    ctx->method = KHTTP_GET;
+    ctx->write_cb = NULL;
+    ctx->write_data = NULL;
+    ctx->streaming = 0;
+    ctx->decoding = 0;
+    ctx->write_abort = 0;
+    ctx->download_fd = -1;
+    ctx->nosplice = 0;
+    ctx->expect = 0;
+    ctx->cont = 0;
+    ctx->count = 0;
+    ctx->fresh = 0;
+    ctx->rx_bytes = 0;
+    ctx->hp.status_code = 0;
+    ctx->state = KHTTP_STATE_INIT;
+    ctx->want = KHTTP_WANT_NONE;
+    ctx->result = KHTTP_ERR_OK;
 }
 
-int khttp_socket_create()
+int khttp_socket_create(int family)
 {
-    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    int fd = socket(family, SOCK_STREAM, 0);
     if(fd < 0){
         LOG_ERROR("khttp socket create failure %d(%s)\n", errno, strerror(errno));
         return fd;
@@ -412,6 +698,53 @@ int khttp_socket_nonblock(int fd, int enable)
     return ret;
 }
 
+int khttp_socket_nodelay(int fd, int enable)
+{
+    int ret = setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (const char *)&enable, sizeof(enable));
+    if(ret != 0){
+        LOG_WARN("khttp set socket nodelay failure %d(%s)\n", errno, strerror(errno));
+    }
+    return ret;
+}
+
+int khttp_socket_bufsize(int fd, int sndbuf, int rcvbuf)
+{
+    int ret = 0;
+    if(sndbuf > 0 && setsockopt(fd, SOL_SOCKET, SO_SNDBUF, (const char *)&sndbuf, sizeof(sndbuf)) != 0){
+        LOG_WARN("khttp set socket send buffer failure %d(%s)\n", errno, strerror(errno));
+        ret = -1;
+    }
+    if(rcvbuf > 0 && setsockopt(fd, SOL_SOCKET, SO_RCVBUF, (const char *)&rcvbuf, sizeof(rcvbuf)) != 0){
+        LOG_WARN("khttp set socket recv buffer failure %d(%s)\n", errno, strerror(errno));
+        ret = -1;
+    }
+    return ret;
+}
+
+int khttp_socket_keepalive(int fd, int idle, int interval, int count)
+{
+    int on = 1;
+    int ret = setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, (const char *)&on, sizeof(on));
+#ifdef TCP_KEEPIDLE
+    if(ret == 0 && idle > 0) ret = setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, (const char *)&idle, sizeof(idle));
+    if(ret == 0 && interval > 0) ret = setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, (const char *)&interval, sizeof(interval));
+    if(ret == 0 && count > 0) ret = setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, (const char *)&count, sizeof(count));
+#endif
+    if(ret != 0){
+        LOG_WARN("khttp set socket keepalive failure %d(%s)\n", errno, strerror(errno));
+    }
+    return ret;
+}
+
+// Socket options of the context, before connect so buffer sizes affect window scaling
+static void khttp_socket_setup(khttp_ctx *ctx, int fd)
+{
+    khttp_socket_nonblock(fd, 1);
+    if(ctx->tcp_nodelay) khttp_socket_nodelay(fd, 1);
+    if(ctx->sndbuf > 0 || ctx->rcvbuf > 0) khttp_socket_bufsize(fd, ctx->sndbuf, ctx->rcvbuf);
+    if(ctx->ka_idle > 0) khttp_socket_keepalive(fd, ctx->ka_idle, ctx->ka_interval, ctx->ka_count);
+}
+
 int khttp_socket_reuseaddr(int fd, int enable)
 {
     int ret = setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (const char *)&enable, sizeof(enable));
@@ -445,206 +778,562 @@ int http_socket_recvtimeout(int fd, int timeout)
     return ret;
 }
 
-int khttp_md5sum(char *input, int len, char *out)
+/*
+ * Keep-alive connection pool. Idle connections are shared process wide and
+ * looked up by scheme/host/port. A connection only goes back to the pool when
+ * its last response was read completely and the server allows keep-alive.
+ */
+typedef struct khttp_conn {
+    int                 fd;
+    int                 proto;
+    int                 port;
+    char                host[KHTTP_HOST_LEN];
+    khttp_tls_config    *tls;
+#ifdef OPENSSL
+    SSL                 *ssl;
+#endif
+    uint64_t            idle_since;
+    struct khttp_conn   *next;
+}khttp_conn;
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static khttp_conn *pool_head = NULL;
+static khttp_conn *pool_spare = NULL;                   //Recycled entries, no malloc per request
+static int pool_spare_count = 0;
+static int pool_per_host = KHTTP_POOL_PER_HOST;
+static int pool_idle_timeo = KHTTP_POOL_IDLE_TIMEO;
+
+uint64_t khttp_now_ms()
 {
-    int ret = 0, i = 0;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+uint64_t khttp_now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void khttp_conn_free(khttp_conn *conn)
+{
+    if(!conn) return;
 #ifdef OPENSSL
-    MD5_CTX ctx;
-    char buf[3] = {'\0'};
-    unsigned char md5[MD5_DIGEST_LENGTH];
-    if(input == NULL || len < 1 || out == NULL)
-        return -1;
-    MD5_Init(&ctx);
-    MD5_Update(&ctx, input, len);
-    MD5_Final(md5, &ctx);
-    out[0] = '\0';
-    for(i=0;i<MD5_DIGEST_LENGTH;i++)
-    {
-        sprintf(buf, "%02x", md5[i]);
-        strcat(out, buf);
+    if(conn->ssl){
+        SSL_set_shutdown(conn->ssl, 2);
+        SSL_shutdown(conn->ssl);
+        SSL_free(conn->ssl);
     }
-#else
-//#error "FIXME NO OPENSSL"
+    khttp_tls_config_free(conn->tls);
 #endif
-    //LOG_DEBUG("MD5:[%s]\n", out);
-    return ret;
+    if(conn->fd >= 0) close(conn->fd);
+    pthread_mutex_lock(&pool_lock);
+    if(pool_spare_count < KHTTP_POOL_SPARE){
+        conn->next = pool_spare;
+        pool_spare = conn;
+        pool_spare_count ++;
+        conn = NULL;
+    }
+    pthread_mutex_unlock(&pool_lock);
+    khttp_free(conn);
 }
 
-int khttp_set_method(khttp_ctx *ctx, int method)
+static khttp_conn *khttp_conn_new()
 {
-    if(method < KHTTP_GET || method > KHTTP_DELETE){
-        LOG_ERROR("khttp set method parameter out of range\n");
-        return -KHTTP_ERR_PARAM;
+    pthread_mutex_lock(&pool_lock);
+    khttp_conn *conn = pool_spare;
+    if(conn){
+        pool_spare = conn->next;
+        pool_spare_count --;
     }
-    ctx->method = method;
-    return KHTTP_ERR_OK;
+    pthread_mutex_unlock(&pool_lock);
+    if(conn) memset(conn, 0, sizeof(khttp_conn));
+    else conn = khttp_calloc(1, sizeof(khttp_conn));
+    return conn;
 }
-void khttp_copy_host(char *in, char *out)
+
+static void khttp_conn_free_list(khttp_conn *conn)
 {
-    int i = 0;
-    for(i=0 ; i<strlen(in) ; i++) {
-        if(in[i] == ':' || in[i] == '/' || in[i] == '\0') break;
-        out[i] = in[i];
+    while(conn){
+        khttp_conn *next = conn->next;
+        khttp_conn_free(conn);
+        conn = next;
     }
 }
 
-void khttp_dump_uri(khttp_ctx *ctx)
+static int khttp_conn_match(khttp_conn *conn, khttp_ctx *ctx)
 {
-    printf("======================\n");
-    printf("host: %s\n", ctx->host);
-    printf("port: %d\n", ctx->port);
-    printf("path: %s\n", ctx->path);
+    if(conn->proto != ctx->proto || conn->port != ctx->port) return 0;
+    if(strcasecmp(conn->host, ctx->host) != 0) return 0;
+    // Never hand out a session set up with other trust or client cert
+    if(conn->proto == KHTTP_HTTPS && conn->tls != ctx->tls) return 0;
+    return 1;
 }
 
-void khttp_dump_message_flow(char *data, int len, int way)
+static int khttp_conn_alive(khttp_conn *conn)
 {
-#ifdef KHTTP_DEBUG_SESS
-    //data[len]  = 0;
-    printf("----------------------------------------------\n");
-    if(way == 0){
-        printf("          Client   >>>    Server\n");
-    }else{
-        printf("          Server   >>>    Client\n");
-    }
-    printf("----------------------------------------------\n");
-    printf("%s\n", data);
-    printf("----------------------------------------------\n");
+    char c;
+#ifdef OPENSSL
+    if(conn->ssl && SSL_pending(conn->ssl) > 0) return 0;
 #endif
+    // Idle connection must have nothing to read. EOF or stray data is stale.
+    int ret = recv(conn->fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    if(ret >= 0) return 0;
+    return errno == EAGAIN || errno == EWOULDBLOCK;
 }
 
-int http_send(khttp_ctx *ctx, void *buf, int len, int timeout)
+// Unlink expired connections, caller hold pool_lock
+static khttp_conn *khttp_pool_expire(uint64_t now)
 {
-    struct timeval tv;
-    tv.tv_sec = timeout / 1000;
-    tv.tv_usec = (timeout % 1000 )  * 1000;
-    if(ctx->fd < 0) return -KHTTP_ERR_NO_FD;
-    int sent = 0;
-    char *head = buf;
-    do {
-        fd_set fs;
-        FD_ZERO(&fs);
-        FD_SET(ctx->fd, &fs);
-        int ret = select(ctx->fd +1, NULL, &fs, NULL, &tv);
-        if(ret >= 0){
-            // ret == 0 handle?
-            //LOG_DEBUG("send:\n%s\nfd:%d\n", head, ctx->fd);
-            ret = send(ctx->fd, head + sent, len - sent, 0);
-            if(ret > 0) {
-                sent += ret;
-            } else {
-                LOG_ERROR("khttp send error %d (%s)\n", errno, strerror(errno));
-                return -KHTTP_ERR_SEND;
-            }
+    khttp_conn *dead = NULL;
+    khttp_conn **pp = &pool_head;
+    while(*pp){
+        khttp_conn *conn = *pp;
+        if(now - conn->idle_since >= (uint64_t)pool_idle_timeo){
+            *pp = conn->next;
+            conn->next = dead;
+            dead = conn;
         }else{
-            return -KHTTP_ERR_DISCONN;
+            pp = &conn->next;
         }
-    }while(sent < len);
-    return KHTTP_ERR_OK;
+    }
+    return dead;
 }
-#ifdef OPENSSL
-int https_send(khttp_ctx *ctx, void *buf, int len, int timeout)
+
+static int khttp_pool_get(khttp_ctx *ctx)
 {
-    int sent = 0;
-    char *head = buf;
-    struct timeval tv;
-    int ret = KHTTP_ERR_OK;
-    int retry = 3;//FIXME define in header
-    tv.tv_sec = timeout / 1000;
-    tv.tv_usec = (timeout % 1000) * 1000;
-    if(ctx->fd < 0) return -KHTTP_ERR_NO_FD;
-    do {
-        fd_set fs;
-        FD_ZERO(&fs);
-        FD_SET(ctx->fd, &fs);
-        int res = select(ctx->fd + 1, NULL, &fs, NULL, &tv);
-        if(res >= 0){
-            //LOG_DEBUG("send data...\n");
-            res = SSL_write(ctx->ssl, head + sent, len - sent);
-            if(res > 0){
-                sent += res;
-            }else if(errno == -EAGAIN && retry != 0){
-                retry--;
-            }else{
-                ret = -KHTTP_ERR_SEND;
-                break;
-            }
-        }else{
-            ret = -KHTTP_ERR_DISCONN;
+    khttp_conn *conn = NULL;
+    khttp_conn *dead = NULL;
+    pthread_mutex_lock(&pool_lock);
+    dead = khttp_pool_expire(khttp_now_ms());
+    khttp_conn **pp = &pool_head;
+    while(*pp){
+        khttp_conn *curr = *pp;
+        if(!khttp_conn_match(curr, ctx)){
+            pp = &curr->next;
+            continue;
+        }
+        *pp = curr->next;
+        if(khttp_conn_alive(curr)){
+            conn = curr;
             break;
         }
-    }while(sent < len);
-    //LOG_DEBUG("send https success\n%s\n", (char *)buf);
-    return ret;
-}
+        curr->next = dead;
+        dead = curr;
+    }
+    pthread_mutex_unlock(&pool_lock);
+    khttp_conn_free_list(dead);
+    if(!conn) return 0;
+    ctx->fd = conn->fd;
+#ifdef OPENSSL
+    ctx->ssl = conn->ssl;
+    conn->ssl = NULL;
 #endif
-int http_recv(khttp_ctx *ctx, void *buf, int len, int timeout)
-{
-    int ret = KHTTP_ERR_OK;
-    struct timeval tv;
-    tv.tv_sec = timeout / 1000;
-    tv.tv_usec = (timeout % 1000)  * 1000;
-    if(ctx->fd < 0) return -KHTTP_ERR_NO_FD;
-    fd_set fs;
-    FD_ZERO(&fs);
-    FD_SET(ctx->fd, &fs);
-    ret = select(ctx->fd + 1, &fs, NULL, NULL, &tv);
-    if(ret >= 0) {
-        if(ret == 0) {
-            LOG_ERROR("khttp recv timeout\n");
-        }
-        ret = recv(ctx->fd, buf, len, 0);
-        if(ret < 0) {
-            LOG_ERROR("khttp recv error %d (%s)\n", errno, strerror(errno));
-            return -KHTTP_ERR_RECV;
-        }
+    conn->fd = -1;
+    khttp_conn_free(conn);
+    ctx->reused = 1;
+    return 1;
+}
+
+static void khttp_pool_put(khttp_ctx *ctx)
+{
+    khttp_conn *conn = khttp_conn_new();
+    if(!conn){
+        khttp_close(ctx);
+        return;
+    }
+    conn->fd = ctx->fd;
+    conn->proto = ctx->proto;
+    conn->port = ctx->port;
+    memcpy(conn->host, ctx->host, KHTTP_HOST_LEN);
+#ifdef OPENSSL
+    conn->tls = khttp_tls_config_ref(ctx->tls);
+    conn->ssl = ctx->ssl;
+    ctx->ssl = NULL;
+#endif
+    if(ctx->multi) khttp_multi_unwatch(ctx);
+    ctx->fd = -1;
+    ctx->reused = 0;
+    conn->idle_since = khttp_now_ms();
+    int count = 0;
+    pthread_mutex_lock(&pool_lock);
+    khttp_conn *dead = khttp_pool_expire(conn->idle_since);
+    khttp_conn *curr = NULL;
+    for(curr = pool_head; curr != NULL; curr = curr->next){
+        if(khttp_conn_match(curr, ctx)) count ++;
+    }
+    if(count < pool_per_host){
+        conn->next = pool_head;
+        pool_head = conn;
+        conn = NULL;
+    }
+    pthread_mutex_unlock(&pool_lock);
+    // Per host limit reached, drop this one
+    khttp_conn_free(conn);
+    khttp_conn_free_list(dead);
+}
+
+int khttp_pool_set_limit(int per_host, int idle_timeout)
+{
+    if(per_host < 0 || idle_timeout < 0) return -KHTTP_ERR_PARAM;
+    pthread_mutex_lock(&pool_lock);
+    pool_per_host = per_host;
+    pool_idle_timeo = idle_timeout;
+    pthread_mutex_unlock(&pool_lock);
+    return KHTTP_ERR_OK;
+}
+
+void khttp_pool_cleanup()
+{
+    pthread_mutex_lock(&pool_lock);
+    khttp_conn *dead = pool_head;
+    pool_head = NULL;
+    pthread_mutex_unlock(&pool_lock);
+    // Closed entries land on the spare list, release it after them
+    khttp_conn_free_list(dead);
+    pthread_mutex_lock(&pool_lock);
+    khttp_conn *spare = pool_spare;
+    pool_spare = NULL;
+    pool_spare_count = 0;
+    pthread_mutex_unlock(&pool_lock);
+    while(spare){
+        khttp_conn *next = spare->next;
+        khttp_free(spare);
+        spare = next;
+    }
+}
+
+void khttp_close(khttp_ctx *ctx)
+{
+    if(ctx->multi) khttp_multi_unwatch(ctx);
+    khttp_race_close(ctx, -1);
+#ifdef OPENSSL
+    if(ctx->ssl){
+        SSL_set_shutdown(ctx->ssl, 2);
+        SSL_shutdown(ctx->ssl);
+        SSL_free(ctx->ssl);
+        ctx->ssl = NULL;
+    }
+#endif
+    if(ctx->fd >= 0) close(ctx->fd);
+    ctx->fd = -1;
+    ctx->reused = 0;
+    // Pipe may hold bytes of an aborted splice
+    if(ctx->splice_pipe[0] >= 0){
+        close(ctx->splice_pipe[0]);
+        close(ctx->splice_pipe[1]);
+        ctx->splice_pipe[0] = -1;
+        ctx->splice_pipe[1] = -1;
+    }
+}
+
+// Hand connection to the pool if the exchange left it clean, else close it
+static void khttp_release(khttp_ctx *ctx)
+{
+    if(ctx->fd < 0) return;
+    if(ctx->keepalive == KHTTP_ENABLE && ctx->done == 1 && ctx->pending == NULL &&
+            ctx->hp.status_code >= 200 && http_should_keep_alive(&ctx->hp)){
+        khttp_pool_put(ctx);
     }else{
-        LOG_ERROR("khttp recv select error %d (%s)\n", errno, strerror(errno));
+        khttp_close(ctx);
+    }
+}
+
+/*
+ * Hand the body of the final response to cb fragment by fragment as it is
+ * parsed. ctx->body stays empty so downloads run in constant memory.
+ */
+int khttp_set_write_cb(khttp_ctx *ctx, khttp_write_cb cb, void *userdata)
+{
+    if(ctx == NULL) return -KHTTP_ERR_PARAM;
+    ctx->write_cb = cb;
+    ctx->write_data = userdata;
+    return KHTTP_ERR_OK;
+}
+
+/*
+ * Send size of the file behind fd, from its current offset, as the request
+ * body. Plain HTTP uses sendfile(), the fd is read with pread and not closed.
+ */
+int khttp_set_upload_fd(khttp_ctx *ctx, int fd)
+{
+    struct stat st;
+    if(ctx == NULL || fd < 0) return -KHTTP_ERR_PARAM;
+    off_t start = lseek(fd, 0, SEEK_CUR);
+    if(fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || start < 0 || start > st.st_size){
+        LOG_ERROR("khttp upload fd %d is not a regular file\n", fd);
+        return -KHTTP_ERR_NO_FILE;
+    }
+    if(ctx->upload == NULL && (ctx->upload = khttp_calloc(1, sizeof(khttp_form_part))) == NULL){
+        return -KHTTP_ERR_OOM;
+    }
+    ctx->upload->fd = fd;
+    ctx->upload->start = start;
+    ctx->upload->size = st.st_size - start;
+    return KHTTP_ERR_OK;
+}
+
+/*
+ * Write the body of the final response to fd. On plain HTTP a body with
+ * Content-Length is spliced from the socket through a pipe and never
+ * copied to user space. fd must be blocking, -1 turns it off.
+ */
+int khttp_set_download_fd(khttp_ctx *ctx, int fd)
+{
+    if(ctx == NULL) return -KHTTP_ERR_PARAM;
+    ctx->download_fd = fd < 0 ? -1 : fd;
+    ctx->nosplice = 0;
+    return KHTTP_ERR_OK;
+}
+
+int khttp_set_tcp_nodelay(khttp_ctx *ctx, int enable)
+{
+    if(ctx == NULL) return -KHTTP_ERR_PARAM;
+    ctx->tcp_nodelay = enable;
+    return KHTTP_ERR_OK;
+}
+
+// 0 keeps the system default
+int khttp_set_sock_buf(khttp_ctx *ctx, int sndbuf, int rcvbuf)
+{
+    if(ctx == NULL || sndbuf < 0 || rcvbuf < 0) return -KHTTP_ERR_PARAM;
+    ctx->sndbuf = sndbuf;
+    ctx->rcvbuf = rcvbuf;
+    return KHTTP_ERR_OK;
+}
+
+// TCP keepalive probes in seconds. idle 0 disables.
+int khttp_set_tcp_keepalive(khttp_ctx *ctx, int idle, int interval, int count)
+{
+    if(ctx == NULL || idle < 0 || interval < 0 || count < 0) return -KHTTP_ERR_PARAM;
+    ctx->ka_idle = idle;
+    ctx->ka_interval = interval;
+    ctx->ka_count = count;
+    return KHTTP_ERR_OK;
+}
+
+int khttp_set_keepalive(khttp_ctx *ctx, int enable)
+{
+    if(ctx == NULL) return -KHTTP_ERR_PARAM;
+    ctx->keepalive = enable ? KHTTP_ENABLE : KHTTP_DISABLE;
+    return KHTTP_ERR_OK;
+}
+
+/*
+ * Advertise Accept-Encoding and decode gzip, deflate (and br when built with
+ * KHTTP_BROTLI) responses on the fly into ctx->body, write_cb or download fd.
+ * An Accept-Encoding added by the caller is sent instead of the default.
+ */
+int khttp_set_decode(khttp_ctx *ctx, int enable)
+{
+    if(ctx == NULL) return -KHTTP_ERR_PARAM;
+    if(enable && khttp_decode_accept() == NULL) return -KHTTP_ERR_NOT_SUPP;
+    ctx->decode = enable ? 1 : 0;
+    ctx->req_cache_valid = 0;
+    return KHTTP_ERR_OK;
+}
+
+/*
+ * gzip post data and upload fd bodies of min_size bytes and up while they
+ * are sent, with chunked framing since the compressed length is not known
+ * up front. A Content-Encoding added by the caller turns it off, the body
+ * is taken as already encoded.
+ */
+int khttp_set_encode(khttp_ctx *ctx, int enable, size_t min_size)
+{
+    if(ctx == NULL) return -KHTTP_ERR_PARAM;
+    if(enable && khttp_encode_name() == NULL) return -KHTTP_ERR_NOT_SUPP;
+    ctx->encode = enable ? 1 : 0;
+    ctx->encode_min = min_size;
+    return KHTTP_ERR_OK;
+}
+
+int khttp_md5sum(char *input, int len, char *out)
+{
+    int ret = 0, i = 0;
+#ifdef OPENSSL
+    char buf[3] = {'\0'};
+    unsigned char md5[EVP_MAX_MD_SIZE];
+    if(input == NULL || len < 1 || out == NULL)
+        return -1;
+    // EVP digest works on every OpenSSL, MD5_* is deprecated since 3.0
+    if(EVP_Digest(input, len, md5, NULL, EVP_md5(), NULL) != 1)
+        return -1;
+    out[0] = '\0';
+    for(i=0;i<MD5_DIGEST_LENGTH;i++)
+    {
+        sprintf(buf, "%02x", md5[i]);
+        strcat(out, buf);
     }
+#else
+//#error "FIXME NO OPENSSL"
+#endif
+    //LOG_DEBUG("MD5:[%s]\n", out);
     return ret;
 }
+
+int khttp_set_method(khttp_ctx *ctx, int method)
+{
+    if(method < KHTTP_GET || method > KHTTP_DELETE){
+        LOG_ERROR("khttp set method parameter out of range\n");
+        return -KHTTP_ERR_PARAM;
+    }
+    ctx->method = method;
+    return KHTTP_ERR_OK;
+}
+// Host part of in up to ':' or '/', always NUL terminated in out of size bytes
+void khttp_copy_host(char *in, char *out, size_t size)
+{
+    size_t i = 0;
+    for(i = 0; i < size - 1; i++) {
+        if(in[i] == ':' || in[i] == '/' || in[i] == '\0') break;
+        out[i] = in[i];
+    }
+    out[i] = 0;
+}
+
+void khttp_dump_uri(khttp_ctx *ctx)
+{
+    printf("======================\n");
+    printf("host: %s\n", ctx->host);
+    printf("port: %d\n", ctx->port);
+    printf("path: %s\n", ctx->path);
+}
+
+void khttp_dump_message_flow(char *data, int len, int way)
+{
+#ifdef KHTTP_DEBUG_SESS
+    //data[len]  = 0;
+    printf("----------------------------------------------\n");
+    if(way == 0){
+        printf("          Client   >>>    Server\n");
+    }else{
+        printf("          Server   >>>    Client\n");
+    }
+    printf("----------------------------------------------\n");
+    printf("%.*s\n", len, data);
+    printf("----------------------------------------------\n");
+#endif
+}
+
+/*
+ * Socket primitives. All sockets are non-blocking, each call moves as many
+ * bytes as the kernel takes and returns -KHTTP_ERR_AGAIN with ctx->want set
+ * when it has to wait. recv returns 0 on orderly shutdown.
+ */
+int http_send(khttp_ctx *ctx, void *buf, int len)
+{
+    if(ctx->fd < 0) return -KHTTP_ERR_NO_FD;
+    for(;;){
+        int ret = send(ctx->fd, buf, len, MSG_NOSIGNAL);
+        if(ret >= 0) return ret;
+        if(errno == EINTR) continue;
+        if(errno == EAGAIN || errno == EWOULDBLOCK){
+            ctx->want = KHTTP_WANT_WRITE;
+            return -KHTTP_ERR_AGAIN;
+        }
+        LOG_ERROR("khttp send error %d (%s)\n", errno, strerror(errno));
+        return -KHTTP_ERR_SEND;
+    }
+}
+
+// Whole request in one sendmsg so header and body leave in the same segment
+int http_sendv(khttp_ctx *ctx, struct iovec *iov, int count)
+{
+    struct msghdr msg;
+    if(ctx->fd < 0) return -KHTTP_ERR_NO_FD;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = count;
+    for(;;){
+        int ret = sendmsg(ctx->fd, &msg, MSG_NOSIGNAL);
+        if(ret >= 0) return ret;
+        if(errno == EINTR) continue;
+        if(errno == EAGAIN || errno == EWOULDBLOCK){
+            ctx->want = KHTTP_WANT_WRITE;
+            return -KHTTP_ERR_AGAIN;
+        }
+        LOG_ERROR("khttp send error %d (%s)\n", errno, strerror(errno));
+        return -KHTTP_ERR_SEND;
+    }
+}
+
+int http_recv(khttp_ctx *ctx, void *buf, int len)
+{
+    if(ctx->fd < 0) return -KHTTP_ERR_NO_FD;
+    for(;;){
+        int ret = recv(ctx->fd, buf, len, 0);
+        if(ret >= 0) return ret;
+        if(errno == EINTR) continue;
+        if(errno == EAGAIN || errno == EWOULDBLOCK){
+            ctx->want = KHTTP_WANT_READ;
+            return -KHTTP_ERR_AGAIN;
+        }
+        LOG_ERROR("khttp recv error %d (%s)\n", errno, strerror(errno));
+        return -KHTTP_ERR_RECV;
+    }
+}
 #ifdef OPENSSL
-int https_recv(khttp_ctx *ctx, void *buf, int len, int timeout)
+// Map SSL_get_error to want flag. Return 1 if caller should wait.
+static int khttp_ssl_want(khttp_ctx *ctx, int err)
+{
+    if(err == SSL_ERROR_WANT_READ){
+        ctx->want = KHTTP_WANT_READ;
+        return 1;
+    }
+    if(err == SSL_ERROR_WANT_WRITE){
+        ctx->want = KHTTP_WANT_WRITE;
+        return 1;
+    }
+    return 0;
+}
+
+int https_send(khttp_ctx *ctx, void *buf, int len)
+{
+    if(ctx->fd < 0 || ctx->ssl == NULL) return -KHTTP_ERR_NO_FD;
+    ERR_clear_error();
+    int ret = SSL_write(ctx->ssl, buf, len);
+    if(ret > 0) return ret;
+    if(khttp_ssl_want(ctx, SSL_get_error(ctx->ssl, ret))) return -KHTTP_ERR_AGAIN;
+    LOG_ERROR("SSL_write error %d(%s)\n", errno, strerror(errno));
+    return -KHTTP_ERR_SEND;
+}
+
+/*
+ * Coalesce pieces into one TLS record. A retry after WANT_WRITE starts at
+ * the same offset, so SSL_write sees the same bytes again.
+ */
+int https_sendv(khttp_ctx *ctx, struct iovec *iov, int count)
+{
+    char buf[KHTTP_NETWORK_BUF];
+    int len = 0;
+    int i = 0;
+    if(count == 1) return https_send(ctx, iov[0].iov_base, iov[0].iov_len);
+    for(i = 0; i < count && len < KHTTP_NETWORK_BUF; i++){
+        size_t n = iov[i].iov_len;
+        if(n > KHTTP_NETWORK_BUF - len) n = KHTTP_NETWORK_BUF - len;
+        memcpy(buf + len, iov[i].iov_base, n);
+        len += n;
+    }
+    return https_send(ctx, buf, len);
+}
+
+int https_recv(khttp_ctx *ctx, void *buf, int len)
 {
     if(ctx == NULL || buf == NULL || len <= 0) return -KHTTP_ERR_PARAM;
-    int ret = KHTTP_ERR_OK;
-    int res = 0;
-    struct timeval tv;
-    tv.tv_sec = timeout / 1000;
-    tv.tv_usec = (timeout % 1000) * 1000;
-    if(SSL_pending(ctx->ssl) > 0){
-        //data available
-        res = SSL_read(ctx->ssl, buf, len);
-        if(res <= 0){
-            LOG_ERROR("SSL_read  error %d(%s)\n", errno, strerror(errno));
-            ret = -KHTTP_ERR_RECV;
-            goto end;
-        }
-        ret = res;
-    }else{
-        //data not available select socket
-        fd_set fs;
-        FD_ZERO(&fs);
-        FD_SET(ctx->fd, &fs);
-        res = select(ctx->fd + 1, &fs, NULL, NULL, &tv);
-        if(res < 0){
-            LOG_ERROR("https select error %d(%s)\n", errno, strerror(errno));
-            ret = -KHTTP_ERR_RECV;
-            goto end;
-        }else if(res == 0){
-            LOG_ERROR("https select timeout\n");
-            ret = -KHTTP_ERR_TIMEOUT;
-            goto end;
-        }
-        res = SSL_read(ctx->ssl, buf, len);
-        if(res <= 0){
-            LOG_ERROR("SSL_read  error %d(%s)\n", errno, strerror(errno));
-            ret = -KHTTP_ERR_RECV;
-            goto end;
-        }
-        ret = res;
-    }
-end:
-    return ret;
+    if(ctx->fd < 0 || ctx->ssl == NULL) return -KHTTP_ERR_NO_FD;
+    ERR_clear_error();
+    int ret = SSL_read(ctx->ssl, buf, len);
+    if(ret > 0) return ret;
+    int err = SSL_get_error(ctx->ssl, ret);
+    if(khttp_ssl_want(ctx, err)) return -KHTTP_ERR_AGAIN;
+    // close_notify, or plain EOF from servers that skip it
+    if(err == SSL_ERROR_ZERO_RETURN) return 0;
+    if(err == SSL_ERROR_SYSCALL && ERR_peek_error() == 0 && (ret == 0 || errno == 0)) return 0;
+    LOG_ERROR("SSL_read error %d(%s)\n", errno, strerror(errno));
+    return -KHTTP_ERR_RECV;
 }
 #endif
 int khttp_set_uri(khttp_ctx *ctx, char *uri)
@@ -662,6 +1351,7 @@ int khttp_set_uri(khttp_ctx *ctx, char *uri)
         host = head + 8;
 #ifdef OPENSSL
         ctx->send = https_send;
+        ctx->sendv = https_sendv;
         ctx->recv = https_recv;
 #else
 //#error "FIXME NO OPENSSL"
@@ -670,15 +1360,26 @@ int khttp_set_uri(khttp_ctx *ctx, char *uri)
         ctx->proto = KHTTP_HTTP;
         host = head + 7;
         ctx->send = http_send;
+        ctx->sendv = http_sendv;
         ctx->recv = http_recv;
     } else {
         ctx->proto = KHTTP_HTTP;
         host = head;
         ctx->send = http_send;
+        ctx->sendv = http_sendv;
         ctx->recv = http_recv;
     }
+    if(strcspn(host, ":/") >= KHTTP_HOST_LEN){
+        LOG_ERROR("khttp uri host too long\n");
+        return -KHTTP_ERR_PARAM;
+    }
     if((path = strchr(host, '/'))!= NULL) {
-        strncpy(ctx->path, path, KHTTP_PATH_LEN);
+        size_t len = strlen(path);
+        if(len >= KHTTP_URI_LEN){
+            LOG_ERROR("khttp uri path too long: %zu\n", len);
+            return -KHTTP_ERR_PARAM;
+        }
+        memcpy(ctx->path, path, len + 1);
     } else {
         strcpy(ctx->path, "/");
     }
@@ -694,141 +1395,445 @@ int khttp_set_uri(khttp_ctx *ctx, char *uri)
         if(ctx->proto == KHTTP_HTTPS) ctx->port = 443;
         else ctx->port = 80;
     }
-    khttp_copy_host(host, ctx->host);
+    khttp_copy_host(host, ctx->host, sizeof(ctx->host));
+    ctx->req_cache_valid = 0;
     return KHTTP_ERR_OK;
 }
 #ifdef OPENSSL
+/*
+ * Shared TLS configuration. The SSL_CTX with its CA store, certificate chain
+ * and private key is built once and shared by every context and thread that
+ * uses the same settings. Each config keeps the last client session per
+ * origin so later connections resume with an abbreviated handshake.
+ */
+typedef struct khttp_tls_sess {
+    char                    *origin;                    //host:port
+    SSL_SESSION             *sess;
+    struct khttp_tls_sess   *next;
+}khttp_tls_sess;
+
+struct khttp_tls_config {
+    int                     ref;
+    int                     ssl_method;
+    int                     pass_serv_auth;
+    char                    cert_path[KHTTP_PATH_LEN];
+    char                    key_path[KHTTP_PATH_LEN];
+    char                    key_pass[KHTTP_PASS_LEN];
+    SSL_CTX                 *ssl_ctx;
+    pthread_mutex_t         lock;
+    khttp_tls_sess          *sess;
+    int                     sess_count;
+    struct khttp_tls_config *next;                      //Shared config registry
+};
+
+static pthread_once_t ssl_once = PTHREAD_ONCE_INIT;
+static int ssl_origin_idx = -1;
+static pthread_mutex_t tls_lock = PTHREAD_MUTEX_INITIALIZER;
+static khttp_tls_config *tls_head = NULL;
+
+static void khttp_ssl_origin_free(void *parent, void *ptr, CRYPTO_EX_DATA *ad,
+        int idx, long argl, void *argp)
+{
+    khttp_free(ptr);
+}
+
+static void khttp_ssl_init(void)
+{
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+    SSL_load_error_strings();
+    SSL_library_init();
+#else
+    OPENSSL_init_ssl(OPENSSL_INIT_LOAD_SSL_STRINGS | OPENSSL_INIT_LOAD_CRYPTO_STRINGS, NULL);
+#endif
+    ssl_origin_idx = SSL_get_ex_new_index(0, NULL, NULL, NULL, khttp_ssl_origin_free);
+}
+
 static int ssl_ca_verify_cb(int ok, X509_STORE_CTX *store)
 {
-    int depth, err;
     X509 *cert = NULL;
     char data[KHTTP_SSL_DATA_LEN];
     if(!ok) {
         cert = X509_STORE_CTX_get_current_cert(store);
-        depth = X509_STORE_CTX_get_error_depth(store);
-        err = X509_STORE_CTX_get_error(store);
-        LOG_DEBUG("Error with certificate at depth: %i", depth);
+        // Computed in the arguments, compiled out with LOG_DEBUG
+        LOG_DEBUG("Error with certificate at depth: %i", X509_STORE_CTX_get_error_depth(store));
         X509_NAME_oneline(X509_get_issuer_name(cert), data, KHTTP_SSL_DATA_LEN);
         LOG_DEBUG(" issuer = %s", data);
         X509_NAME_oneline(X509_get_subject_name(cert), data, KHTTP_SSL_DATA_LEN);
         LOG_DEBUG(" subject = %s", data);
-        LOG_DEBUG(" err %i:%s", err, X509_verify_cert_error_string(err));
+        LOG_DEBUG(" err %i:%s", X509_STORE_CTX_get_error(store),
+                X509_verify_cert_error_string(X509_STORE_CTX_get_error(store)));
         return 0;
     }
     return ok;
 }
 
-
-int khttp_ssl_setup(khttp_ctx *ctx)
+static SSL_CTX *khttp_ssl_ctx_new(int method)
 {
-    int ret = 0;
-    SSL_load_error_strings();
-    if(SSL_library_init() != 1) {
-        LOG_ERROR("SSL library init failure\n");
-        return -KHTTP_ERR_SSL;
+    SSL_CTX *ssl_ctx = NULL;
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+    int version = 0;
+    if((ssl_ctx = SSL_CTX_new(TLS_client_method())) == NULL) {
+        LOG_ERROR("SSL setup request method failure\n");
+        return NULL;
+    }
+    if(method == KHTTP_METHOD_SSLV3){
+        version = SSL3_VERSION;
+    }else if(method == KHTTP_METHOD_TLSV1){
+        version = TLS1_VERSION;
+    }else if(method == KHTTP_METHOD_TLSV1_1){
+        version = TLS1_1_VERSION;
+    }else if(method == KHTTP_METHOD_TLSV1_2){
+        version = TLS1_2_VERSION;
     }
-    if(ctx->ssl_method == KHTTP_METHOD_SSLV2_3){
-        if( (ctx->ssl_ctx = SSL_CTX_new(SSLv23_client_method())) == NULL) {
+    // Pin the protocol version, SSLv23 negotiate the highest one
+    if(version && (SSL_CTX_set_min_proto_version(ssl_ctx, version) != 1 ||
+                SSL_CTX_set_max_proto_version(ssl_ctx, version) != 1)){
+        LOG_ERROR("SSL setup request method %d failure\n", method);
+        SSL_CTX_free(ssl_ctx);
+        return NULL;
+    }
+#else
+    if(method == KHTTP_METHOD_SSLV2_3){
+        if( (ssl_ctx = SSL_CTX_new(SSLv23_client_method())) == NULL) {
             LOG_ERROR("SSL setup request method SSLv23 failure\n");
-            return -KHTTP_ERR_SSL;
         }
-    }else if(ctx->ssl_method == KHTTP_METHOD_SSLV3){
-        if( (ctx->ssl_ctx = SSL_CTX_new(SSLv3_client_method())) == NULL) {
+    }else if(method == KHTTP_METHOD_SSLV3){
+        if( (ssl_ctx = SSL_CTX_new(SSLv3_client_method())) == NULL) {
             LOG_ERROR("SSL setup request method SSLv3 failure\n");
-            return -KHTTP_ERR_SSL;
         }
-    }else if(ctx->ssl_method == KHTTP_METHOD_TLSV1){
-        if( (ctx->ssl_ctx = SSL_CTX_new(TLSv1_client_method())) == NULL) {
+    }else if(method == KHTTP_METHOD_TLSV1){
+        if( (ssl_ctx = SSL_CTX_new(TLSv1_client_method())) == NULL) {
             LOG_ERROR("SSL setup request method TLSv1 failure\n");
-            return -KHTTP_ERR_SSL;
         }
 #ifndef __MAC__
-    }else if(ctx->ssl_method == KHTTP_METHOD_TLSV1_1){
-        if( (ctx->ssl_ctx = SSL_CTX_new(TLSv1_1_client_method())) == NULL) {
+    }else if(method == KHTTP_METHOD_TLSV1_1){
+        if( (ssl_ctx = SSL_CTX_new(TLSv1_1_client_method())) == NULL) {
             LOG_ERROR("SSL setup request method TLSv1_1 failure\n");
-            return -KHTTP_ERR_SSL;
         }
-    }else if(ctx->ssl_method == KHTTP_METHOD_TLSV1_2){
-        if( (ctx->ssl_ctx = SSL_CTX_new(TLSv1_2_client_method())) == NULL) {
+    }else if(method == KHTTP_METHOD_TLSV1_2){
+        if( (ssl_ctx = SSL_CTX_new(TLSv1_2_client_method())) == NULL) {
             LOG_ERROR("SSL setup request method TLSv1_2 failure\n");
-            return -KHTTP_ERR_SSL;
         }
 #endif
     }else{
         //Not going happen
     }
-    // Pass server auth
-    if(ctx->pass_serv_auth){
-        SSL_CTX_set_verify(ctx->ssl_ctx, SSL_VERIFY_NONE, NULL);
-    }else{
-        SSL_CTX_set_verify(ctx->ssl_ctx, SSL_VERIFY_PEER, ssl_ca_verify_cb);
-        SSL_CTX_set_verify_depth(ctx->ssl_ctx, KHTTP_SSL_DEPTH);
-        if(SSL_CTX_load_verify_locations(ctx->ssl_ctx, ctx->cert_path, NULL) != 1){
-            LOG_ERROR("khttp not able to load certificate on path: %s\n", ctx->cert_path);
+#endif
+    return ssl_ctx;
+}
+
+static void khttp_tls_sess_free(khttp_tls_sess *ts)
+{
+    SSL_SESSION_free(ts->sess);
+    khttp_free(ts->origin);
+    khttp_free(ts);
+}
+
+// Session callback. OpenSSL hand over the reference when return 1.
+static int khttp_tls_new_sess_cb(SSL *ssl, SSL_SESSION *sess)
+{
+    khttp_tls_config *cfg = SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl));
+    char *origin = SSL_get_ex_data(ssl, ssl_origin_idx);
+    if(cfg == NULL || origin == NULL) return 0;
+    khttp_tls_sess *ts = NULL;
+    khttp_tls_sess *old = NULL;
+    pthread_mutex_lock(&cfg->lock);
+    khttp_tls_sess **pp = &cfg->sess;
+    while(*pp){
+        if(strcmp((*pp)->origin, origin) == 0){
+            ts = *pp;
+            *pp = ts->next;
+            cfg->sess_count --;
+            break;
         }
+        pp = &(*pp)->next;
     }
-    SSL_CTX_set_default_passwd_cb_userdata(ctx->ssl_ctx, ctx->key_pass);
-    if(SSL_CTX_use_certificate_chain_file(ctx->ssl_ctx, ctx->cert_path) == 1) {
-        LOG_DEBUG("khttp load certificate success\n");
+    if(ts == NULL && cfg->sess_count >= KHTTP_TLS_SESS_MAX){
+        // Cache full, evict the least recently stored origin
+        for(pp = &cfg->sess; (*pp)->next; pp = &(*pp)->next);
+        old = *pp;
+        *pp = NULL;
+        cfg->sess_count --;
     }
-    if(SSL_CTX_use_PrivateKey_file(ctx->ssl_ctx, ctx->key_path, SSL_FILETYPE_PEM) == 1) {
-        LOG_DEBUG("khttp load private key success\n");
+    if(ts == NULL){
+        ts = khttp_calloc(1, sizeof(khttp_tls_sess));
+        if(ts) ts->origin = khttp_strdup(origin);
+        if(ts && ts->origin == NULL){
+            khttp_free(ts);
+            ts = NULL;
+        }
+    }else{
+        SSL_SESSION_free(ts->sess);
     }
-    if(SSL_CTX_check_private_key(ctx->ssl_ctx) == 1) {
-        LOG_DEBUG("khttp check private key success\n");
+    if(ts){
+        ts->sess = sess;
+        ts->next = cfg->sess;
+        cfg->sess = ts;
+        cfg->sess_count ++;
     }
-    if((ctx->ssl = SSL_new(ctx->ssl_ctx)) == NULL) {
-        LOG_ERROR("create SSL failure\n");
-        return -KHTTP_ERR_SSL;
+    pthread_mutex_unlock(&cfg->lock);
+    if(old) khttp_tls_sess_free(old);
+    return ts ? 1 : 0;
+}
+
+// Return a referenced session for origin or NULL
+static SSL_SESSION *khttp_tls_sess_get(khttp_tls_config *cfg, const char *origin)
+{
+    SSL_SESSION *sess = NULL;
+    khttp_tls_sess *ts = NULL;
+    pthread_mutex_lock(&cfg->lock);
+    for(ts = cfg->sess; ts != NULL; ts = ts->next){
+        if(strcmp(ts->origin, origin) == 0){
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+            if(!SSL_SESSION_is_resumable(ts->sess)) break;
+#endif
+            sess = ts->sess;
+            SSL_SESSION_up_ref(sess);
+            break;
+        }
     }
-    if((ret = SSL_set_fd(ctx->ssl, ctx->fd)) != 1) {
-        ret = SSL_get_error(ctx->ssl, ret);
-        LOG_ERROR("set SSL fd failure %d\n", ret);
-        return -KHTTP_ERR_SSL;
+    pthread_mutex_unlock(&cfg->lock);
+    return sess;
+}
+
+khttp_tls_config *khttp_tls_config_new(int method, int skip_auth, char *cert, char *key, char *pw)
+{
+    if(method < KHTTP_METHOD_SSLV2_3 || method > KHTTP_METHOD_TLSV1_2) return NULL;
+    pthread_once(&ssl_once, khttp_ssl_init);
+    khttp_tls_config *cfg = khttp_calloc(1, sizeof(khttp_tls_config));
+    if(!cfg){
+        LOG_ERROR("khttp TLS config create failure out of memory\n");
+        return NULL;
     }
-    if((ret = SSL_connect(ctx->ssl)) != 1) {
-        char error_buffer[256];
-        LOG_ERROR("SSL_connect failure %d\n", ret);
-        ret = SSL_get_error(ctx->ssl, ret);
-        if(SSL_ERROR_WANT_READ == ret){
-            return KHTTP_ERR_OK;
-        }else if(SSL_ERROR_WANT_WRITE == ret) {
-            return KHTTP_ERR_OK;
+    cfg->ref = 1;
+    cfg->ssl_method = method;
+    cfg->pass_serv_auth = skip_auth ? 1 : 0;
+    if(cert) strncpy(cfg->cert_path, cert, KHTTP_PATH_LEN - 1);
+    if(key) strncpy(cfg->key_path, key, KHTTP_PATH_LEN - 1);
+    if(pw) strncpy(cfg->key_pass, pw, KHTTP_PASS_LEN - 1);
+    pthread_mutex_init(&cfg->lock, NULL);
+    if((cfg->ssl_ctx = khttp_ssl_ctx_new(method)) == NULL){
+        pthread_mutex_destroy(&cfg->lock);
+        khttp_free(cfg);
+        return NULL;
+    }
+    // Pass server auth
+    if(cfg->pass_serv_auth){
+        SSL_CTX_set_verify(cfg->ssl_ctx, SSL_VERIFY_NONE, NULL);
+    }else{
+        SSL_CTX_set_verify(cfg->ssl_ctx, SSL_VERIFY_PEER, ssl_ca_verify_cb);
+        SSL_CTX_set_verify_depth(cfg->ssl_ctx, KHTTP_SSL_DEPTH);
+        if(cfg->cert_path[0] == 0){
+            SSL_CTX_set_default_verify_paths(cfg->ssl_ctx);
+        }else if(SSL_CTX_load_verify_locations(cfg->ssl_ctx, cfg->cert_path, NULL) != 1){
+            LOG_ERROR("khttp not able to load certificate on path: %s\n", cfg->cert_path);
         }
-        switch(ret){
-            case 0x1470E086:
-            case 0x14090086:
-                ret = SSL_get_verify_result(ctx->ssl);
-                if(ret != X509_V_OK){
-                    snprintf(error_buffer, sizeof(error_buffer),
-                            "SSL certificate problem: %s",
-                            X509_verify_cert_error_string(ret));
-                }
-            default:
-                ERR_error_string_n(ret, error_buffer, sizeof(error_buffer));
-                break;
+    }
+    SSL_CTX_set_default_passwd_cb_userdata(cfg->ssl_ctx, cfg->key_pass);
+    if(cfg->cert_path[0] && SSL_CTX_use_certificate_chain_file(cfg->ssl_ctx, cfg->cert_path) == 1) {
+        LOG_DEBUG("khttp load certificate success\n");
+    }
+    if(cfg->key_path[0] && SSL_CTX_use_PrivateKey_file(cfg->ssl_ctx, cfg->key_path, SSL_FILETYPE_PEM) == 1) {
+        LOG_DEBUG("khttp load private key success\n");
+        if(SSL_CTX_check_private_key(cfg->ssl_ctx) == 1) {
+            LOG_DEBUG("khttp check private key success\n");
         }
-        LOG_ERROR("SSL_get_error failure %d %s\n", ret, error_buffer);
-        return -KHTTP_ERR_SSL;//TODO
     }
-    //LOG_DEBUG("Connect to SSL server success\n");
-    return KHTTP_ERR_OK;
+    ERR_clear_error();
+    // Client session cache is kept per origin by khttp, not by OpenSSL
+    SSL_CTX_set_app_data(cfg->ssl_ctx, cfg);
+    SSL_CTX_set_session_cache_mode(cfg->ssl_ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(cfg->ssl_ctx, khttp_tls_new_sess_cb);
+    // Non-blocking sockets: SSL_write may be retried with the buffer advanced
+    SSL_CTX_set_mode(cfg->ssl_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    return cfg;
 }
 
-int khttp_ssl_set_method(khttp_ctx *ctx, int method)
+static khttp_tls_config *khttp_tls_config_ref(khttp_tls_config *cfg)
 {
-    if(method >= KHTTP_METHOD_SSLV2_3 && method <= KHTTP_METHOD_TLSV1_2){
-        ctx->ssl_method = method;
-    }
-    return KHTTP_ERR_OK;
+    if(cfg) __sync_add_and_fetch(&cfg->ref, 1);
+    return cfg;
 }
 
-int khttp_ssl_skip_auth(khttp_ctx *ctx)
+void khttp_tls_config_free(khttp_tls_config *cfg)
+{
+    if(!cfg) return;
+    if(__sync_sub_and_fetch(&cfg->ref, 1) != 0) return;
+    while(cfg->sess){
+        khttp_tls_sess *ts = cfg->sess;
+        cfg->sess = ts->next;
+        khttp_tls_sess_free(ts);
+    }
+    SSL_CTX_free(cfg->ssl_ctx);
+    pthread_mutex_destroy(&cfg->lock);
+    khttp_free(cfg);
+}
+
+int khttp_set_tls_config(khttp_ctx *ctx, khttp_tls_config *cfg)
+{
+    if(ctx == NULL) return -KHTTP_ERR_PARAM;
+    khttp_tls_config_ref(cfg);
+    khttp_tls_config_free(ctx->tls);
+    ctx->tls = cfg;
+    ctx->tls_user = cfg ? 1 : 0;
+    return KHTTP_ERR_OK;
+}
+
+// Find or create the shared config matching context TLS settings
+static khttp_tls_config *khttp_tls_config_lookup(khttp_ctx *ctx)
+{
+    khttp_tls_config *cfg = NULL;
+    pthread_mutex_lock(&tls_lock);
+    for(cfg = tls_head; cfg != NULL; cfg = cfg->next){
+        if(cfg->ssl_method == ctx->ssl_method &&
+                cfg->pass_serv_auth == ctx->pass_serv_auth &&
+                strcmp(cfg->cert_path, ctx->cert_path) == 0 &&
+                strcmp(cfg->key_path, ctx->key_path) == 0 &&
+                strcmp(cfg->key_pass, ctx->key_pass) == 0){
+            break;
+        }
+    }
+    if(cfg == NULL){
+        cfg = khttp_tls_config_new(ctx->ssl_method, ctx->pass_serv_auth,
+                ctx->cert_path, ctx->key_path, ctx->key_pass);
+        if(cfg){
+            cfg->next = tls_head;
+            tls_head = cfg;
+        }
+    }
+    khttp_tls_config_ref(cfg);
+    pthread_mutex_unlock(&tls_lock);
+    return cfg;
+}
+
+static int khttp_tls_attach(khttp_ctx *ctx)
+{
+    if(ctx->tls_user) return KHTTP_ERR_OK;
+    khttp_tls_config *cfg = khttp_tls_config_lookup(ctx);
+    if(cfg == NULL) return -KHTTP_ERR_SSL;
+    khttp_tls_config_free(ctx->tls);
+    ctx->tls = cfg;
+    return KHTTP_ERR_OK;
+}
+
+void khttp_tls_cleanup()
+{
+    pthread_mutex_lock(&tls_lock);
+    khttp_tls_config *cfg = tls_head;
+    tls_head = NULL;
+    pthread_mutex_unlock(&tls_lock);
+    while(cfg){
+        khttp_tls_config *next = cfg->next;
+        khttp_tls_config_free(cfg);
+        cfg = next;
+    }
+}
+
+int khttp_ssl_setup(khttp_ctx *ctx)
+{
+    int ret = 0;
+    char *origin = NULL;
+    SSL_SESSION *sess = NULL;
+    if(ctx->tls == NULL && khttp_tls_attach(ctx) != KHTTP_ERR_OK){
+        LOG_ERROR("khttp TLS config setup failure\n");
+        return -KHTTP_ERR_SSL;
+    }
+    if((ctx->ssl = SSL_new(ctx->tls->ssl_ctx)) == NULL) {
+        LOG_ERROR("create SSL failure\n");
+        return -KHTTP_ERR_SSL;
+    }
+    if((ret = SSL_set_fd(ctx->ssl, ctx->fd)) != 1) {
+        ret = SSL_get_error(ctx->ssl, ret);
+        LOG_ERROR("set SSL fd failure %d\n", ret);
+        return -KHTTP_ERR_SSL;
+    }
+    SSL_set_tlsext_host_name(ctx->ssl, ctx->host);
+#ifdef SSL_OP_ENABLE_KTLS
+    // Taken only if kernel and negotiated cipher allow, else plain TLS
+    if(ctx->ktls) SSL_set_options(ctx->ssl, SSL_OP_ENABLE_KTLS);
+#endif
+    // Tag the connection with its origin for the session callback
+    if((origin = khttp_malloc(strlen(ctx->host) + 8)) != NULL){
+        sprintf(origin, "%s:%d", ctx->host, ctx->port);
+        SSL_set_ex_data(ctx->ssl, ssl_origin_idx, origin);
+        if((sess = khttp_tls_sess_get(ctx->tls, origin)) != NULL){
+            SSL_set_session(ctx->ssl, sess);
+            SSL_SESSION_free(sess);
+        }
+    }
+    return KHTTP_ERR_OK;
+}
+
+int khttp_ssl_handshake(khttp_ctx *ctx)
+{
+    int ret = 0;
+    ERR_clear_error();
+    if((ret = SSL_connect(ctx->ssl)) != 1) {
+        char error_buffer[256];
+        ret = SSL_get_error(ctx->ssl, ret);
+        if(khttp_ssl_want(ctx, ret)){
+            return -KHTTP_ERR_AGAIN;
+        }
+        LOG_ERROR("SSL_connect failure %d\n", ret);
+        ret = ERR_peek_last_error();
+        error_buffer[0] = 0;
+        if(ERR_GET_REASON(ret) == SSL_R_CERTIFICATE_VERIFY_FAILED){
+            ret = SSL_get_verify_result(ctx->ssl);
+            snprintf(error_buffer, sizeof(error_buffer),
+                    "SSL certificate problem: %s",
+                    X509_verify_cert_error_string(ret));
+        }else{
+            ERR_error_string_n(ret, error_buffer, sizeof(error_buffer));
+        }
+        LOG_ERROR("SSL_get_error failure %d %s\n", ret, error_buffer);
+        return -KHTTP_ERR_SSL;//TODO
+    }
+    ctx->tls_resumed = SSL_session_reused(ctx->ssl);
+    //LOG_DEBUG("Connect to SSL server success\n");
+    return KHTTP_ERR_OK;
+}
+
+int khttp_ssl_set_method(khttp_ctx *ctx, int method)
+{
+    if(method >= KHTTP_METHOD_SSLV2_3 && method <= KHTTP_METHOD_TLSV1_2){
+        ctx->ssl_method = method;
+    }
+    return KHTTP_ERR_OK;
+}
+
+int khttp_ssl_skip_auth(khttp_ctx *ctx)
 {
     ctx->pass_serv_auth = 1;
     return KHTTP_ERR_OK;
 }
 
+/*
+ * Opt in to kernel TLS. OpenSSL hands the record layer to the kernel after
+ * the handshake when the tls module and cipher allow it, then file uploads
+ * go out with SSL_sendfile(). Connections fall back to user space TLS.
+ */
+int khttp_ssl_set_ktls(khttp_ctx *ctx, int enable)
+{
+    if(ctx == NULL) return -KHTTP_ERR_PARAM;
+#ifndef SSL_OP_ENABLE_KTLS
+    if(enable) return -KHTTP_ERR_NOT_SUPP;
+#endif
+    ctx->ktls = enable ? KHTTP_ENABLE : KHTTP_DISABLE;
+    return KHTTP_ERR_OK;
+}
+
+// Current connection encrypts in the kernel
+int khttp_ssl_ktls_send(khttp_ctx *ctx)
+{
+#ifdef SSL_OP_ENABLE_KTLS
+    if(ctx == NULL || ctx->ssl == NULL) return 0;
+    return BIO_get_ktls_send(SSL_get_wbio(ctx->ssl)) ? 1 : 0;
+#else
+    // OpenSSL before 3.0 has no kTLS
+    return 0;
+#endif
+}
+
 int khttp_ssl_set_cert_key(khttp_ctx *ctx, char *cert, char *key, char *pw)
 {
     if(ctx == NULL || cert == NULL || key == NULL) return -KHTTP_ERR_PARAM;
@@ -839,6 +1844,16 @@ int khttp_ssl_set_cert_key(khttp_ctx *ctx, char *cert, char *key, char *pw)
     if(pw) strncpy(ctx->key_pass, pw, KHTTP_PASS_LEN);
     return KHTTP_ERR_OK;
 }
+#else
+int khttp_ssl_set_ktls(khttp_ctx *ctx, int enable)
+{
+    return -KHTTP_ERR_NOT_SUPP;
+}
+
+int khttp_ssl_ktls_send(khttp_ctx *ctx)
+{
+    return 0;
+}
 #endif
 int khttp_set_username_password(khttp_ctx *ctx, char *username, char *password, int auth_type)
 {
@@ -856,800 +1871,1460 @@ int khttp_set_username_password(khttp_ctx *ctx, char *username, char *password,
 
 int khttp_set_post_data(khttp_ctx *ctx, char *data)
 {
-    if(ctx == NULL || data == NULL) return -KHTTP_ERR_PARAM;
-    if(ctx->data) free(ctx->data);
-    //Malloc memory from data string length. Should be protect?
-    ctx->data = malloc(strlen(data) + 1);
-    if(!ctx->data) return -KHTTP_ERR_OOM;
-    //Copy from data
-    strcpy(ctx->data, data);
+    if(data == NULL) return -KHTTP_ERR_PARAM;
+    return khttp_set_post_data_len(ctx, data, strlen(data));
+}
+
+// Request body of len bytes, may hold NUL. A copy is kept until khttp_reset.
+int khttp_set_post_data_len(khttp_ctx *ctx, const void *data, size_t len)
+{
+    if(ctx == NULL || (data == NULL && len > 0)) return -KHTTP_ERR_PARAM;
+    char *tmp = khttp_malloc(len + 1);
+    if(!tmp) return -KHTTP_ERR_OOM;
+    if(len > 0) memcpy(tmp, data, len);
+    tmp[len] = 0;
+    khttp_free(ctx->data);
+    ctx->data = tmp;
+    ctx->data_len = len;
     return KHTTP_ERR_OK;
 }
 
-int khttp_set_post_form(khttp_ctx *ctx, char *key, char *value, int type)
+// Formatted string on the heap, length in len
+static char *khttp_strdup_printf(size_t *len, const char *fmt, ...)
 {
-    if(ctx == NULL || key == NULL || value == NULL || type < KHTTP_FORM_STRING || type > KHTTP_FORM_FILE) return -KHTTP_ERR_PARAM;
-    if(type == KHTTP_FORM_STRING){
-        size_t offset = ctx->form_len;
-        ctx->form_len = ctx->form_len + 44 + strlen("Content-Disposition: form-data; name=\"\"\r\n\r\n") + 2;
-        ctx->form_len = ctx->form_len + strlen(key) + strlen(value);
-        ctx->form = realloc(ctx->form, ctx->form_len + 1);
-        if(ctx->form == NULL) return -KHTTP_ERR_OOM;
-        char *head = ctx->form + offset;
-        sprintf(head, "--------------------------%s\r\n"
-                "Content-Disposition: form-data; name=\"%s\"\r\n\r\n"
-                "%s\r\n"
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    if(n < 0) return NULL;
+    char *str = khttp_malloc(n + 1);
+    if(str == NULL) return NULL;
+    va_start(ap, fmt);
+    vsnprintf(str, n + 1, fmt, ap);
+    va_end(ap);
+    *len = n;
+    return str;
+}
+
+/*
+ * Append a form part. Only the part header is kept in memory, file bytes
+ * are read when the form is sent so upload memory does not grow with size.
+ */
+static khttp_form_part *khttp_form_add(khttp_ctx *ctx, char *key, char *filename, char *value, size_t size)
+{
+    khttp_form_part *part = khttp_calloc(1, sizeof(khttp_form_part));
+    if(part == NULL) return NULL;
+    part->fd = -1;
+    part->size = size;
+    //TODO add file type checking
+    //text/plain or application/octet-stream
+    if(filename){
+        part->head = khttp_strdup_printf(&part->head_len, "--------------------------%s\r\n"
+                "Content-Disposition: form-data; name=\"%s\"; filename=\"%s\"\r\n"
+                "Content-Type: application/octet-stream\r\n\r\n"
                 ,ctx->boundary
                 ,key
-                ,value
+                ,filename
                 );
     }else{
-        //TODO add file type checking
-        //text/plain or application/octet-stream
-        size_t offset = ctx->form_len;
-        ctx->form_len = ctx->form_len + 44 + strlen("Content-Disposition: form-data; name=\"\"; filename=\"\"\r\nContent-Type: application/octet-stream\r\n\r\n") + 2;
-        //origin size + end boundary + header + file end(\r\n)
-        size_t file_size = khttp_file_size(value);
-        if(file_size <= 0){
-            LOG_ERROR("File %s not exist\n",value);
-            return -KHTTP_ERR_NO_FILE;
-        }
-        //Calculate the latest form length
-        ctx->form_len = ctx->form_len + strlen(key) + file_size + strlen(value);
-        ctx->form = realloc(ctx->form, ctx->form_len + 1);
-        if(ctx->form == NULL) return -KHTTP_ERR_OOM;
-        //Write the next header
-        char *head = ctx->form + offset;
-        int head_len = sprintf(head, "--------------------------%s\r\n"
-                "Content-Disposition: form-data; name=\"%s\"; filename=\"%s\"\r\n"
-                "Content-Type: application/octet-stream\r\n\r\n"
+        part->head = khttp_strdup_printf(&part->head_len, "--------------------------%s\r\n"
+                "Content-Disposition: form-data; name=\"%s\"\r\n\r\n"
+                "%s"
                 ,ctx->boundary
                 ,key
                 ,value
                 );
-        head = head + head_len;//Offset header
-        FILE *fp = fopen(value, "r");
-        if(fp){
-            if(fread(head , 1, file_size, fp) != file_size){
-                LOG_ERROR("read file failure\n");
-                fclose(fp);
-                return -KHTTP_ERR_FILE_READ;
-            }
-            fclose(fp);
-        }
-        head = head + file_size;
-        head[0] = '\r';
-        head[1] = '\n';
-        head[2] = 0;
-        //LOG_DEBUG("\n%s\n", ctx->form);
     }
+    if(part->head == NULL){
+        khttp_free(part);
+        return NULL;
+    }
+    if(ctx->form_tail) ctx->form_tail->next = part;
+    else ctx->form = part;
+    ctx->form_tail = part;
+    //header + body + part end(\r\n)
+    ctx->form_len += part->head_len + size + 2;
+    return part;
+}
+
+int khttp_set_post_form(khttp_ctx *ctx, char *key, char *value, int type)
+{
+    khttp_form_part *part = NULL;
+    if(ctx == NULL || key == NULL || value == NULL || type < KHTTP_FORM_STRING || type > KHTTP_FORM_FILE) return -KHTTP_ERR_PARAM;
+    if(type == KHTTP_FORM_STRING){
+        if(khttp_form_add(ctx, key, NULL, value, 0) == NULL) return -KHTTP_ERR_OOM;
+        return KHTTP_ERR_OK;
+    }
+    off_t file_size = khttp_file_size(value);
+    if(file_size < 0){
+        LOG_ERROR("File %s not exist\n",value);
+        return -KHTTP_ERR_NO_FILE;
+    }
+    char *path = khttp_strdup(value);
+    if(path == NULL || (part = khttp_form_add(ctx, key, value, NULL, file_size)) == NULL){
+        khttp_free(path);
+        return -KHTTP_ERR_OOM;
+    }
+    part->path = path;
     return KHTTP_ERR_OK;
 }
 
-int khttp_send_http_req(khttp_ctx *ctx)
+// Upload from the current offset of fd to its end. fd is not closed.
+int khttp_set_post_form_fd(khttp_ctx *ctx, char *key, char *filename, int fd)
 {
-    char resp_str[KHTTP_RESP_LEN];
-    //FIXME change to dynamic size
-    char *req = malloc(KHTTP_REQ_SIZE);
-    if(!req) return -KHTTP_ERR_OOM;
+    struct stat st;
+    khttp_form_part *part = NULL;
+    if(ctx == NULL || key == NULL || filename == NULL || fd < 0) return -KHTTP_ERR_PARAM;
+    off_t start = lseek(fd, 0, SEEK_CUR);
+    if(fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || start < 0 || start > st.st_size){
+        LOG_ERROR("khttp form fd %d is not a regular file\n", fd);
+        return -KHTTP_ERR_NO_FILE;
+    }
+    if((part = khttp_form_add(ctx, key, filename, NULL, st.st_size - start)) == NULL) return -KHTTP_ERR_OOM;
+    part->fd = fd;
+    part->start = start;
+    return KHTTP_ERR_OK;
+}
 
-    memset(req, 0, KHTTP_REQ_SIZE);
-    int len = 0;
-    if(ctx->method == KHTTP_GET) {
-        if(ctx->auth_type == KHTTP_AUTH_BASIC){
-            len = snprintf(resp_str, KHTTP_RESP_LEN, "%s:%s", ctx->username, ctx->password);
-            size_t base64_len;
-            char *base64 = khttp_base64_encode((unsigned char *) resp_str, len, &base64_len);
-            if(!base64) return -KHTTP_ERR_OOM;
-            len = snprintf(req, KHTTP_REQ_SIZE, "GET %s HTTP/1.1\r\n"
-                "Authorization: Basic %s\r\n"
-                "User-Agent: %s\r\n"
-                "Host: %s\r\n"
-                "Accept: */*\r\n"
-                "\r\n", ctx->path, base64 ,KHTTP_USER_AGENT, ctx->host);
-            //TODO add len > KHTTP_REQ_SIZE handle
-            free(base64);
-            base64 = NULL;
-        }else{
-            len = snprintf(req, KHTTP_REQ_SIZE, "GET %s HTTP/1.1\r\n"
-                "User-Agent: %s\r\n"
-                "Host: %s\r\n"
-                "Accept: */*\r\n"
-                "\r\n", ctx->path, KHTTP_USER_AGENT, ctx->host);
-        }
-    }else if(ctx->method == KHTTP_POST){
-        if(ctx->auth_type == KHTTP_AUTH_BASIC){
-            len = snprintf(resp_str, KHTTP_RESP_LEN, "%s:%s", ctx->username, ctx->password);
-            size_t base64_len;
-            char *base64 = khttp_base64_encode((unsigned char *) resp_str, len, &base64_len);
-            if(!base64) return -KHTTP_ERR_OOM;
-            if(ctx->data){
-                len = snprintf(req, KHTTP_REQ_SIZE, "POST %s HTTP/1.1\r\n"
-                    "Authorization: Basic %s\r\n"
-                    "User-Agent: %s\r\n"
-                    "Host: %s\r\n"
-                    "Accept: */*\r\n"
-                    "Content-Length: %zu\r\n"
-                    "Content-Type: application/x-www-form-urlencoded\r\n"
-                    "\r\n", ctx->path, base64 ,KHTTP_USER_AGENT, ctx->host, strlen(ctx->data));
-            }else if(ctx->form){
-                len = snprintf(req, KHTTP_REQ_SIZE, "POST %s HTTP/1.1\r\n"
-                    "Authorization: Basic %s\r\n"
-                    "User-Agent: %s\r\n"
-                    "Host: %s\r\n"
-                    "Accept: */*\r\n"
-                    "Content-Length: %zu\r\n"
-                    "Expect: 100-continue\r\n"
-                    "Content-Type: multipart/form-data; boundary=------------------------%s\r\n"
-                    "\r\n", ctx->path, base64 ,KHTTP_USER_AGENT, ctx->host, ctx->form_len + 44, ctx->boundary);
-                //FIXME change the Content-Type to dynamic like application/x-www-form-urlencoded or application/json...
-            }else{
-                len = snprintf(req, KHTTP_REQ_SIZE, "POST %s HTTP/1.1\r\n"
-                    "Authorization: Basic %s\r\n"
-                    "User-Agent: %s\r\n"
-                    "Host: %s\r\n"
-                    "Accept: */*\r\n"
-                    "\r\n", ctx->path, base64 ,KHTTP_USER_AGENT, ctx->host);
-                //TODO add len > KHTTP_REQ_SIZE handle
-            }
-            free(base64);
-            base64 = NULL;
-        }else{
-            if(ctx->data){
-                len = snprintf(req, KHTTP_REQ_SIZE, "POST %s HTTP/1.1\r\n"
-                    "User-Agent: %s\r\n"
-                    "Host: %s\r\n"
-                    "Accept: */*\r\n"
-                    "Content-Length: %zu\r\n"
-                    "Content-Type: application/x-www-form-urlencoded\r\n"
-                    "\r\n", ctx->path, KHTTP_USER_AGENT, ctx->host, strlen(ctx->data));
-            }else if(ctx->form){
-                len = snprintf(req, KHTTP_REQ_SIZE, "POST %s HTTP/1.1\r\n"
-                    "User-Agent: %s\r\n"
-                    "Host: %s\r\n"
-                    "Accept: */*\r\n"
-                    "Content-Length: %zu\r\n"
-                    "Expect: 100-continue\r\n"
-                    "Content-Type: multipart/form-data; boundary=------------------------%s\r\n"
-                    "\r\n", ctx->path, KHTTP_USER_AGENT, ctx->host, ctx->form_len + 46, ctx->boundary);
-            }else{
-                len = snprintf(req, KHTTP_REQ_SIZE, "POST %s HTTP/1.1\r\n"
-                    "User-Agent: %s\r\n"
-                    "Host: %s\r\n"
-                    "Accept: */*\r\n"
-                    "\r\n", ctx->path, KHTTP_USER_AGENT, ctx->host);
-            }
-        }
-    }else if(ctx->method == KHTTP_PUT){
-        if(ctx->auth_type == KHTTP_AUTH_BASIC){
-            len = snprintf(resp_str, KHTTP_RESP_LEN, "%s:%s", ctx->username, ctx->password);
-            size_t base64_len;
-            char *base64 = khttp_base64_encode((unsigned char *) resp_str, len, &base64_len);
-            if(!base64) return -KHTTP_ERR_OOM;
-            if(ctx->data){
-                len = snprintf(req, KHTTP_REQ_SIZE, "PUT %s HTTP/1.1\r\n"
-                    "Authorization: Basic %s\r\n"
-                    "User-Agent: %s\r\n"
-                    "Host: %s\r\n"
-                    "Accept: */*\r\n"
-                    "Content-Length: %zu\r\n"
-                    "Content-Type: application/x-www-form-urlencoded\r\n"
-                    "\r\n", ctx->path, base64 ,KHTTP_USER_AGENT, ctx->host, strlen(ctx->data));
-            }else{
-                len = snprintf(req, KHTTP_REQ_SIZE, "PUT %s HTTP/1.1\r\n"
-                    "Authorization: Basic %s\r\n"
-                    "User-Agent: %s\r\n"
-                    "Host: %s\r\n"
-                    "Accept: */*\r\n"
-                    "\r\n", ctx->path, base64 ,KHTTP_USER_AGENT, ctx->host);
-                //TODO add len > KHTTP_REQ_SIZE handle
-            }
-            free(base64);
-            base64 = NULL;
-        }else{
-            if(ctx->data){
-                len = snprintf(req, KHTTP_REQ_SIZE, "PUT %s HTTP/1.1\r\n"
-                    "User-Agent: %s\r\n"
-                    "Host: %s\r\n"
-                    "Accept: */*\r\n"
-                    "Content-Length: %zu\r\n"
-                    "Content-Type: application/x-www-form-urlencoded\r\n"
-                    "\r\n", ctx->path, KHTTP_USER_AGENT, ctx->host, strlen(ctx->data));
-            }else{
-                len = snprintf(req, KHTTP_REQ_SIZE, "PUT %s HTTP/1.1\r\n"
-                    "User-Agent: %s\r\n"
-                    "Host: %s\r\n"
-                    "Accept: */*\r\n"
-                    "\r\n", ctx->path, KHTTP_USER_AGENT, ctx->host);
-            }
-        }
-    }else if(ctx->method == KHTTP_DELETE){
-        if(ctx->auth_type == KHTTP_AUTH_BASIC){
-            len = snprintf(resp_str, KHTTP_RESP_LEN, "%s:%s", ctx->username, ctx->password);
-            size_t base64_len;
-            char *base64 = khttp_base64_encode((unsigned char *) resp_str, len, &base64_len);
-            if(!base64) return -KHTTP_ERR_OOM;
-            if(ctx->data){
-                len = snprintf(req, KHTTP_REQ_SIZE, "DELETE %s HTTP/1.1\r\n"
-                    "Authorization: Basic %s\r\n"
-                    "User-Agent: %s\r\n"
-                    "Host: %s\r\n"
-                    "Accept: */*\r\n"
-                    "Content-Length: %zu\r\n"
-                    "Content-Type: application/x-www-form-urlencoded\r\n"
-                    "\r\n", ctx->path, base64 ,KHTTP_USER_AGENT, ctx->host, strlen(ctx->data));
-            }else{
-                len = snprintf(req, KHTTP_REQ_SIZE, "DELETE %s HTTP/1.1\r\n"
-                    "Authorization: Basic %s\r\n"
-                    "User-Agent: %s\r\n"
-                    "Host: %s\r\n"
-                    "Accept: */*\r\n"
-                    "\r\n", ctx->path, base64 ,KHTTP_USER_AGENT, ctx->host);
-                //TODO add len > KHTTP_REQ_SIZE handle
-            }
-            free(base64);
-            base64 = NULL;
-        }else{
-            if(ctx->data){
-                len = snprintf(req, KHTTP_REQ_SIZE, "DELETE %s HTTP/1.1\r\n"
-                    "User-Agent: %s\r\n"
-                    "Host: %s\r\n"
-                    "Accept: */*\r\n"
-                    "Content-Length: %zu\r\n"
-                    "Content-Type: application/x-www-form-urlencoded\r\n"
-                    "\r\n", ctx->path, KHTTP_USER_AGENT, ctx->host, strlen(ctx->data));
-            }else{
-                len = snprintf(req, KHTTP_REQ_SIZE, "DELETE %s HTTP/1.1\r\n"
-                    "User-Agent: %s\r\n"
-                    "Host: %s\r\n"
-                    "Accept: */*\r\n"
-                    "\r\n", ctx->path, KHTTP_USER_AGENT, ctx->host);
-            }
-        }
+// Upload size bytes produced by cb. cb is called again from offset 0 if the form is resent.
+int khttp_set_post_form_cb(khttp_ctx *ctx, char *key, char *filename, size_t size, khttp_read_cb cb, void *userdata)
+{
+    khttp_form_part *part = NULL;
+    if(ctx == NULL || key == NULL || filename == NULL || cb == NULL) return -KHTTP_ERR_PARAM;
+    if((part = khttp_form_add(ctx, key, filename, NULL, size)) == NULL) return -KHTTP_ERR_OOM;
+    part->read_cb = cb;
+    part->read_data = userdata;
+    return KHTTP_ERR_OK;
+}
+
+/*
+ * Request bytes are queued as a list of pieces and written by the transfer
+ * state machine, so building a request never blocks on the network. Header
+ * text is copied to ctx->out, bodies owned by ctx are referenced in place.
+ */
+static void khttp_out_reset(khttp_ctx *ctx)
+{
+    ctx->out_used = 0;
+    ctx->out_len = 0;
+    ctx->out_off = 0;
+    ctx->seg_count = 0;
+}
+
+// Make room for len more bytes at ctx->out + ctx->out_used
+static int khttp_out_reserve(khttp_ctx *ctx, size_t len)
+{
+    if(ctx->out_used + len > ctx->out_cap){
+        size_t cap = ctx->out_cap ? ctx->out_cap : KHTTP_REQ_SIZE;
+        while(cap < ctx->out_used + len) cap = cap * 2;
+        char *tmp = khttp_realloc(ctx->out, cap);
+        if(!tmp) return -KHTTP_ERR_OOM;
+        ctx->out = tmp;
+        ctx->out_cap = cap;
+    }
+    return KHTTP_ERR_OK;
+}
+
+// Queue len bytes written at ctx->out + ctx->out_used
+static int khttp_out_commit(khttp_ctx *ctx, size_t len)
+{
+    khttp_seg *last = ctx->seg_count ? &ctx->seg[ctx->seg_count - 1] : NULL;
+    if(last && last->ext == NULL && last->off + last->len == ctx->out_used){
+        last->len += len;
+    }else if(ctx->seg_count < KHTTP_OUT_SEG){
+        last = &ctx->seg[ctx->seg_count++];
+        last->ext = NULL;
+        last->off = ctx->out_used;
+        last->len = len;
     }else{
-        //TODO add DELETE and UPDATE?
+        return -KHTTP_ERR_PARAM;
     }
-    if(req){
-        khttp_dump_message_flow(req, len, 0);
-        if(ctx->send(ctx, req, len, KHTTP_SEND_TIMEO) != KHTTP_ERR_OK){
-            LOG_ERROR("khttp request send failure\n");
+    ctx->out_used += len;
+    ctx->out_len += len;
+    return KHTTP_ERR_OK;
+}
+
+static int khttp_out_append(khttp_ctx *ctx, const char *buf, size_t len)
+{
+    if(khttp_out_reserve(ctx, len) != KHTTP_ERR_OK) return -KHTTP_ERR_OOM;
+    memcpy(ctx->out + ctx->out_used, buf, len);
+    return khttp_out_commit(ctx, len);
+}
+
+// Queue caller memory without copy. Must stay valid until the request is sent.
+static int khttp_out_ref(khttp_ctx *ctx, const char *buf, size_t len)
+{
+    if(len == 0) return KHTTP_ERR_OK;
+    if(ctx->seg_count >= KHTTP_OUT_SEG) return khttp_out_append(ctx, buf, len);
+    khttp_seg *seg = &ctx->seg[ctx->seg_count++];
+    seg->ext = buf;
+    seg->off = 0;
+    seg->len = len;
+    ctx->out_len += len;
+    return KHTTP_ERR_OK;
+}
+
+// Fill iov with the unsent part of the queue
+static int khttp_out_iov(khttp_ctx *ctx, struct iovec *iov)
+{
+    size_t skip = ctx->out_off;
+    int count = 0;
+    int i = 0;
+    for(i = 0; i < ctx->seg_count; i++){
+        khttp_seg *seg = &ctx->seg[i];
+        const char *base = seg->ext ? seg->ext : ctx->out + seg->off;
+        if(skip >= seg->len){
+            skip -= seg->len;
+            continue;
         }
+        iov[count].iov_base = (void *)(base + skip);
+        iov[count].iov_len = seg->len - skip;
+        skip = 0;
+        count++;
     }
-    if(ctx->data){
-        khttp_dump_message_flow(ctx->data, len, 0);
-        if(ctx->send(ctx, ctx->data, strlen(ctx->data), KHTTP_SEND_TIMEO) != KHTTP_ERR_OK){
-            LOG_ERROR("khttp request send failure\n");
-        }
+    return count;
+}
+
+static int khttp_out_printf(khttp_ctx *ctx, const char *fmt, ...)
+{
+    va_list ap;
+    char buf[256];
+    va_start(ap, fmt);
+    int len = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    if(len < 0) return -KHTTP_ERR_PARAM;
+    if(len < sizeof(buf)) return khttp_out_append(ctx, buf, len);
+    char *tmp = khttp_arena_alloc(&ctx->arena, len + 1);
+    if(!tmp) return -KHTTP_ERR_OOM;
+    va_start(ap, fmt);
+    vsnprintf(tmp, len + 1, fmt, ap);
+    va_end(ap);
+    return khttp_out_append(ctx, tmp, len);
+}
+
+static int khttp_has_header(khttp_ctx *ctx, const char *name)
+{
+    size_t len = strlen(name);
+    char *ptr = ctx->req_hdr;
+    while(ptr && *ptr){
+        if(strncasecmp(ptr, name, len) == 0 && ptr[len] == ':') return 1;
+        ptr = strstr(ptr, "\r\n");
+        if(ptr) ptr += 2;
     }
-    free(req);
     return 0;
 }
-int khttp_send_form(khttp_ctx *ctx)
+
+/*
+ * Headers that only change with the target or khttp_add_header(). Kept
+ * serialized in ctx->req_cache so every request copies them in one piece.
+ */
+static int khttp_build_cache(khttp_ctx *ctx)
 {
-    if(ctx->form){
-        //LOG_DEBUG("length: %lu\n%s",ctx->form_len, ctx->form);
-        if(ctx->send(ctx, ctx->form, ctx->form_len, KHTTP_SEND_TIMEO) != KHTTP_ERR_OK){
-            LOG_ERROR("khttp request send failure\n");
+    char port[16] = "";
+    int def = ctx->proto == KHTTP_HTTPS ? KHTTP_HTTPS_PORT : KHTTP_HTTP_PORT;
+    if(ctx->req_cache_valid) return KHTTP_ERR_OK;
+    if(ctx->port != def) snprintf(port, sizeof(port), ":%d", ctx->port);
+    const char *ua = khttp_has_header(ctx, "User-Agent") ? "" : "User-Agent: " KHTTP_USER_AGENT "\r\n";
+    const char *accept = khttp_has_header(ctx, "Accept") ? "" : "Accept: */*\r\n";
+    const char *enc = ctx->decode && !khttp_has_header(ctx, "Accept-Encoding") ? khttp_decode_accept() : NULL;
+    const char *user = ctx->req_hdr ? ctx->req_hdr : "";
+    size_t len = strlen(ua) + strlen(ctx->host) + strlen(port) + strlen(accept) + strlen(user) + 48;
+    char *tmp = khttp_realloc(ctx->req_cache, len);
+    if(!tmp) return -KHTTP_ERR_OOM;
+    ctx->req_cache = tmp;
+    ctx->req_cache_len = snprintf(ctx->req_cache, len, "%sHost: %s%s\r\n%s%s%s%s%s", ua, ctx->host, port, accept,
+            enc ? "Accept-Encoding: " : "", enc ? enc : "", enc ? "\r\n" : "", user);
+    ctx->req_cache_valid = 1;
+    return KHTTP_ERR_OK;
+}
+
+/*
+ * Digest credential cache. The last challenge of each scheme/host/port and
+ * user is shared process wide so later requests answer it up front instead
+ * of paying a 401 round trip. Passwords and HA1 are never stored.
+ */
+typedef struct khttp_auth {
+    int                 proto;
+    int                 port;
+    char                *host;
+    char                username[KHTTP_USER_LEN];
+    char                realm[KHTTP_REALM_LEN];
+    char                nonce[KHTTP_NONCE_LEN];
+    char                opaque[KHTTP_OPAQUE_LEN];
+    char                qop[KHTTP_QOP_LEN];
+    uint32_t            nc;                             //Last nonce-count sent with nonce
+    struct khttp_auth   *next;
+}khttp_auth;
+
+static pthread_mutex_t auth_lock = PTHREAD_MUTEX_INITIALIZER;
+static khttp_auth *auth_head = NULL;                   //Most recently used first
+
+// Caller hold auth_lock. Found entry is moved to the front.
+static khttp_auth *khttp_auth_find(khttp_ctx *ctx)
+{
+    khttp_auth **pp = &auth_head;
+    while(*pp){
+        khttp_auth *a = *pp;
+        if(a->proto == ctx->proto && a->port == ctx->port &&
+                strcasecmp(a->host, ctx->host) == 0 &&
+                strcmp(a->username, ctx->username) == 0){
+            *pp = a->next;
+            a->next = auth_head;
+            auth_head = a;
+            return a;
         }
-        char buf[47];
-        memset(buf, 0, 47);
-        snprintf(buf, 47,"--------------------------%s--\r\n", ctx->boundary);
-        if(ctx->send(ctx, buf, 46, KHTTP_SEND_TIMEO) != KHTTP_ERR_OK){
-            LOG_ERROR("khttp request send failure\n");
+        pp = &a->next;
+    }
+    return NULL;
+}
+
+// Remember the challenge just parsed into ctx
+static void khttp_auth_cache_store(khttp_ctx *ctx)
+{
+    khttp_auth *a = NULL;
+    khttp_auth *dead = NULL;
+    int count = 0;
+    pthread_mutex_lock(&auth_lock);
+    if((a = khttp_auth_find(ctx)) == NULL){
+        if((a = khttp_calloc(1, sizeof(khttp_auth))) == NULL ||
+                (a->host = khttp_strdup(ctx->host)) == NULL){
+            pthread_mutex_unlock(&auth_lock);
+            khttp_free(a);
+            return;
         }
+        a->proto = ctx->proto;
+        a->port = ctx->port;
+        snprintf(a->username, KHTTP_USER_LEN, "%s", ctx->username);
+        a->next = auth_head;
+        auth_head = a;
+        // Drop the least recently used entry past the limit
+        khttp_auth *curr = auth_head;
+        for(count = 1; curr->next; curr = curr->next, count++){
+            if(count == KHTTP_AUTH_CACHE_MAX){
+                dead = curr->next;
+                curr->next = NULL;
+                break;
+            }
+        }
+    }
+    // Nonce-count restarts only with a new nonce, a reused nonce must not replay
+    if(strcmp(a->nonce, ctx->nonce) != 0) a->nc = 0;
+    memcpy(a->realm, ctx->realm, KHTTP_REALM_LEN);
+    memcpy(a->nonce, ctx->nonce, KHTTP_NONCE_LEN);
+    memcpy(a->opaque, ctx->opaque, KHTTP_OPAQUE_LEN);
+    memcpy(a->qop, ctx->qop, KHTTP_QOP_LEN);
+    pthread_mutex_unlock(&auth_lock);
+    while(dead){
+        khttp_auth *next = dead->next;
+        khttp_free(dead->host);
+        khttp_free(dead);
+        dead = next;
+    }
+}
+
+// Load cached challenge into ctx and reserve the next nonce-count
+static int khttp_auth_cache_load(khttp_ctx *ctx, uint32_t *nc)
+{
+    khttp_auth *a = NULL;
+    pthread_mutex_lock(&auth_lock);
+    if((a = khttp_auth_find(ctx)) != NULL){
+        memcpy(ctx->realm, a->realm, KHTTP_REALM_LEN);
+        memcpy(ctx->nonce, a->nonce, KHTTP_NONCE_LEN);
+        memcpy(ctx->opaque, a->opaque, KHTTP_OPAQUE_LEN);
+        memcpy(ctx->qop, a->qop, KHTTP_QOP_LEN);
+        *nc = ++a->nc;
+    }
+    pthread_mutex_unlock(&auth_lock);
+    return a != NULL;
+}
+
+// Credentials were refused, stop sending them up front
+static void khttp_auth_cache_drop(khttp_ctx *ctx)
+{
+    khttp_auth *a = NULL;
+    pthread_mutex_lock(&auth_lock);
+    if((a = khttp_auth_find(ctx)) != NULL) auth_head = a->next;
+    pthread_mutex_unlock(&auth_lock);
+    if(a){
+        khttp_free(a->host);
+        khttp_free(a);
+    }
+}
+
+void khttp_auth_cleanup()
+{
+    pthread_mutex_lock(&auth_lock);
+    khttp_auth *a = auth_head;
+    auth_head = NULL;
+    pthread_mutex_unlock(&auth_lock);
+    while(a){
+        khttp_auth *next = a->next;
+        khttp_free(a->host);
+        khttp_free(a);
+        a = next;
     }
-    return -KHTTP_ERR_OK;
 }
-int khttp_send_http_auth(khttp_ctx *ctx)
+
+static int khttp_build_auth(khttp_ctx *ctx)
 {
+    char resp_str[KHTTP_RESP_LEN];
     char ha1[KHTTP_NONCE_LEN];
     char ha2[KHTTP_NONCE_LEN];
-    char resp_str[KHTTP_RESP_LEN];
     char response[KHTTP_NONCE_LEN];
     char cnonce[KHTTP_CNONCE_LEN];
-    char *req = malloc(KHTTP_REQ_SIZE);
-    if(!req) return -KHTTP_ERR_OOM;
-    char *cnonce_b64 = NULL;
-    char path[KHTTP_PATH_LEN + 8];
+    char nc_str[9];
+    char path[KHTTP_URI_LEN + 16];
+    unsigned char rands[16];
+    char *b64 = NULL;
+    uint32_t nc = 1;
+    int ret = KHTTP_ERR_OK;
     int len = 0;
-    if (ctx->auth_type == KHTTP_AUTH_DIGEST){
-        //HA1
-        len = snprintf(resp_str, KHTTP_CNONCE_LEN, "%s:%s:%s", ctx->username, ctx->realm, ctx->password);
-        memset(ha1, 0, KHTTP_NONCE_LEN);
-        khttp_md5sum(resp_str, len, ha1);
-        //HA2
-        len = snprintf(path, KHTTP_PATH_LEN + 8, "%s:%s", khttp_type2str(ctx->method), ctx->path);
-        memset(ha2, 0, KHTTP_NONCE_LEN);
-        khttp_md5sum(path, len, ha2);
-        //cnonce
-        //TODO add random rule generate cnonce
-        khttp_md5sum(cnonce, strlen(cnonce), cnonce);
-        size_t cnonce_b64_len;
-        cnonce_b64 = khttp_base64_encode((unsigned char *) cnonce, 32, &cnonce_b64_len);
-        //response
-        if(strcmp(ctx->qop, "auth") == 0){
-            //FIXME dynamic generate nonceCount "00000001"
-            len = snprintf(resp_str, KHTTP_RESP_LEN, "%s:%s:%s:%s:%s:%s", ha1, ctx->nonce, "00000001", cnonce_b64, ctx->qop, ha2);
-            khttp_md5sum(resp_str, len, response);
-        }else{
-            len = snprintf(resp_str, KHTTP_RESP_LEN, "%s:%s:%s", ha1, ctx->nonce, ha2);
-            khttp_md5sum(resp_str, len, response);
-        }
-    }else if(ctx->auth_type == KHTTP_AUTH_BASIC){
+    int i = 0;
+    if(ctx->auth_type == KHTTP_AUTH_BASIC){
         len = snprintf(resp_str, KHTTP_RESP_LEN, "%s:%s", ctx->username, ctx->password);
-        size_t cnonce_b64_len;
-        cnonce_b64 = khttp_base64_encode((unsigned char *) resp_str, len, &cnonce_b64_len);
-    }
-    if(ctx->method == KHTTP_GET) {
-        if(ctx->auth_type == KHTTP_AUTH_DIGEST){//Digest auth
-            len = snprintf(req, KHTTP_REQ_SIZE,
-                "GET %s HTTP/1.1\r\n"
-                "Authorization: %s username=\"%s\", realm=\"%s\", "
-                "nonce=\"%s\", uri=\"%s\", "
-                "cnonce=\"%s\", nc=00000001, qop=%s, "
-                "response=\"%s\"\r\n"
-                "User-Agent: %s\r\n"
-                "Host: %s:%d\r\n"
-                "Accept: */*\r\n\r\n",
-                ctx->path,
-                khttp_auth2str(ctx->auth_type), ctx->username, ctx->realm,
-                ctx->nonce, ctx->path,
-                cnonce_b64, ctx->qop,
-                response,
-                KHTTP_USER_AGENT,
-                ctx->host, ctx->port
-                );
-        }else{//Basic auth
-            len = snprintf(req, KHTTP_REQ_SIZE,
-                "GET %s HTTP/1.1\r\n"
-                "Authorization: %s %s\r\n"
-                "User-Agent: %s\r\n"
-                "Host: %s:%d\r\n"
-                "Accept: */*\r\n\r\n",
-                ctx->path,
-                khttp_auth2str(ctx->auth_type), cnonce_b64,
-                KHTTP_USER_AGENT,
-                ctx->host, ctx->port
-                );
+        if((b64 = khttp_base64_arena(ctx, (unsigned char *) resp_str, len)) == NULL){
+            return -KHTTP_ERR_OOM;
         }
-    }else if(ctx->method == KHTTP_POST){
-        if(ctx->auth_type == KHTTP_AUTH_DIGEST){//Digest auth
-            if(ctx->data){
-                len = snprintf(req, KHTTP_REQ_SIZE,
-                    "POST %s HTTP/1.1\r\n"
-                    "Authorization: %s username=\"%s\", realm=\"%s\", "
-                    "nonce=\"%s\", uri=\"%s\", "
-                    "cnonce=\"%s\", nc=00000001, qop=%s, "
-                    "response=\"%s\"\r\n"
-                    "User-Agent: %s\r\n"
-                    "Host: %s:%d\r\n"
-                    "Accept: */*\r\n"
-                    "Content-Length: %zu\r\n"
-                    "Content-Type: application/x-www-form-urlencoded\r\n"
-                    "\r\n",
-                    ctx->path,
-                    khttp_auth2str(ctx->auth_type), ctx->username, ctx->realm,
-                    ctx->nonce, ctx->path,
-                    cnonce_b64, ctx->qop,
-                    response,
-                    KHTTP_USER_AGENT,
-                    ctx->host, ctx->port,
-                    strlen(ctx->data)
-                    );
-            }else{
-                len = snprintf(req, KHTTP_REQ_SIZE,
-                    "POST %s HTTP/1.1\r\n"
-                    "Authorization: %s username=\"%s\", realm=\"%s\", "
-                    "nonce=\"%s\", uri=\"%s\", "
-                    "cnonce=\"%s\", nc=00000001, qop=%s, "
-                    "response=\"%s\"\r\n"
-                    "User-Agent: %s\r\n"
-                    "Host: %s:%d\r\n"
-                    "Accept: */*\r\n\r\n",
-                    ctx->path,
-                    khttp_auth2str(ctx->auth_type), ctx->username, ctx->realm,
-                    ctx->nonce, ctx->path,
-                    cnonce_b64, ctx->qop,
-                    response,
-                    KHTTP_USER_AGENT,
-                    ctx->host, ctx->port
-                    );
+        return khttp_out_printf(ctx, "Authorization: Basic %s\r\n", b64);
+    }
+    if(ctx->auth_type != KHTTP_AUTH_DIGEST) return KHTTP_ERR_OK;
+    // Answer the 401 just parsed, or the cached challenge before any 401
+    if(ctx->count > 0) khttp_auth_cache_store(ctx);
+    if(!khttp_auth_cache_load(ctx, &nc)){
+        if(ctx->count == 0) return KHTTP_ERR_OK;
+        nc = 1;
+    }
+    snprintf(nc_str, sizeof(nc_str), "%08x", nc);
+    //HA1
+    len = snprintf(resp_str, KHTTP_CNONCE_LEN, "%s:%s:%s", ctx->username, ctx->realm, ctx->password);
+    memset(ha1, 0, KHTTP_NONCE_LEN);
+    khttp_md5sum(resp_str, len, ha1);
+    //HA2
+    len = snprintf(path, sizeof(path), "%s:%s", khttp_type2str(ctx->method), ctx->path);
+    memset(ha2, 0, KHTTP_NONCE_LEN);
+    khttp_md5sum(path, len, ha2);
+    //cnonce
+    if(khttp_random(rands, sizeof(rands)) != KHTTP_ERR_OK){
+        LOG_ERROR("khttp generate cnonce failure\n");
+        return -KHTTP_ERR_UNKNOWN;
+    }
+    for(i = 0; i < sizeof(rands); i++){
+        sprintf(cnonce + i * 2, "%02x", rands[i]);
+    }
+    if((b64 = khttp_base64_arena(ctx, (unsigned char *) cnonce, 32)) == NULL){
+        return -KHTTP_ERR_OOM;
+    }
+    //response
+    if(strcmp(ctx->qop, "auth") == 0){
+        len = snprintf(resp_str, KHTTP_RESP_LEN, "%s:%s:%s:%s:%s:%s", ha1, ctx->nonce, nc_str, b64, ctx->qop, ha2);
+        khttp_md5sum(resp_str, len, response);
+    }else{
+        len = snprintf(resp_str, KHTTP_RESP_LEN, "%s:%s:%s", ha1, ctx->nonce, ha2);
+        khttp_md5sum(resp_str, len, response);
+    }
+    ret = khttp_out_printf(ctx,
+            "Authorization: %s username=\"%s\", realm=\"%s\", "
+            "nonce=\"%s\", uri=\"%s\", "
+            "cnonce=\"%s\", nc=%s, qop=%s, "
+            "response=\"%s\"",
+            khttp_auth2str(ctx->auth_type), ctx->username, ctx->realm,
+            ctx->nonce, ctx->path,
+            b64, nc_str, ctx->qop,
+            response);
+    if(ret == KHTTP_ERR_OK && ctx->opaque[0]){
+        ret = khttp_out_printf(ctx, ", opaque=\"%s\"", ctx->opaque);
+    }
+    if(ret == KHTTP_ERR_OK) ret = khttp_out_append(ctx, "\r\n", 2);
+    return ret;
+}
+
+/*
+ * Serialize the request: request line, authorization, cached constant
+ * headers, body framing. Post data is queued by reference after the header,
+ * a form waits for 100 Continue and is queued by khttp_build_form().
+ */
+int khttp_build_request(khttp_ctx *ctx)
+{
+    int ret = KHTTP_ERR_OK;
+    if((ret = khttp_build_cache(ctx)) != KHTTP_ERR_OK) return ret;
+    khttp_form_end(ctx);
+    khttp_out_reset(ctx);
+    ret = khttp_out_printf(ctx, "%s %s HTTP/1.1\r\n", khttp_type2str(ctx->method), ctx->path);
+    if(ret == KHTTP_ERR_OK) ret = khttp_build_auth(ctx);
+    if(ret == KHTTP_ERR_OK) ret = khttp_out_append(ctx, ctx->req_cache, ctx->req_cache_len);
+    if(ret != KHTTP_ERR_OK) return ret;
+    size_t body_len = ctx->data ? ctx->data_len : ctx->upload ? ctx->upload->size : 0;
+    ctx->encoding = ctx->encode && (ctx->data || ctx->upload) && body_len >= ctx->encode_min &&
+        !khttp_has_header(ctx, "Content-Encoding");
+    if(ctx->encoding && (ret = khttp_encode_begin(ctx)) != KHTTP_ERR_OK) return ret;
+    if(ctx->encoding){
+        ret = khttp_out_printf(ctx, "Transfer-Encoding: chunked\r\nContent-Encoding: %s\r\n%s\r\n", khttp_encode_name(),
+                khttp_has_header(ctx, "Content-Type") ? "" : ctx->data ?
+                "Content-Type: application/x-www-form-urlencoded\r\n" : "Content-Type: application/octet-stream\r\n");
+    }else if(ctx->data){
+        ret = khttp_out_printf(ctx, "Content-Length: %zu\r\n%s\r\n", ctx->data_len,
+                khttp_has_header(ctx, "Content-Type") ? "" : "Content-Type: application/x-www-form-urlencoded\r\n");
+    }else if(ctx->upload){
+        ret = khttp_out_printf(ctx, "Content-Length: %zu\r\n%s\r\n", ctx->upload->size,
+                khttp_has_header(ctx, "Content-Type") ? "" : "Content-Type: application/octet-stream\r\n");
+    }else if(ctx->form){
+        //FIXME change the Content-Type to dynamic like application/x-www-form-urlencoded or application/json...
+        ret = khttp_out_printf(ctx, "Content-Length: %zu\r\n"
+                "Expect: 100-continue\r\n"
+                "Content-Type: multipart/form-data; boundary=------------------------%s\r\n"
+                "\r\n", ctx->form_len + 46, ctx->boundary);
+    }else{
+        ret = khttp_out_append(ctx, "\r\n", 2);
+    }
+    if(ret != KHTTP_ERR_OK) return ret;
+    khttp_dump_message_flow(ctx->out, ctx->out_used, 0);
+    if(ctx->encoding){
+        // Compressed body follows the header, streamed by khttp_encode_next()
+        ctx->form_stream = 1;
+        ctx->form_off = 0;
+    }else if(ctx->data){
+        khttp_dump_message_flow(ctx->data, ctx->data_len, 0);
+        ret = khttp_out_ref(ctx, ctx->data, ctx->data_len);
+    }else if(ctx->upload){
+        // Upload body follows the header, streamed by khttp_form_next()
+        ctx->form_stream = 1;
+        ctx->form_raw = 1;
+        ctx->form_cur = ctx->upload;
+        ctx->form_stage = KHTTP_PART_HEAD;
+        ctx->form_off = 0;
+    }
+    ctx->expect = ctx->form != NULL && ctx->data == NULL && ctx->upload == NULL;
+    return ret;
+}
+
+int khttp_add_header(khttp_ctx *ctx, const char *name, const char *value)
+{
+    if(ctx == NULL || name == NULL || value == NULL || name[0] == 0) return -KHTTP_ERR_PARAM;
+    // Refuse header injection
+    if(strpbrk(name, "\r\n:") || strpbrk(value, "\r\n")) return -KHTTP_ERR_PARAM;
+    size_t old = ctx->req_hdr ? strlen(ctx->req_hdr) : 0;
+    size_t len = strlen(name) + strlen(value) + 5;
+    char *tmp = khttp_realloc(ctx->req_hdr, old + len);
+    if(!tmp) return -KHTTP_ERR_OOM;
+    snprintf(tmp + old, len, "%s: %s\r\n", name, value);
+    ctx->req_hdr = tmp;
+    ctx->req_cache_valid = 0;
+    return KHTTP_ERR_OK;
+}
+
+void khttp_clear_headers(khttp_ctx *ctx)
+{
+    if(ctx == NULL) return;
+    khttp_free(ctx->req_hdr);
+    ctx->req_hdr = NULL;
+    ctx->req_cache_valid = 0;
+}
+
+// Stop streaming the form, close the file opened for it
+static void khttp_form_end(khttp_ctx *ctx)
+{
+    if(ctx->form_fd >= 0 && ctx->form_cur && ctx->form_cur->fd < 0) close(ctx->form_fd);
+    ctx->form_fd = -1;
+    ctx->form_cur = NULL;
+    ctx->form_stream = 0;
+    ctx->form_raw = 0;
+    ctx->form_nosendfile = 0;
+    ctx->encoding = 0;
+}
+
+// Form follows the header, parts are queued piece by piece by khttp_form_next()
+int khttp_build_form(khttp_ctx *ctx)
+{
+    khttp_form_end(ctx);
+    khttp_out_reset(ctx);
+    if(ctx->form == NULL) return KHTTP_ERR_OK;
+    ctx->form_stream = 1;
+    ctx->form_raw = 0;
+    ctx->form_cur = ctx->form;
+    ctx->form_stage = KHTTP_PART_HEAD;
+    ctx->form_off = 0;
+    return KHTTP_ERR_OK;
+}
+
+// Queue the next chunk of a part body into the reused output buffer
+static int khttp_form_read(khttp_ctx *ctx, khttp_form_part *part)
+{
+    size_t len = part->size - ctx->form_off;
+    ssize_t n = 0;
+    if(len > KHTTP_NETWORK_BUF) len = KHTTP_NETWORK_BUF;
+    if(khttp_out_reserve(ctx, len) != KHTTP_ERR_OK) return -KHTTP_ERR_OOM;
+    if(part->read_cb){
+        n = part->read_cb(ctx->out + ctx->out_used, len, ctx->form_off, part->read_data);
+        if(n > len) n = 0;
+    }else{
+        do{
+            n = pread(ctx->form_fd, ctx->out + ctx->out_used, len, part->start + ctx->form_off);
+        }while(n < 0 && errno == EINTR);
+    }
+    if(n <= 0){
+        LOG_ERROR("khttp form part read failure %zu/%zu\n", ctx->form_off, part->size);
+        return -KHTTP_ERR_FILE_READ;
+    }
+    ctx->form_off += n;
+    return khttp_out_commit(ctx, n);
+}
+
+#ifdef __linux__
+// File bytes straight from page cache to socket, plain HTTP or kTLS
+static int khttp_form_sendfile(khttp_ctx *ctx, khttp_form_part *part)
+{
+    off_t off = part->start + ctx->form_off;
+    size_t len = part->size - ctx->form_off;
+    if(len > INT_MAX) len = INT_MAX;
+#ifdef SSL_OP_ENABLE_KTLS
+    if(ctx->proto == KHTTP_HTTPS){
+        ERR_clear_error();
+        ossl_ssize_t n = SSL_sendfile(ctx->ssl, ctx->form_fd, off, len, 0);
+        if(n > 0){
+            ctx->form_off += n;
+            ctx->timings.bytes_sent += n;
+            return KHTTP_ERR_OK;
+        }
+        if(khttp_ssl_want(ctx, SSL_get_error(ctx->ssl, n))) return -KHTTP_ERR_AGAIN;
+        LOG_WARN("khttp SSL_sendfile failure %d(%s), read instead\n", errno, strerror(errno));
+        ctx->form_nosendfile = 1;
+        return khttp_form_read(ctx, part);
+    }
+#endif
+    for(;;){
+        ssize_t n = sendfile(ctx->fd, ctx->form_fd, &off, len);
+        if(n > 0){
+            ctx->form_off += n;
+            ctx->timings.bytes_sent += n;
+            return KHTTP_ERR_OK;
+        }
+        if(n == 0){
+            LOG_ERROR("khttp form file shrank %zu/%zu\n", ctx->form_off, part->size);
+            return -KHTTP_ERR_FILE_READ;
+        }
+        if(errno == EINTR) continue;
+        if(errno == EAGAIN || errno == EWOULDBLOCK){
+            ctx->want = KHTTP_WANT_WRITE;
+            return -KHTTP_ERR_AGAIN;
+        }
+        if(errno == EINVAL || errno == ENOSYS){
+            // File system without sendfile support
+            ctx->form_nosendfile = 1;
+            return khttp_form_read(ctx, part);
+        }
+        LOG_ERROR("khttp sendfile error %d (%s)\n", errno, strerror(errno));
+        return -KHTTP_ERR_SEND;
+    }
+}
+#endif
+
+/*
+ * Queue the next chunk of a compressed request body once the output queue
+ * is drained. form_off counts source bytes taken by the compressor, file
+ * bytes it did not take are read again. Return 1 on progress, 0 when sent.
+ */
+static int khttp_encode_next(khttp_ctx *ctx)
+{
+    char tmp[KHTTP_NETWORK_BUF];
+    size_t total = ctx->data ? ctx->data_len : ctx->upload->size;
+    size_t n = 0;
+    int ret = KHTTP_ERR_OK;
+    khttp_out_reset(ctx);
+    // Chunk size goes in front once known, zero padded to a fixed width
+    if(khttp_out_reserve(ctx, KHTTP_NETWORK_BUF + 12) != KHTTP_ERR_OK) return -KHTTP_ERR_OOM;
+    char *chunk = ctx->out + ctx->out_used;
+    while(n < KHTTP_NETWORK_BUF && !khttp_encode_ended(ctx)){
+        const char *src = tmp;
+        size_t len = total - ctx->form_off;
+        size_t used = 0;
+        if(ctx->data){
+            src = ctx->data + ctx->form_off;
+        }else if(len > 0){
+            ssize_t r = 0;
+            if(len > sizeof(tmp)) len = sizeof(tmp);
+            do{
+                r = pread(ctx->upload->fd, tmp, len, ctx->upload->start + ctx->form_off);
+            }while(r < 0 && errno == EINTR);
+            if(r <= 0){
+                LOG_ERROR("khttp upload read failure %zu/%zu\n", ctx->form_off, total);
+                return -KHTTP_ERR_FILE_READ;
             }
-        }else{//Basic auth
-            if(ctx->data){
-                len = snprintf(req, KHTTP_REQ_SIZE,
-                    "POST %s HTTP/1.1\r\n"
-                    "Authorization: %s %s\r\n"
-                    "User-Agent: %s\r\n"
-                    "Host: %s:%d\r\n"
-                    "Accept: */*\r\n"
-                    "Content-Length: %zu\r\n"
-                    "Content-Type: application/x-www-form-urlencoded\r\n"
-                    "\r\n",
-                    ctx->path,
-                    khttp_auth2str(ctx->auth_type), cnonce_b64,
-                    KHTTP_USER_AGENT,
-                    ctx->host, ctx->port,
-                    strlen(ctx->data)
-                    );
-            }else{
-                len = snprintf(req, KHTTP_REQ_SIZE,
-                    "POST %s HTTP/1.1\r\n"
-                    "Authorization: %s %s\r\n"
-                    "User-Agent: %s\r\n"
-                    "Host: %s:%d\r\n"
-                    "Accept: */*\r\n"
-                    "\r\n",
-                    ctx->path,
-                    khttp_auth2str(ctx->auth_type), cnonce_b64,
-                    KHTTP_USER_AGENT,
-                    ctx->host, ctx->port
-                    );
+            len = r;
+        }
+        ret = khttp_encode(ctx, src, len, ctx->form_off + len == total, chunk + 10 + n, KHTTP_NETWORK_BUF - n, &used);
+        if(ret < 0) return ret;
+        n += ret;
+        ctx->form_off += used;
+    }
+    if(n > 0){
+        char head[11];
+        snprintf(head, sizeof(head), "%08zx\r\n", n);
+        memcpy(chunk, head, 10);
+        memcpy(chunk + 10 + n, "\r\n", 2);
+        if((ret = khttp_out_commit(ctx, n + 12)) != KHTTP_ERR_OK) return ret;
+    }
+    if(khttp_encode_ended(ctx)){
+        if((ret = khttp_out_append(ctx, "0\r\n\r\n", 5)) != KHTTP_ERR_OK) return ret;
+        ctx->form_stream = 0;
+    }
+    return 1;
+}
+
+/*
+ * Queue what comes next in the form once the output queue is drained. Part
+ * headers, string values and the closing boundary are batched, body bytes
+ * go one chunk at a time. Return 1 on progress, 0 when the form is sent.
+ */
+static int khttp_form_next(khttp_ctx *ctx)
+{
+    int ret = KHTTP_ERR_OK;
+    if(ctx->encoding) return khttp_encode_next(ctx);
+    khttp_out_reset(ctx);
+    while(ctx->form_cur){
+        khttp_form_part *part = ctx->form_cur;
+        if(ctx->form_stage == KHTTP_PART_HEAD){
+            if(part->head_len && (ret = khttp_out_append(ctx, part->head, part->head_len)) != KHTTP_ERR_OK) return ret;
+            ctx->form_fd = part->fd;
+            if(part->path && part->size > 0 && (ctx->form_fd = open(part->path, O_RDONLY | O_CLOEXEC)) < 0){
+                LOG_ERROR("khttp open %s failure %d(%s)\n", part->path, errno, strerror(errno));
+                return -KHTTP_ERR_NO_FILE;
             }
+            ctx->form_off = 0;
+            ctx->form_stage = KHTTP_PART_BODY;
         }
-    }else if(ctx->method == KHTTP_PUT){
-        if(ctx->auth_type == KHTTP_AUTH_DIGEST){//Digest auth
-            if(ctx->data){
-                len = snprintf(req, KHTTP_REQ_SIZE,
-                    "PUT %s HTTP/1.1\r\n"
-                    "Authorization: %s username=\"%s\", realm=\"%s\", "
-                    "nonce=\"%s\", uri=\"%s\", "
-                    "cnonce=\"%s\", nc=00000001, qop=%s, "
-                    "response=\"%s\"\r\n"
-                    "User-Agent: %s\r\n"
-                    "Host: %s:%d\r\n"
-                    "Accept: */*\r\n"
-                    "Content-Length: %zu\r\n"
-                    "Content-Type: application/x-www-form-urlencoded\r\n"
-                    "\r\n",
-                    ctx->path,
-                    khttp_auth2str(ctx->auth_type), ctx->username, ctx->realm,
-                    ctx->nonce, ctx->path,
-                    cnonce_b64, ctx->qop,
-                    response,
-                    KHTTP_USER_AGENT,
-                    ctx->host, ctx->port,
-                    strlen(ctx->data)
-                    );
-            }else{
-                len = snprintf(req, KHTTP_REQ_SIZE,
-                    "PUT %s HTTP/1.1\r\n"
-                    "Authorization: %s username=\"%s\", realm=\"%s\", "
-                    "nonce=\"%s\", uri=\"%s\", "
-                    "cnonce=\"%s\", nc=00000001, qop=%s, "
-                    "response=\"%s\"\r\n"
-                    "User-Agent: %s\r\n"
-                    "Host: %s:%d\r\n"
-                    "Accept: */*\r\n\r\n",
-                    ctx->path,
-                    khttp_auth2str(ctx->auth_type), ctx->username, ctx->realm,
-                    ctx->nonce, ctx->path,
-                    cnonce_b64, ctx->qop,
-                    response,
-                    KHTTP_USER_AGENT,
-                    ctx->host, ctx->port
-                    );
+        if(ctx->form_stage == KHTTP_PART_BODY && ctx->form_off < part->size){
+            // Flush batched text before body bytes
+            if(ctx->out_len) return 1;
+#ifdef __linux__
+            if(part->read_cb == NULL && !ctx->form_nosendfile &&
+                    (ctx->proto == KHTTP_HTTP || khttp_ssl_ktls_send(ctx))){
+                if((ret = khttp_form_sendfile(ctx, part)) < 0) return ret;
+                return 1;
             }
-        }else{//Basic auth
-            if(ctx->data){
-                len = snprintf(req, KHTTP_REQ_SIZE,
-                    "PUT %s HTTP/1.1\r\n"
-                    "Authorization: %s %s\r\n"
-                    "User-Agent: %s\r\n"
-                    "Host: %s:%d\r\n"
-                    "Accept: */*\r\n"
-                    "Content-Length: %zu\r\n"
-                    "Content-Type: application/x-www-form-urlencoded\r\n"
-                    "\r\n",
-                    ctx->path,
-                    khttp_auth2str(ctx->auth_type), cnonce_b64,
-                    KHTTP_USER_AGENT,
-                    ctx->host, ctx->port,
-                    strlen(ctx->data)
-                    );
-            }else{
-                len = snprintf(req, KHTTP_REQ_SIZE,
-                    "PUT %s HTTP/1.1\r\n"
-                    "Authorization: %s %s\r\n"
-                    "User-Agent: %s\r\n"
-                    "Host: %s:%d\r\n"
-                    "Accept: */*\r\n"
-                    "\r\n",
-                    ctx->path,
-                    khttp_auth2str(ctx->auth_type), cnonce_b64,
-                    KHTTP_USER_AGENT,
-                    ctx->host, ctx->port
-                    );
+#endif
+            if((ret = khttp_form_read(ctx, part)) < 0) return ret;
+            return 1;
+        }
+        if(!ctx->form_raw && (ret = khttp_out_append(ctx, "\r\n", 2)) != KHTTP_ERR_OK) return ret;
+        if(ctx->form_fd >= 0 && part->fd < 0) close(ctx->form_fd);
+        ctx->form_fd = -1;
+        ctx->form_cur = part->next;
+        ctx->form_stage = KHTTP_PART_HEAD;
+    }
+    if(ctx->form_stream && ctx->form_raw){
+        ctx->form_stream = 0;
+        return 1;
+    }
+    if(ctx->form_stream){
+        char buf[47];
+        memset(buf, 0, 47);
+        snprintf(buf, 47,"--------------------------%s--\r\n", ctx->boundary);
+        if((ret = khttp_out_append(ctx, buf, 46)) != KHTTP_ERR_OK) return ret;
+        ctx->form_stream = 0;
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Feed one chunk to the parser. Parser state lives in ctx->hp across reads so
+ * every byte is parsed exactly once. Returns the number of bytes consumed.
+ */
+static int khttp_parse_chunk(khttp_ctx *ctx, const char *buf, size_t len)
+{
+    ctx->parse_end = buf + len;
+    size_t parsed = http_parser_execute(&ctx->hp, &http_parser_cb, buf, len);
+    enum http_errno err = HTTP_PARSER_ERRNO(&ctx->hp);
+    if(err == HPE_PAUSED){
+        http_parser_pause(&ctx->hp, 0);
+    }else if(err == HPE_CB_body && ctx->write_abort){
+        LOG_ERROR("khttp write callback abort transfer\n");
+        return -KHTTP_ERR_WRITE;
+    }else if(err != HPE_OK){
+        LOG_ERROR("khttp parse response failure %s\n", http_errno_name(err));
+        return -KHTTP_ERR_RECV;
+    }
+    return parsed;
+}
+
+static int khttp_save_pending(khttp_ctx *ctx, const char *buf, size_t len)
+{
+    // Bytes after a complete message. Keep them for the next response.
+    if(len == 0) return KHTTP_ERR_OK;
+    char *tmp = khttp_malloc(len);
+    if(!tmp) return -KHTTP_ERR_OOM;
+    memcpy(tmp, buf, len);
+    khttp_free(ctx->pending);
+    ctx->pending = tmp;
+    ctx->pending_len = len;
+    return KHTTP_ERR_OK;
+}
+
+/*
+ * Consume a buffer into the current response. Interim 1xx responses followed
+ * by more data are skipped so the caller only sees the final response.
+ * Returns 1 when a message is complete, 0 when more data is needed.
+ */
+static int khttp_consume(khttp_ctx *ctx, const char *buf, size_t len)
+{
+    while(len > 0){
+        int parsed = khttp_parse_chunk(ctx, buf, len);
+        if(parsed < 0) return parsed;
+        buf += parsed;
+        len -= parsed;
+        if(ctx->done != 1) continue;
+        if(ctx->hp.status_code / 100 == 1){
+            ctx->cont = 1;
+            if(len == 0) return 1;//Only get 100 Continue
+            //Get 100 Continue and others, parse the final response
+            ctx->done = 0;
+            http_parser_init(&ctx->hp, HTTP_RESPONSE);
+            continue;
+        }
+        if(khttp_save_pending(ctx, buf, len) != KHTTP_ERR_OK) return -KHTTP_ERR_OOM;
+        return 1;
+    }
+    return ctx->done == 1;
+}
+
+static void khttp_wait_for(khttp_ctx *ctx, int want, int timeout)
+{
+    ctx->wait_fd = ctx->dns ? khttp_dns_fd(ctx->dns) : ctx->fd;
+    ctx->want = want;
+    ctx->deadline = khttp_now_ms() + timeout;
+}
+
+/*
+ * Happy Eyeballs (RFC 8305). Addresses are tried in resolver order with a new
+ * attempt started every KHTTP_EYEBALLS_DELAY ms, or at once when an attempt
+ * fails. Earlier attempts stay open and the first one to connect wins.
+ */
+static int khttp_race_start(khttp_ctx *ctx)
+{
+    while(ctx->addr_next < ctx->addr_count){
+        int i = ctx->addr_next++;
+        khttp_addr *addr = &ctx->addr[i];
+        int fd = khttp_socket_create(addr->sa.ss_family);
+        if(fd < 0) continue;
+        khttp_socket_setup(ctx, fd);
+        if(connect(fd, (struct sockaddr *)&addr->sa, addr->len) != 0 && errno != EINPROGRESS){
+            LOG_ERROR("khttp connect to server error %d(%s)\n", errno, strerror(errno));
+            close(fd);
+            continue;
+        }
+        ctx->race_fd[ctx->race_count] = fd;
+        ctx->race_addr[ctx->race_count] = i;
+        ctx->race_count ++;
+#ifdef __linux__
+        // Several attempts in flight, wait on all of them through one fd
+        if(ctx->race_count > 1){
+            struct epoll_event ev;
+            int j = ctx->race_epfd < 0 ? 0 : ctx->race_count - 1;
+            if(ctx->race_epfd < 0 && (ctx->race_epfd = epoll_create1(EPOLL_CLOEXEC)) < 0){
+                return KHTTP_ERR_OK;
+            }
+            for(; j < ctx->race_count; j++){
+                memset(&ev, 0, sizeof(ev));
+                ev.events = EPOLLOUT;
+                ev.data.fd = ctx->race_fd[j];
+                epoll_ctl(ctx->race_epfd, EPOLL_CTL_ADD, ctx->race_fd[j], &ev);
             }
         }
-    }else if(ctx->method == KHTTP_DELETE){
-        if(ctx->auth_type == KHTTP_AUTH_DIGEST){//Digest auth
-            if(ctx->data){
-                len = snprintf(req, KHTTP_REQ_SIZE,
-                    "DELETE %s HTTP/1.1\r\n"
-                    "Authorization: %s username=\"%s\", realm=\"%s\", "
-                    "nonce=\"%s\", uri=\"%s\", "
-                    "cnonce=\"%s\", nc=00000001, qop=%s, "
-                    "response=\"%s\"\r\n"
-                    "User-Agent: %s\r\n"
-                    "Host: %s:%d\r\n"
-                    "Accept: */*\r\n"
-                    "Content-Length: %zu\r\n"
-                    "Content-Type: application/x-www-form-urlencoded\r\n"
-                    "\r\n",
-                    ctx->path,
-                    khttp_auth2str(ctx->auth_type), ctx->username, ctx->realm,
-                    ctx->nonce, ctx->path,
-                    cnonce_b64, ctx->qop,
-                    response,
-                    KHTTP_USER_AGENT,
-                    ctx->host, ctx->port,
-                    strlen(ctx->data)
-                    );
-            }else{
-                len = snprintf(req, KHTTP_REQ_SIZE,
-                    "DELETE %s HTTP/1.1\r\n"
-                    "Authorization: %s username=\"%s\", realm=\"%s\", "
-                    "nonce=\"%s\", uri=\"%s\", "
-                    "cnonce=\"%s\", nc=00000001, qop=%s, "
-                    "response=\"%s\"\r\n"
-                    "User-Agent: %s\r\n"
-                    "Host: %s:%d\r\n"
-                    "Accept: */*\r\n\r\n",
-                    ctx->path,
-                    khttp_auth2str(ctx->auth_type), ctx->username, ctx->realm,
-                    ctx->nonce, ctx->path,
-                    cnonce_b64, ctx->qop,
-                    response,
-                    KHTTP_USER_AGENT,
-                    ctx->host, ctx->port
-                    );
+#endif
+        return KHTTP_ERR_OK;
+    }
+    return -KHTTP_ERR_CONNECT;
+}
+
+static void khttp_race_close(khttp_ctx *ctx, int keep)
+{
+    int i = 0;
+    if(ctx->race_count == 0 && ctx->race_epfd < 0) return;
+    if(ctx->multi) khttp_multi_unwatch(ctx);
+    for(i = 0; i < ctx->race_count; i++){
+        if(ctx->race_fd[i] != keep) close(ctx->race_fd[i]);
+    }
+    ctx->race_count = 0;
+    if(ctx->race_epfd >= 0){
+        close(ctx->race_epfd);
+        ctx->race_epfd = -1;
+    }
+}
+
+static void khttp_race_wait(khttp_ctx *ctx)
+{
+    uint64_t now = khttp_now_ms();
+    ctx->want = KHTTP_WANT_WRITE;
+    if(ctx->race_count == 1){
+        ctx->wait_fd = ctx->race_fd[0];
+    }else if(ctx->race_epfd >= 0){
+        ctx->wait_fd = ctx->race_epfd;
+        ctx->want = KHTTP_WANT_READ;
+    }else{
+        ctx->wait_fd = ctx->race_fd[ctx->race_count - 1];
+    }
+    ctx->deadline = ctx->conn_deadline;
+    if(ctx->addr_next < ctx->addr_count && now + KHTTP_EYEBALLS_DELAY < ctx->deadline){
+        ctx->deadline = now + KHTTP_EYEBALLS_DELAY;
+    }
+}
+
+static void khttp_addr_free(khttp_ctx *ctx)
+{
+    khttp_dns_release(ctx);
+    ctx->addr_count = 0;
+    ctx->addr_next = 0;
+}
+
+static int khttp_connect_begin(khttp_ctx *ctx)
+{
+    ctx->timings.connect_start = khttp_now_us();
+    ctx->conn_deadline = khttp_now_ms() + KHTTP_CONN_TIMEO;
+    if(khttp_race_start(ctx) != KHTTP_ERR_OK) return -KHTTP_ERR_CONNECT;
+    ctx->state = KHTTP_STATE_CONNECTING;
+    khttp_race_wait(ctx);
+    return -KHTTP_ERR_AGAIN;
+}
+
+static int khttp_connect_start(khttp_ctx *ctx)
+{
+    int ret = KHTTP_ERR_OK;
+#ifdef OPENSSL
+    if(ctx->proto == KHTTP_HTTPS && khttp_tls_attach(ctx) != KHTTP_ERR_OK){
+        LOG_ERROR("khttp TLS config setup failure\n");
+        return -KHTTP_ERR_SSL;
+    }
+#endif
+    if(!ctx->fresh && ctx->keepalive == KHTTP_ENABLE && khttp_pool_get(ctx)){
+        ctx->timings.conn_reused = 1;
+        khttp_metrics_count(KHTTP_COUNT_CONN_REUSE);
+        ctx->state = KHTTP_STATE_SEND;
+        return KHTTP_ERR_OK;
+    }
+    khttp_addr_free(ctx);
+    ctx->timings.dns_start = khttp_now_us();
+    // Event loop must not stall on getaddrinfo, resolve on the DNS workers
+    if(ctx->multi){
+        ret = khttp_dns_lookup_async(ctx);
+        if(ret == -KHTTP_ERR_AGAIN){
+            ctx->state = KHTTP_STATE_RESOLVE;
+            khttp_wait_for(ctx, KHTTP_WANT_READ, KHTTP_CONN_TIMEO);
+            return ret;
+        }
+    }else{
+        ret = khttp_dns_lookup(ctx);
+    }
+    if(ret != KHTTP_ERR_OK) return ret;
+    ctx->timings.dns_end = khttp_now_us();
+    return khttp_connect_begin(ctx);
+}
+
+static int khttp_resolve_done(khttp_ctx *ctx)
+{
+    int ret = khttp_dns_finish(ctx);
+    if(ret == -KHTTP_ERR_AGAIN) return ret;
+    if(ret != KHTTP_ERR_OK) return ret;
+    ctx->timings.dns_end = khttp_now_us();
+    return khttp_connect_begin(ctx);
+}
+
+static int khttp_connect_done(khttp_ctx *ctx)
+{
+    struct pollfd pfd[KHTTP_DNS_ADDR_MAX];
+    int i = 0;
+    int n = 0;
+    int winner = -1;
+    for(i = 0; i < ctx->race_count; i++){
+        pfd[i].fd = ctx->race_fd[i];
+        pfd[i].events = POLLOUT;
+        pfd[i].revents = 0;
+    }
+    if(poll(pfd, ctx->race_count, 0) > 0){
+        for(i = 0; i < ctx->race_count; i++){
+            int err = 0;
+            socklen_t len = sizeof(err);
+            if(pfd[i].revents == 0) continue;
+            if(getsockopt(pfd[i].fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0) err = errno;
+            if(err == 0 && winner < 0){
+                winner = i;
+                continue;
             }
-        }else{//Basic auth
-            if(ctx->data){
-                len = snprintf(req, KHTTP_REQ_SIZE,
-                    "DELETE %s HTTP/1.1\r\n"
-                    "Authorization: %s %s\r\n"
-                    "User-Agent: %s\r\n"
-                    "Host: %s:%d\r\n"
-                    "Accept: */*\r\n"
-                    "Content-Length: %zu\r\n"
-                    "Content-Type: application/x-www-form-urlencoded\r\n"
-                    "\r\n",
-                    ctx->path,
-                    khttp_auth2str(ctx->auth_type), cnonce_b64,
-                    KHTTP_USER_AGENT,
-                    ctx->host, ctx->port,
-                    strlen(ctx->data)
-                    );
-            }else{
-                len = snprintf(req, KHTTP_REQ_SIZE,
-                    "DELETE %s HTTP/1.1\r\n"
-                    "Authorization: %s %s\r\n"
-                    "User-Agent: %s\r\n"
-                    "Host: %s:%d\r\n"
-                    "Accept: */*\r\n"
-                    "\r\n",
-                    ctx->path,
-                    khttp_auth2str(ctx->auth_type), cnonce_b64,
-                    KHTTP_USER_AGENT,
-                    ctx->host, ctx->port
-                    );
+            if(err != 0){
+                LOG_ERROR("khttp connect to server error %d(%s)\n", err, strerror(err));
+                close(pfd[i].fd);
+                pfd[i].fd = -1;
             }
         }
+        // Drop failed attempts
+        for(i = 0; i < ctx->race_count; i++){
+            if(pfd[i].fd < 0) continue;
+            if(i == winner) winner = n;
+            pfd[n] = pfd[i];
+            ctx->race_fd[n] = ctx->race_fd[i];
+            ctx->race_addr[n] = ctx->race_addr[i];
+            n++;
+        }
+        ctx->race_count = n;
+    }
+    if(winner < 0){
+        // All attempts failed, next address right away
+        if(ctx->race_count == 0 && khttp_race_start(ctx) != KHTTP_ERR_OK){
+            return -KHTTP_ERR_CONNECT;
+        }
+        khttp_race_wait(ctx);
+        return -KHTTP_ERR_AGAIN;
+    }
+    ctx->fd = ctx->race_fd[winner];
+    khttp_addr *addr = &ctx->addr[ctx->race_addr[winner]];
+    memcpy(&ctx->serv_addr, &addr->sa, addr->len);
+    khttp_race_close(ctx, ctx->fd);
+    khttp_addr_free(ctx);
+    ctx->reused = 0;
+    ctx->timings.connect_end = khttp_now_us();
+    ctx->timings.conn_reused = 0;
+    khttp_metrics_count(KHTTP_COUNT_CONN_OPEN);
+    if(ctx->proto == KHTTP_HTTPS){
+#ifdef OPENSSL
+        ctx->timings.tls_start = ctx->timings.connect_end;
+        int ret = khttp_ssl_setup(ctx);
+        if(ret != KHTTP_ERR_OK) return ret;
+        ctx->state = KHTTP_STATE_TLS;
+#else
+        return -KHTTP_ERR_NOT_SUPP;
+#endif
     }else{
+        ctx->state = KHTTP_STATE_SEND;
     }
-    khttp_dump_message_flow(req, len, 0);
-    if(ctx->send(ctx, req, len, KHTTP_SEND_TIMEO) != KHTTP_ERR_OK){
-        LOG_ERROR("khttp request send failure\n");
+    return KHTTP_ERR_OK;
+}
+
+// Queue what follows a complete response. Return next state.
+static int khttp_next_step(khttp_ctx *ctx)
+{
+    int ret = KHTTP_ERR_OK;
+    char *str = NULL;
+    if(ctx->pending != NULL || !http_should_keep_alive(&ctx->hp)){
+        khttp_close(ctx);
     }
-    if(ctx->data){
-        khttp_dump_message_flow(ctx->data, len, 0);
-        if(ctx->send(ctx, ctx->data, strlen(ctx->data), KHTTP_SEND_TIMEO) != KHTTP_ERR_OK){
-            LOG_ERROR("khttp request send failure\n");
+    if(ctx->hp.status_code / 100 == 1){
+        // Interim response, send the form if server wait for it
+        if(ctx->expect){
+            ctx->expect = 0;
+            if((ret = khttp_build_form(ctx)) != KHTTP_ERR_OK) return ret;
+            return KHTTP_STATE_SEND;
         }
+        return KHTTP_STATE_RECV;
     }
-    if(cnonce_b64) free(cnonce_b64);
-    if(req) free(req);
-    return 0;
+    if(ctx->expect){
+        // Final response before the form was sent. Connection is dirty.
+        ctx->expect = 0;
+        khttp_close(ctx);
+    }
+    if(ctx->hp.status_code == 401){
+        str = khttp_find_header(ctx, "WWW-Authenticate");
+        if(str == NULL || khttp_parse_auth(ctx, str) != 0) {
+            LOG_ERROR("khttp parse auth string failure\n");
+            return KHTTP_STATE_DONE;
+        }
+        if(ctx->count == 0 && ctx->auth_type != KHTTP_AUTH_BASIC){
+            ctx->count ++;
+            //LOG_DEBUG("Send HTTP authentication response\n");
+            if((ret = khttp_build_request(ctx)) != KHTTP_ERR_OK){
+                LOG_ERROR("khttp send HTTP authentication response failure %d\n", ret);
+                return ret;
+            }
+            return KHTTP_STATE_SEND;
+        }
+        // Answer to a fresh challenge refused, credentials are wrong
+        if(ctx->auth_type == KHTTP_AUTH_DIGEST) khttp_auth_cache_drop(ctx);
+    }
+    return KHTTP_STATE_DONE;
 }
 
-int khttp_recv_http_resp(khttp_ctx *ctx)
+static void khttp_recv_begin(khttp_ctx *ctx)
 {
-    char buf[KHTTP_NETWORK_BUF];
-    memset(buf, 0, KHTTP_NETWORK_BUF);
-    int len = 0;
-    char *data = NULL;
+    //Free all header before recv data
+    khttp_free_header(ctx);
+    khttp_body_reset(ctx);
     // Pass context to http parser data pointer
     ctx->hp.data = ctx;
-    int total = 0;
-    for(;;) {
-        len = ctx->recv(ctx, buf, KHTTP_NETWORK_BUF, KHTTP_RECV_TIMEO);
-        if(len < 0) {
+    http_parser_init(&ctx->hp, HTTP_RESPONSE);
+    ctx->rx_bytes = 0;
+    ctx->streaming = 0;
+    ctx->write_abort = 0;
+}
+
+// Pooled connection closed by server before any reply, redo on a new one
+static int khttp_retry(khttp_ctx *ctx)
+{
+    if(ctx->count != 0 || !ctx->reused || ctx->rx_bytes != 0 || ctx->fresh) return 0;
+    khttp_close(ctx);
+    ctx->fresh = 1;
+    // Request may be part way into the form, start over from the header
+    if(khttp_build_request(ctx) != KHTTP_ERR_OK) return 0;
+    ctx->state = KHTTP_STATE_CONNECT;
+    return 1;
+}
+
+static int khttp_do_send(khttp_ctx *ctx)
+{
+    struct iovec iov[KHTTP_OUT_SEG];
+    int ret = 0;
+    for(;;){
+        while(ctx->out_off < ctx->out_len){
+            int count = khttp_out_iov(ctx, iov);
+            ret = ctx->sendv(ctx, iov, count);
+            if(ret < 0) break;
+            ctx->out_off += ret;
+            ctx->timings.bytes_sent += ret;
+        }
+        if(ret >= 0){
+            // Queue drained, pull the next piece of a streamed form
+            if(!ctx->form_stream) break;
+            if((ret = khttp_form_next(ctx)) >= 0) continue;
+        }
+        if(ret == -KHTTP_ERR_AGAIN){
+            khttp_wait_for(ctx, ctx->want, KHTTP_SEND_TIMEO);
+            return ret;
+        }
+        if(ret == -KHTTP_ERR_FILE_READ || ret == -KHTTP_ERR_NO_FILE || ret == -KHTTP_ERR_OOM){
+            return ret;
+        }
+        if(khttp_retry(ctx)) return KHTTP_ERR_OK;
+        LOG_ERROR("khttp request send failure\n");
+        return -KHTTP_ERR_SEND;
+    }
+    ctx->timings.sent = khttp_now_us();
+    ctx->state = KHTTP_STATE_RECV;
+    khttp_recv_begin(ctx);
+    // Wait a short time for 100 Continue, then send the form anyway
+    khttp_wait_for(ctx, KHTTP_WANT_READ, ctx->expect ? KHTTP_EXPECT_TIMEO : KHTTP_RECV_TIMEO);
+    return KHTTP_ERR_OK;
+}
+
+#ifdef __linux__
+// Rest of a Content-Length body can go from socket to download fd directly
+static int khttp_can_splice(khttp_ctx *ctx)
+{
+    return ctx->streaming && ctx->download_fd >= 0 && !ctx->nosplice && !ctx->decoding &&
+        ctx->proto == KHTTP_HTTP && ctx->done == 0 && ctx->pending == NULL &&
+        !(ctx->hp.flags & F_CHUNKED) && ctx->hp.content_length != ULLONG_MAX &&
+        ctx->hp.content_length > 0;
+}
+
+// Empty the pipe with read/write when download fd refuses splice
+static int khttp_splice_drain(khttp_ctx *ctx, size_t len)
+{
+    char buf[KHTTP_NETWORK_BUF];
+    while(len > 0){
+        ssize_t n = read(ctx->splice_pipe[0], buf, len < sizeof(buf) ? len : sizeof(buf));
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0) return -KHTTP_ERR_RECV;
+        if(khttp_write_fd(ctx->download_fd, buf, n) != KHTTP_ERR_OK) return -KHTTP_ERR_WRITE;
+        len -= n;
+    }
+    return KHTTP_ERR_OK;
+}
+
+/*
+ * Move the body from socket to download fd through a pipe, bytes stay in
+ * the kernel. The parser is skipped, so finish the message for it here.
+ */
+static int khttp_splice_body(khttp_ctx *ctx)
+{
+    if(ctx->splice_pipe[0] < 0 && pipe2(ctx->splice_pipe, O_CLOEXEC | O_NONBLOCK) != 0){
+        LOG_WARN("khttp splice pipe failure %d(%s)\n", errno, strerror(errno));
+        ctx->nosplice = 1;
+        return KHTTP_ERR_OK;
+    }
+    while(ctx->hp.content_length > 0){
+        size_t len = ctx->hp.content_length > KHTTP_SPLICE_LEN ? KHTTP_SPLICE_LEN : ctx->hp.content_length;
+        ssize_t n = splice(ctx->fd, NULL, ctx->splice_pipe[1], NULL, len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if(n == 0){
+            LOG_ERROR("khttp connection closed with %llu body bytes left\n", (unsigned long long)ctx->hp.content_length);
+            return -KHTTP_ERR_DISCONN;
+        }
+        if(n < 0){
+            if(errno == EINTR) continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK){
+                ctx->want = KHTTP_WANT_READ;
+                return -KHTTP_ERR_AGAIN;
+            }
+            LOG_ERROR("khttp splice recv error %d (%s)\n", errno, strerror(errno));
             return -KHTTP_ERR_RECV;
         }
-        if(len == 0) return -KHTTP_ERR_DISCONN;
-        data = realloc(data, total + len + 1);
-        memcpy(data + total, buf, len);
-        total += len;
-        http_parser_init(&ctx->hp, HTTP_RESPONSE);
-        ctx->body_len = 0;//Reset body length until parse finish.
-        if(strncmp(data, "HTTP/1.1 100 Continue", 21) == 0){
-            ctx->cont = 1;
-            // char *end = strstr(data, "\r\n\r\n");
-            //LOG_DEBUG("len: %d\n%s\n", len, data);
-            if(len == 25){//Only get 100 Continue
-                ctx->hp.status_code = 100;
-                //LOG_DEBUG("Only get 100 continue\n");
-                goto end;
-            }else if(len > 25){
-                ctx->cont = 1;//Get 100 Continue and others
-                total = total - 25;
-                memmove(data, data + 25, len - 25);
+        ctx->rx_bytes += n;
+        ctx->timings.bytes_recv += n;
+        ctx->hp.content_length -= n;
+        while(n > 0){
+            ssize_t m = ctx->nosplice ? 0 : splice(ctx->splice_pipe[0], NULL, ctx->download_fd, NULL, n, SPLICE_F_MOVE);
+            if(m < 0 && errno == EINTR) continue;
+            if(m <= 0){
+                if(!ctx->nosplice && errno != EINVAL){
+                    LOG_ERROR("khttp splice write error %d (%s)\n", errno, strerror(errno));
+                    return -KHTTP_ERR_WRITE;
+                }
+                // e.g. O_APPEND file, copy what is in the pipe and stop splicing
+                ctx->nosplice = 1;
+                return khttp_splice_drain(ctx, n);
             }
+            n -= m;
         }
-        //LOG_INFO("Parse:\n%s\n", data);
-        http_parser_execute(&ctx->hp, &http_parser_cb, data, total);
-        if(ctx->done == 1){
-            break;
+    }
+    khttp_message_complete_cb(&ctx->hp);
+    return 1;
+}
+#endif
+
+static int khttp_do_recv(khttp_ctx *ctx)
+{
+    char buf[KHTTP_NETWORK_BUF];
+    int ret = 0;
+    if(ctx->pending){
+        char *pending = ctx->pending;
+        size_t pending_len = ctx->pending_len;
+        ctx->pending = NULL;
+        ctx->pending_len = 0;
+        ret = khttp_consume(ctx, pending, pending_len);
+        khttp_free(pending);
+        if(ret < 0) return ret;
+    }
+    while(ret == 0){
+#ifdef __linux__
+        if(khttp_can_splice(ctx)){
+            ret = khttp_splice_body(ctx);
+            if(ret == -KHTTP_ERR_AGAIN) khttp_wait_for(ctx, ctx->want, KHTTP_RECV_TIMEO);
+            if(ret < 0) return ret;
+            continue;
+        }
+#endif
+        int len = ctx->recv(ctx, buf, KHTTP_NETWORK_BUF);
+        if(len == -KHTTP_ERR_AGAIN){
+            // Keep the short 100 Continue deadline until the first byte
+            if(!ctx->expect || ctx->rx_bytes) khttp_wait_for(ctx, ctx->want, KHTTP_RECV_TIMEO);
+            return len;
+        }
+        if(len == 0){
+            // Tell parser about EOF. Body without length ends here.
+            khttp_parse_chunk(ctx, NULL, 0);
+            if(ctx->done == 1) break;
         }
+        if(len <= 0){
+            if(khttp_retry(ctx)) return KHTTP_ERR_OK;
+            LOG_ERROR("khttp recv HTTP response failure %d\n", len);
+            return len == 0 ? -KHTTP_ERR_DISCONN : -KHTTP_ERR_RECV;
+        }
+        if(ctx->rx_bytes == 0) ctx->timings.first_byte = khttp_now_us();
+        ctx->rx_bytes += len;
+        ctx->timings.bytes_recv += len;
+        khttp_dump_message_flow(buf, len, 1);
+        ret = khttp_consume(ctx, buf, len);
+        if(ret < 0) return ret;
     }
-    http_parser_init(&ctx->hp, HTTP_RESPONSE);
-    // Malloc memory for body
-    ctx->body = malloc(ctx->body_len + 1);
-    if(!ctx->body){
+    if(ctx->body == NULL && khttp_body_grow(ctx, 0) != KHTTP_ERR_OK){
         return -KHTTP_ERR_OOM;
     }
-    //LOG_DEBUG("malloc %zu byte for body\n", ctx->body_len);
-    memset(ctx->body, 0, ctx->body_len + 1);
-    //Set body length to 0 before parse
-    ctx->body_len = 0;
-    if(ctx->body == NULL) return -KHTTP_ERR_OOM;
-    http_parser_execute(&ctx->hp, &http_parser_cb, data, total);
-    //LOG_DEBUG("status_code %d\n", ctx->hp.status_code);
-    //LOG_DEBUG("body:\n%s\n", ctx->body);
-    //FIXME why mark end of data will crash. WTF
-    data[total] = 0;
-    khttp_dump_message_flow(data, total, 0);
-    // Free receive buffer
-end:
-    free(data);
+    ((char *)ctx->body)[ctx->body_len] = 0;
+    ret = khttp_next_step(ctx);
+    if(ret < 0) return ret;
+    if(ret == KHTTP_STATE_RECV){
+        khttp_recv_begin(ctx);
+        khttp_wait_for(ctx, KHTTP_WANT_READ, KHTTP_RECV_TIMEO);
+    }else if(ret == KHTTP_STATE_SEND){
+        ctx->out_off = 0;
+        // Server closed after this response, reconnect for the next step
+        if(ctx->fd < 0) ret = KHTTP_STATE_CONNECT;
+    }
+    ctx->state = ret;
     return KHTTP_ERR_OK;
 }
 
-int khttp_perform(khttp_ctx *ctx)
+/*
+ * Parse raw response bytes with the parser and callbacks of a live transfer,
+ * no socket involved. Returns 1 when the response is complete, the next call
+ * starts a new one. For benchmarks and tests.
+ */
+int khttp_feed_response(khttp_ctx *ctx, const char *buf, size_t len)
 {
-    char *str = NULL;
-    struct addrinfo hints;
-    struct addrinfo *result;
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_family = AF_INET;
-    int res = 0;
-    int ret = KHTTP_ERR_OK;
-    char port[16];
-    sprintf(port, "%d", ctx->port);
-    if((res = getaddrinfo(ctx->host, port, &hints, &result)) != 0){
-        LOG_ERROR("khttp DNS lookup failure. getaddrinfo: %s\n", gai_strerror(res));
-        ret = -KHTTP_ERR_DNS;
-        goto err;
-    }
-    ctx->serv_addr.sin_addr = ((struct sockaddr_in *)result->ai_addr)->sin_addr;
-    ctx->serv_addr.sin_port = htons(ctx->port);
-    //char addrstr[100];
-    //inet_ntop (result->ai_family, &ctx->serv_addr.sin_addr, addrstr, 100);
-    //LOG_DEBUG("IP:%s\n", addrstr);
-    ctx->fd = khttp_socket_create();
-    if(ctx->fd < 1){
-        LOG_ERROR("khttp socket create error\n");
-        ret = -KHTTP_ERR_SOCK;
-        goto err1;
-    }
-    if(connect(ctx->fd, result->ai_addr, result->ai_addrlen)!= 0) {
-        if(errno == -EINPROGRESS){
-            //sleep(1);
-        }else{
-           LOG_ERROR("khttp connect to server error %d(%s)\n", errno, strerror(errno));
-           ret = -KHTTP_ERR_CONNECT;
-           goto err1;
+    if(ctx == NULL || (buf == NULL && len > 0)) return -KHTTP_ERR_PARAM;
+    if(ctx->state != KHTTP_STATE_RECV){
+        // Bytes past the previous response are not replayed
+        if(ctx->pending){
+            khttp_free(ctx->pending);
+            ctx->pending = NULL;
+            ctx->pending_len = 0;
         }
+        khttp_recv_begin(ctx);
+        ctx->state = KHTTP_STATE_RECV;
     }
-    //LOG_DEBUG("khttp connect to server successfully\n");
-    freeaddrinfo(result);
-    if(ctx->proto == KHTTP_HTTPS){
+    ctx->rx_bytes += len;
+    int ret = khttp_consume(ctx, buf, len);
+    if(ret != 1) return ret;
+    if(ctx->body == NULL && khttp_body_grow(ctx, 0) != KHTTP_ERR_OK) return -KHTTP_ERR_OOM;
+    ((char *)ctx->body)[ctx->body_len] = 0;
+    ctx->state = KHTTP_STATE_DONE;
+    return 1;
+}
+
 #ifdef OPENSSL
-        if(khttp_ssl_setup(ctx) != KHTTP_ERR_OK){
-            LOG_ERROR("khttp ssl setup failure\n");
-            return -KHTTP_ERR_SSL;
-        }
-        //LOG_DEBUG("khttp setup ssl connection successfully\n");
-#else
-        return -KHTTP_ERR_NOT_SUPP;
+static int khttp_do_handshake(khttp_ctx *ctx)
+{
+    int ret = khttp_ssl_handshake(ctx);
+    if(ret == -KHTTP_ERR_AGAIN){
+        khttp_wait_for(ctx, ctx->want, KHTTP_CONN_TIMEO);
+        return ret;
+    }
+    if(ret != KHTTP_ERR_OK) return ret;
+    ctx->timings.tls_end = khttp_now_us();
+    ctx->timings.tls_reused = ctx->tls_resumed;
+    khttp_metrics_count(ctx->tls_resumed ? KHTTP_COUNT_TLS_RESUMED : KHTTP_COUNT_TLS_FULL);
+    ctx->state = KHTTP_STATE_SEND;
+    return KHTTP_ERR_OK;
+}
 #endif
+
+/*
+ * Arm a transfer. Connection, TLS and parser progress are kept in ctx so
+ * khttp_step() can be driven by khttp_perform() or by an event loop.
+ */
+int khttp_start(khttp_ctx *ctx)
+{
+    int ret = KHTTP_ERR_OK;
+    if(ctx == NULL) return -KHTTP_ERR_PARAM;
+    ctx->count = 0;
+    ctx->fresh = 0;
+    ctx->cont = 0;
+    ctx->hp.status_code = 0;
+    ctx->want = KHTTP_WANT_NONE;
+    memset(&ctx->timings, 0, sizeof(khttp_timings));
+    ctx->timings.start = khttp_now_us();
+    // Scratch of the previous request is dead now
+    khttp_arena_reset(&ctx->arena);
+    //LOG_DEBUG("Send HTTP request\n");
+    if((ret = khttp_build_request(ctx)) != KHTTP_ERR_OK){
+        LOG_ERROR("khttp send HTTP request failure %d\n", ret);
+        ctx->state = KHTTP_STATE_ERROR;
+        ctx->result = ret;
+        khttp_metrics_record(ctx, ret);
+        return ret;
     }
-    int count = 0;
-    for(;;)
-    {
-        if(ctx->hp.status_code == 401){
-            //LOG_DEBUG("Send HTTP authentication response\n");
-            //FIXME change to khttp_send_http_auth
-            if((res = khttp_send_http_auth(ctx)) != 0){
-                LOG_ERROR("khttp send HTTP authentication response failure %d\n", res);
+    ctx->state = ctx->fd < 0 ? KHTTP_STATE_CONNECT : KHTTP_STATE_SEND;
+    ctx->result = -KHTTP_ERR_AGAIN;
+    return KHTTP_ERR_OK;
+}
+
+// Valid until the next khttp_start() on ctx
+const khttp_timings *khttp_get_timings(khttp_ctx *ctx)
+{
+    if(ctx == NULL) return NULL;
+    return &ctx->timings;
+}
+
+/*
+ * Run the transfer until it has to wait for the socket. Returns
+ * -KHTTP_ERR_AGAIN with ctx->fd / ctx->want telling what to wait for,
+ * KHTTP_ERR_OK when the transfer is complete or a negative error.
+ */
+int khttp_step(khttp_ctx *ctx)
+{
+    int ret = KHTTP_ERR_OK;
+    while(ret == KHTTP_ERR_OK){
+        switch(ctx->state){
+            case KHTTP_STATE_CONNECT:
+                ret = khttp_connect_start(ctx);
                 break;
-            }
-            //FIXME
-            ctx->hp.status_code = 0;
-        }else if(ctx->hp.status_code == 200){
-            if(ctx->cont == 1 && ctx->form != NULL){
-                khttp_send_form(ctx);
-                ctx->cont = 0;//Clean continue flag for next read
-                goto end;//Send data then end
-            }
-        }else if(ctx->hp.status_code == 100){
-            if(ctx->cont == 1 && ctx->form != NULL){
-                khttp_send_form(ctx);
-                ctx->cont = 0;//Clean continue flag for next read
-            }
-            //TODO What's next if no form or data to send
-        }else{
-            //LOG_DEBUG("Send HTTP request\n");
-            if((res = khttp_send_http_req(ctx)) != 0){
-                LOG_ERROR("khttp send HTTP request failure %d\n", res);
+            case KHTTP_STATE_RESOLVE:
+                ret = khttp_resolve_done(ctx);
                 break;
-            }
-        }
-        //Free all header before recv data
-        khttp_free_header(ctx);
-        khttp_free_body(ctx);
-        if((res = khttp_recv_http_resp(ctx)) != 0){
-            LOG_ERROR("khttp recv HTTP response failure %d\n", res);
-            ret = res;
-            goto err;
-        }
-        //LOG_DEBUG("receive HTTP response success\n");
-        switch(ctx->hp.status_code)
-        {
-            case 401:
-                str = khttp_find_header(ctx, "WWW-Authenticate");
-                if(khttp_parse_auth(ctx, str) != 0) {
-                    LOG_ERROR("khttp parse auth string failure\n");
-                    goto err;
-                }
-                if(count == 1 || (count == 0 && ctx->auth_type == KHTTP_AUTH_BASIC)){
-                    goto end;
-                }
+            case KHTTP_STATE_CONNECTING:
+                ret = khttp_connect_done(ctx);
                 break;
-            case 200:
-                //LOG_INFO("GOT 200 OK count:%d\n", count);
-                if(ctx->cont == 1 && count == 0){
-                    //LOG_INFO("Got 200 OK before send post data/form\n");
-                    break;
-                }
-                goto end;
+#ifdef OPENSSL
+            case KHTTP_STATE_TLS:
+                ret = khttp_do_handshake(ctx);
                 break;
-            case 100:
-                //LOG_INFO("GOT 100 Continue\n");
-                if(ctx->cont == 1 && count == 0){
-                    break;
-                }
-                //khttp_send_form(ctx);
-                //Send form data...
+#endif
+            case KHTTP_STATE_SEND:
+                ret = khttp_do_send(ctx);
                 break;
-            default:
-                goto end;
+            case KHTTP_STATE_RECV:
+                ret = khttp_do_recv(ctx);
                 break;
+            case KHTTP_STATE_DONE:
+                if(ctx->timings.done == 0){
+                    ctx->timings.done = khttp_now_us();
+                    khttp_metrics_record(ctx, KHTTP_ERR_OK);
+                }
+                khttp_addr_free(ctx);
+                khttp_release(ctx);
+                ctx->want = KHTTP_WANT_NONE;
+                ctx->result = KHTTP_ERR_OK;
+                return KHTTP_ERR_OK;
+            default:
+                return ctx->result;
         }
-        // Session count
-        count ++;
-        //LOG_DEBUG("recv http data\n");
-        //LOG_DEBUG("end\n%s\n", ctx->body);
-        //printf("end\n%s\n", (char *)ctx->body);
     }
-end:
+    if(ret != -KHTTP_ERR_AGAIN){
+        //khttp_dump_header(ctx);
+        khttp_addr_free(ctx);
+        khttp_close(ctx);
+        ctx->want = KHTTP_WANT_NONE;
+        ctx->state = KHTTP_STATE_ERROR;
+        ctx->result = ret;
+        khttp_metrics_record(ctx, ret);
+    }
     return ret;
-err1:
-    freeaddrinfo(result);
-err:
-    //khttp_dump_header(ctx);
+}
+
+// Deadline of the current wait passed
+int khttp_expire(khttp_ctx *ctx)
+{
+    if(ctx->state == KHTTP_STATE_RECV && ctx->expect && ctx->rx_bytes == 0){
+        // No 100 Continue from server, go ahead with the form
+        ctx->expect = 0;
+        int ret = khttp_build_form(ctx);
+        if(ret == KHTTP_ERR_OK){
+            ctx->state = KHTTP_STATE_SEND;
+            return khttp_step(ctx);
+        }
+        ctx->result = ret;
+    }else if(ctx->state == KHTTP_STATE_CONNECTING && khttp_now_ms() < ctx->conn_deadline){
+        // Slow attempt, race it with the next address
+        khttp_race_start(ctx);
+        khttp_race_wait(ctx);
+        return -KHTTP_ERR_AGAIN;
+    }else{
+        LOG_ERROR("khttp transfer timeout\n");
+        ctx->result = -KHTTP_ERR_TIMEOUT;
+    }
+    khttp_addr_free(ctx);
+    khttp_close(ctx);
+    ctx->want = KHTTP_WANT_NONE;
+    ctx->state = KHTTP_STATE_ERROR;
+    khttp_metrics_record(ctx, ctx->result);
+    return ctx->result;
+}
+
+int khttp_perform(khttp_ctx *ctx)
+{
+    int ret = khttp_start(ctx);
+    if(ret == KHTTP_ERR_OK) ret = khttp_step(ctx);
+    while(ret == -KHTTP_ERR_AGAIN){
+        struct pollfd pfd;
+        int64_t timeout = (int64_t)(ctx->deadline - khttp_now_ms());
+        pfd.fd = ctx->wait_fd;
+        pfd.events = ctx->want == KHTTP_WANT_WRITE ? POLLOUT : POLLIN;
+        pfd.revents = 0;
+        int res = poll(&pfd, 1, timeout > 0 ? (int)timeout : 0);
+        if(res < 0 && errno == EINTR) continue;
+        if(res < 0){
+            LOG_ERROR("khttp poll error %d(%s)\n", errno, strerror(errno));
+            ret = -KHTTP_ERR_UNKNOWN;
+            khttp_close(ctx);
+            ctx->state = KHTTP_STATE_ERROR;
+            khttp_metrics_record(ctx, ret);
+            break;
+        }
+        ret = res == 0 ? khttp_expire(ctx) : khttp_step(ctx);
+    }
     return ret;
 }
@@ -2,6 +2,7 @@
 #define __KHTTP_H
 #include <stdio.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <string.h>
 #include <unistd.h>
 #include <netdb.h>
@@ -13,17 +14,21 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 
 #include "http_parser.h"
 
 #ifdef OPENSSL
 #include <openssl/ssl.h>
 #include <openssl/md5.h>
+#include <openssl/evp.h>
 #include <openssl/err.h>
+#include <openssl/rand.h>
 #endif
 
 #define KHTTP_HOST_LEN      1024
 #define KHTTP_PATH_LEN      1024
+#define KHTTP_URI_LEN       8192                        //Request path and query
 #define KHTTP_PASS_LEN      128
 #define KHTTP_USER_LEN      128
 
@@ -42,17 +47,46 @@
 #define KHTTP_HTTP_PORT     80
 #define KHTTP_HTTPS_PORT    443
 
-#define KHTTP_HEADER_MAX    32
+#define KHTTP_HEADER_INIT   64
+#define KHTTP_HEADER_ARENA  4096
 
 #define KHTTP_ENABLE        1
 #define KHTTP_DISABLE       0
 
 #define KHTTP_SEND_TIMEO    10000
 #define KHTTP_RECV_TIMEO    10000
+#define KHTTP_CONN_TIMEO    10000
+#define KHTTP_EXPECT_TIMEO  1000
+#define KHTTP_EYEBALLS_DELAY    250
 
 #define KHTTP_SSL_DEPTH     3
-#define KHTTP_NETWORK_BUF   1500
+#define KHTTP_TLS_SESS_MAX  256
+#define KHTTP_NETWORK_BUF   16384
+#define KHTTP_OUT_SEG       8
+#define KHTTP_SPLICE_LEN    65536
 
+#define KHTTP_BODY_INIT         4096
+#define KHTTP_BODY_PRESIZE_MAX  (16 * 1024 * 1024)
+#define KHTTP_BODY_KEEP         (1024 * 1024)
+#define KHTTP_ARENA_BLOCK       4096
+#define KHTTP_ARENA_KEEP        (64 * 1024)
+#define KHTTP_ENCODE_LEVEL      6                       //zlib level of compressed request bodies
+
+
+#define KHTTP_DNS_ADDR_MAX      8
+#define KHTTP_DNS_TTL           60000
+#define KHTTP_DNS_NEG_TTL       5000
+#define KHTTP_DNS_CACHE_MAX     1024
+#define KHTTP_DNS_THREADS       2
+#define KHTTP_DNS_THREADS_MAX   16
+
+#define KHTTP_POOL_PER_HOST     8
+#define KHTTP_POOL_IDLE_TIMEO   30000
+#define KHTTP_POOL_SPARE        16
+#define KHTTP_AUTH_CACHE_MAX    256
+
+#define KHTTP_HIST_SUB_BITS     3                       //8 sub-buckets per power of 2, 12.5% error
+#define KHTTP_HIST_BUCKETS      312                     //Values up to 2^40 us
 
 #define KHTTP_USER_AGENT    "khttp/0.1"
 
@@ -87,9 +121,29 @@ enum{
     KHTTP_ERR_NOT_SUPP,
     KHTTP_ERR_NO_FILE,
     KHTTP_ERR_FILE_READ,
+    KHTTP_ERR_WRITE,
+    KHTTP_ERR_AGAIN,
     KHTTP_ERR_UNKNOWN
 };
 
+// Latency histograms of khttp_metrics_*
+enum{
+    KHTTP_PHASE_DNS,
+    KHTTP_PHASE_CONNECT,
+    KHTTP_PHASE_TLS,
+    KHTTP_PHASE_TTFB,                                   //Request sent to first response byte
+    KHTTP_PHASE_TOTAL,                                  //Successful transfers only
+    KHTTP_PHASE_MAX
+};
+
+enum{
+    KHTTP_COUNT_CONN_OPEN,
+    KHTTP_COUNT_CONN_REUSE,
+    KHTTP_COUNT_TLS_FULL,
+    KHTTP_COUNT_TLS_RESUMED,
+    KHTTP_COUNT_MAX
+};
+
 enum{
     KHTTP_AUTH_NONE,
     KHTTP_AUTH_DIGEST,
@@ -109,22 +163,156 @@ enum{
     KHTTP_HTTPS
 };
 
+enum{
+    KHTTP_HEADER_NONE,
+    KHTTP_HEADER_FIELD,
+    KHTTP_HEADER_VALUE
+};
+
+enum{
+    KHTTP_WANT_NONE,
+    KHTTP_WANT_READ,
+    KHTTP_WANT_WRITE
+};
+
+enum{
+    KHTTP_STATE_INIT,
+    KHTTP_STATE_CONNECT,
+    KHTTP_STATE_RESOLVE,
+    KHTTP_STATE_CONNECTING,
+    KHTTP_STATE_TLS,
+    KHTTP_STATE_SEND,
+    KHTTP_STATE_RECV,
+    KHTTP_STATE_DONE,
+    KHTTP_STATE_ERROR
+};
+
+enum{
+    KHTTP_PART_HEAD,
+    KHTTP_PART_BODY,
+    KHTTP_PART_END
+};
+
+typedef struct khttp_tls_config khttp_tls_config;
+typedef struct khttp_multi khttp_multi;
+typedef struct khttp_arena_block khttp_arena_block;
+typedef void *(*khttp_malloc_fn)(size_t size, void *userdata);
+typedef void *(*khttp_realloc_fn)(void *ptr, size_t size, void *userdata);
+typedef void (*khttp_free_fn)(void *ptr, void *userdata);
+typedef struct khttp_dns_query khttp_dns_query;
+typedef struct khttp_decoder khttp_decoder;
+typedef struct khttp_encoder khttp_encoder;
+// Return len to go on, anything else aborts the transfer with KHTTP_ERR_WRITE
+typedef size_t (*khttp_write_cb)(const char *buf, size_t len, void *userdata);
+
+// Fill buf with up to len bytes of a form part starting at offset. Return
+// bytes filled, 0 before the declared size aborts with KHTTP_ERR_FILE_READ.
+typedef size_t (*khttp_read_cb)(char *buf, size_t len, size_t offset, void *userdata);
+
+// Form part. Body comes from a file, fd or callback when the form is sent.
+typedef struct khttp_form_part {
+    char                *head;                          //Boundary, part headers, string value
+    size_t              head_len;
+    char                *path;                          //File opened at send time
+    int                 fd;                             //Caller fd read with pread, -1 if none
+    off_t               start;                          //Offset of body in fd
+    size_t              size;                           //Body bytes after head
+    khttp_read_cb       read_cb;
+    void                *read_data;
+    struct khttp_form_part *next;
+}khttp_form_part;
+
+// Scratch memory of one request, see khttp_mem.c
+typedef struct khttp_arena {
+    khttp_arena_block   *head;
+    khttp_arena_block   *curr;
+    size_t              total;
+}khttp_arena;
+
+// Response header as offsets into the header arena
+typedef struct khttp_header {
+    size_t              field;
+    size_t              field_len;
+    size_t              value;
+    size_t              value_len;
+}khttp_header;
+
+// Piece of queued request, in ctx->out at off or caller memory at ext
+typedef struct khttp_seg {
+    const char          *ext;
+    size_t              off;
+    size_t              len;
+}khttp_seg;
+
+typedef struct khttp_addr {
+    struct sockaddr_storage sa;
+    socklen_t           len;
+}khttp_addr;
+
 struct khttp_resp {
     int                 body_len;
     void                *body;
 };
 
+/*
+ * Phases of the last khttp_perform() / khttp_start() in CLOCK_MONOTONIC
+ * microseconds. 0 means the phase did not happen, e.g. no DNS or connect
+ * on a pooled connection. With authentication rounds or a retry each
+ * stamp is the last time the phase ran, bytes add up over all rounds.
+ */
+typedef struct khttp_timings {
+    uint64_t            start;                          //khttp_start()
+    uint64_t            dns_start;
+    uint64_t            dns_end;
+    uint64_t            connect_start;
+    uint64_t            connect_end;
+    uint64_t            tls_start;
+    uint64_t            tls_end;
+    uint64_t            sent;                           //Request fully sent
+    uint64_t            first_byte;                     //First response byte
+    uint64_t            headers;                        //Response headers complete
+    uint64_t            done;                           //Message complete
+    size_t              bytes_sent;                     //Request bytes on the wire
+    size_t              bytes_recv;                     //Response bytes on the wire
+    int                 conn_reused;                    //Connection came from pool
+    int                 tls_reused;                     //Handshake resumed a session
+}khttp_timings;
+
+/*
+ * Log-linear histogram in the style of HdrHistogram. Values below 16 have a
+ * bucket each, above that every power of 2 is split in 8 buckets. One writer
+ * at a time, readers may run concurrently.
+ */
+typedef struct khttp_hist {
+    uint64_t            count;
+    uint64_t            sum;
+    uint64_t            max;
+    uint64_t            bucket[KHTTP_HIST_BUCKETS];
+}khttp_hist;
+
 typedef struct khttp_ctx {
     int                 fd;
-    struct sockaddr_in  serv_addr;
+    struct sockaddr_storage serv_addr;                  //Address of connected server
     int                 proto;                          //KHTTP_HTTP / KHTTP_HTTPS
     int                 method;                         //KHTTP_GET / KHTTP_POST
     int                 header_count;
-    char                *header_field[KHTTP_HEADER_MAX];
-    char                *header_value[KHTTP_HEADER_MAX];
+    int                 header_cap;
+    int                 header_state;                   //Last header callback type
+    int                 header_split;                   //Last field fragment ended a read
+    khttp_header        *headers;
+    char                *header_buf;                    //Arena of NUL terminated names and values
+    size_t              header_len;
+    size_t              header_buf_cap;
+    int                 *header_hash;                   //Open addressing, header index + 1
+    int                 header_hash_cap;
+    int                 header_indexed;                 //Headers in hash table
+    const char          *parse_end;                     //End of buffer being parsed
     char                host[KHTTP_HOST_LEN];
-    char                path[KHTTP_PATH_LEN];
+    char                path[KHTTP_URI_LEN];
     int                 port;
+    int                 keepalive;                      //Return connection to pool after response
+    int                 reused;                         //Connection came from pool
+    size_t              rx_bytes;                       //Bytes received for current response
     // Authentication
     int                 auth_type;
     int                 ssl_method;
@@ -141,33 +329,183 @@ typedef struct khttp_ctx {
     char                boundary[KHTTP_BOUND_LEN];
     // Body
     size_t              body_len;
+    size_t              body_cap;
     void                *body;
     int                 done;
+    khttp_write_cb      write_cb;                       //Deliver body here instead of ctx->body
+    void                *write_data;
+    int                 streaming;                      //Current response goes to write_cb
+    int                 write_abort;                    //write_cb refused data
+    int                 decode;                         //Send Accept-Encoding, decode responses
+    int                 decoding;                       //Current response goes through decoder
+    khttp_decoder       *decoder;                       //Decompression state, kept for the next response
+    char                *pending;                       //Received data after last message
+    size_t              pending_len;
     char                *data;
-    char                *form;
-    size_t              form_len;
+    size_t              data_len;                       //Bytes in data, NUL allowed
+    int                 encode;                         //gzip request bodies of encode_min bytes and up
+    size_t              encode_min;
+    int                 encoding;                       //Request body goes out compressed and chunked
+    khttp_encoder       *encoder;                       //Compression state, kept for the next request
+    khttp_form_part     *form;                          //Parts in send order
+    khttp_form_part     *form_tail;
+    size_t              form_len;                       //Form bytes before closing boundary
+    int                 form_stream;                    //Form or upload being sent
+    int                 form_raw;                       //Upload body, no multipart framing
+    int                 form_stage;                     //KHTTP_PART_* of form_cur
+    khttp_form_part     *form_cur;
+    size_t              form_off;                       //Body bytes of form_cur sent
+    int                 form_fd;                        //Body fd of form_cur
+    int                 form_nosendfile;                //sendfile refused, read instead
+    khttp_form_part     *upload;                        //Request body read from fd
+    int                 download_fd;                    //Final response body goes here, -1 if none
+    int                 splice_pipe[2];                 //Socket to download_fd without copy
+    int                 nosplice;                       //download_fd refused splice
     int                 cont;
     http_parser         hp;
+    khttp_tls_config    *tls;                           //Shared SSL_CTX and session cache
+    int                 tls_user;                       //TLS config set by khttp_set_tls_config
+    int                 tls_resumed;                    //Last handshake resumed a session
+    int                 ktls;                           //Ask OpenSSL for kernel TLS offload
+    struct timeval      timeout;
+    struct khttp_resp   resp;
+    // Transfer state machine
+    int                 state;                          //KHTTP_STATE_*
+    int                 want;                           //KHTTP_WANT_* while state waits
+    uint64_t            deadline;                       //Monotonic ms the wait expires
+    int                 result;                         //Transfer result once finished
+    int                 count;                          //Authentication round
+    int                 fresh;                          //Skip pool, retry on new connection
+    int                 expect;                         //Form waits for 100 Continue
+    khttp_addr          addr[KHTTP_DNS_ADDR_MAX];       //Resolved addresses of host
+    int                 addr_count;
+    int                 addr_next;                      //Next address to connect
+    khttp_dns_query     *dns;                           //Pending async lookup
+    int                 wait_fd;                        //fd the current wait is on
+    int                 race_fd[KHTTP_DNS_ADDR_MAX];    //Connect attempts in flight
+    int                 race_addr[KHTTP_DNS_ADDR_MAX];  //Index in addr of each attempt
+    int                 race_count;
+    int                 race_epfd;                      //All attempts, when more than one
+    uint64_t            conn_deadline;
+    char                *out;                           //Copied request bytes
+    size_t              out_used;
+    size_t              out_cap;
+    khttp_seg           seg[KHTTP_OUT_SEG];             //Queued request pieces
+    int                 seg_count;
+    size_t              out_len;                        //Bytes queued in all pieces
+    size_t              out_off;                        //Bytes already sent
+    char                *req_hdr;                       //Headers from khttp_add_header
+    char                *req_cache;                     //Serialized constant headers
+    size_t              req_cache_len;
+    int                 req_cache_valid;
+    int                 tcp_nodelay;
+    int                 sndbuf;
+    int                 rcvbuf;
+    int                 ka_idle;
+    int                 ka_interval;
+    int                 ka_count;
+    khttp_arena         arena;                          //Per request allocations, reset by khttp_start
+    khttp_timings       timings;
+    khttp_multi         *multi;
+    int                 multi_fd;                       //fd registered to epoll
+    int                 multi_events;
+    struct khttp_ctx    *multi_next;
+    int (*send)(struct khttp_ctx *, void *, int);
+    int (*sendv)(struct khttp_ctx *, struct iovec *, int);
+    int (*recv)(struct khttp_ctx *, void *, int);
+    // Keep at the end. Layout above is the same with or without OPENSSL.
 #ifdef OPENSSL
     BIO                 *bio;
-    SSL_CTX             *ssl_ctx;
     SSL                 *ssl;
 #endif
-    struct timeval      timeout;
-    struct khttp_resp   resp;
-    int (*send)(struct khttp_ctx *, void *, int, int);
-    int (*recv)(struct khttp_ctx *, void *, int, int);
 }khttp_ctx;
 
 khttp_ctx *khttp_new();
 void khttp_destroy(khttp_ctx *ctx);
+void khttp_reset(khttp_ctx *ctx);
 int khttp_perform(khttp_ctx *ctx);
 int khttp_set_method(khttp_ctx *ctx, int method);
 int khttp_set_uri(khttp_ctx *ctx, char *uri);
 int khttp_ssl_set_method(khttp_ctx *ctx, int method);
 int khttp_ssl_skip_auth(khttp_ctx *ctx);
+int khttp_ssl_set_ktls(khttp_ctx *ctx, int enable);
+int khttp_ssl_ktls_send(khttp_ctx *ctx);
 int khttp_ssl_set_cert_key(khttp_ctx *ctx, char *cert, char *key, char *pw);
+khttp_tls_config *khttp_tls_config_new(int method, int skip_auth, char *cert, char *key, char *pw);
+void khttp_tls_config_free(khttp_tls_config *cfg);
+int khttp_set_tls_config(khttp_ctx *ctx, khttp_tls_config *cfg);
+void khttp_tls_cleanup();
 int khttp_set_username_password(khttp_ctx *ctx, char *username, char *password, int auth_type);
 int khttp_set_post_data(khttp_ctx *ctx, char *data);
+int khttp_set_post_data_len(khttp_ctx *ctx, const void *data, size_t len);
 int khttp_set_post_form(khttp_ctx *ctx, char *key, char *value, int type);
+int khttp_set_post_form_fd(khttp_ctx *ctx, char *key, char *filename, int fd);
+int khttp_set_post_form_cb(khttp_ctx *ctx, char *key, char *filename, size_t size, khttp_read_cb cb, void *userdata);
+int khttp_set_keepalive(khttp_ctx *ctx, int enable);
+int khttp_add_header(khttp_ctx *ctx, const char *name, const char *value);
+void khttp_clear_headers(khttp_ctx *ctx);
+int khttp_set_tcp_nodelay(khttp_ctx *ctx, int enable);
+int khttp_set_sock_buf(khttp_ctx *ctx, int sndbuf, int rcvbuf);
+int khttp_set_tcp_keepalive(khttp_ctx *ctx, int idle, int interval, int count);
+int khttp_set_write_cb(khttp_ctx *ctx, khttp_write_cb cb, void *userdata);
+int khttp_set_upload_fd(khttp_ctx *ctx, int fd);
+int khttp_set_download_fd(khttp_ctx *ctx, int fd);
+int khttp_set_decode(khttp_ctx *ctx, int enable);
+int khttp_set_encode(khttp_ctx *ctx, int enable, size_t min_size);
+const khttp_timings *khttp_get_timings(khttp_ctx *ctx);
+uint64_t khttp_now_us();
+char *khttp_find_header(khttp_ctx *ctx, const char *header);
+int khttp_pool_set_limit(int per_host, int idle_timeout);
+void khttp_pool_cleanup();
+void khttp_auth_cleanup();
+int khttp_start(khttp_ctx *ctx);
+int khttp_step(khttp_ctx *ctx);
+int khttp_expire(khttp_ctx *ctx);
+int khttp_feed_response(khttp_ctx *ctx, const char *buf, size_t len);
+khttp_multi *khttp_multi_new();
+void khttp_multi_destroy(khttp_multi *m);
+int khttp_multi_add(khttp_multi *m, khttp_ctx *ctx);
+int khttp_multi_remove(khttp_multi *m, khttp_ctx *ctx);
+int khttp_multi_perform(khttp_multi *m, int *running);
+int khttp_multi_poll(khttp_multi *m, int timeout_ms);
+khttp_ctx *khttp_multi_done(khttp_multi *m, int *result);
+void khttp_multi_unwatch(khttp_ctx *ctx);
+int khttp_dns_set_ttl(int ttl, int neg_ttl);
+int khttp_dns_set_threads(int threads);
+void khttp_dns_stats(unsigned long *hits, unsigned long *misses);
+int khttp_dns_lookup(khttp_ctx *ctx);
+int khttp_dns_lookup_async(khttp_ctx *ctx);
+int khttp_dns_fd(khttp_dns_query *q);
+int khttp_dns_finish(khttp_ctx *ctx);
+void khttp_dns_release(khttp_ctx *ctx);
+void khttp_dns_cleanup();
+int khttp_set_allocator(khttp_malloc_fn m, khttp_realloc_fn r, khttp_free_fn f, void *userdata);
+void *khttp_malloc(size_t size);
+void *khttp_calloc(size_t n, size_t size);
+void *khttp_realloc(void *ptr, size_t size);
+void khttp_free(void *ptr);
+char *khttp_strdup(const char *str);
+void *khttp_arena_alloc(khttp_arena *arena, size_t size);
+void khttp_arena_reset(khttp_arena *arena);
+void khttp_arena_free(khttp_arena *arena);
+void khttp_hist_record(khttp_hist *h, uint64_t value);
+void khttp_hist_merge(khttp_hist *dst, const khttp_hist *src);
+uint64_t khttp_hist_quantile(const khttp_hist *h, double q);
+void khttp_metrics_count(int counter);
+void khttp_metrics_record(khttp_ctx *ctx, int result);
+int khttp_metrics_phase(int phase, khttp_hist *out);
+int khttp_metrics_export(char *buf, size_t len);
+const char *khttp_strerror(int err);
+// Receives decoded body bytes, KHTTP_ERR_OK to go on
+typedef int (*khttp_decode_out)(khttp_ctx *ctx, const char *buf, size_t len);
+const char *khttp_decode_accept();
+int khttp_decode_begin(khttp_ctx *ctx, const char *value);
+int khttp_decode(khttp_ctx *ctx, const char *buf, size_t len, khttp_decode_out out);
+int khttp_decode_end(khttp_ctx *ctx);
+void khttp_decode_free(khttp_ctx *ctx);
+const char *khttp_encode_name();
+int khttp_encode_begin(khttp_ctx *ctx);
+int khttp_encode(khttp_ctx *ctx, const char *buf, size_t len, int finish, char *out, size_t cap, size_t *used);
+int khttp_encode_ended(khttp_ctx *ctx);
+void khttp_encode_free(khttp_ctx *ctx);
 #endif
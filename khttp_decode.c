@@ -0,0 +1,271 @@
+#include "khttp.h"
+#include "log.h"
+#ifdef KHTTP_ZLIB
+#include <zlib.h>
+#endif
+#ifdef KHTTP_BROTLI
+#include <brotli/decode.h>
+#endif
+
+/*
+ * Content-Encoding decoding. The body callback hands every piece of the
+ * compressed body over as it arrives, output goes out in KHTTP_NETWORK_BUF
+ * pieces, the compressed body is never kept. The zlib state is allocated
+ * once per ctx and reset for the next response.
+ */
+
+enum{
+    KHTTP_ENC_IDENTITY,
+    KHTTP_ENC_GZIP,
+    KHTTP_ENC_DEFLATE,
+    KHTTP_ENC_BR
+};
+
+struct khttp_decoder {
+    int                 encoding;                       //KHTTP_ENC_* of the current response
+    int                 ended;                          //End of compressed stream seen
+    int                 member;                         //gzip member finished, another may follow
+    size_t              in;                             //Compressed bytes of the current response
+#ifdef KHTTP_ZLIB
+    z_stream            zs;
+    int                 zs_init;
+    int                 raw;                            //deflate without zlib header
+#endif
+#ifdef KHTTP_BROTLI
+    BrotliDecoderState  *br;
+#endif
+};
+
+#ifdef KHTTP_ZLIB
+static voidpf khttp_zalloc(voidpf opaque, uInt items, uInt size)
+{
+    if(size != 0 && items > SIZE_MAX / size) return NULL;
+    return khttp_malloc((size_t)items * size);
+}
+
+static void khttp_zfree(voidpf opaque, voidpf ptr)
+{
+    khttp_free(ptr);
+}
+#endif
+
+#ifdef KHTTP_BROTLI
+static void *khttp_br_alloc(void *opaque, size_t size)
+{
+    return khttp_malloc(size);
+}
+
+static void khttp_br_free(void *opaque, void *ptr)
+{
+    khttp_free(ptr);
+}
+#endif
+
+// Value for Accept-Encoding, NULL when built without any decoder
+const char *khttp_decode_accept()
+{
+#if defined(KHTTP_ZLIB) && defined(KHTTP_BROTLI)
+    return "gzip, deflate, br";
+#elif defined(KHTTP_ZLIB)
+    return "gzip, deflate";
+#elif defined(KHTTP_BROTLI)
+    return "br";
+#else
+    return NULL;
+#endif
+}
+
+static int khttp_decode_type(const char *value)
+{
+    if(strcasecmp(value, "identity") == 0) return KHTTP_ENC_IDENTITY;
+#ifdef KHTTP_ZLIB
+    if(strcasecmp(value, "gzip") == 0 || strcasecmp(value, "x-gzip") == 0) return KHTTP_ENC_GZIP;
+    if(strcasecmp(value, "deflate") == 0) return KHTTP_ENC_DEFLATE;
+#endif
+#ifdef KHTTP_BROTLI
+    if(strcasecmp(value, "br") == 0) return KHTTP_ENC_BR;
+#endif
+    return -1;
+}
+
+/*
+ * Prepare ctx->decoder for a response with the given Content-Encoding.
+ * Returns 1 when the body has to be decoded, 0 when it is stored as is.
+ * An encoding khttp can not decode leaves the body untouched, the caller
+ * still sees Content-Encoding.
+ */
+int khttp_decode_begin(khttp_ctx *ctx, const char *value)
+{
+    khttp_decoder *d = ctx->decoder;
+    int type = khttp_decode_type(value);
+    if(type < 0){
+        LOG_WARN("khttp unsupported content encoding %s, body kept encoded\n", value);
+        return 0;
+    }
+    if(type == KHTTP_ENC_IDENTITY) return 0;
+    if(d == NULL){
+        d = khttp_calloc(1, sizeof(khttp_decoder));
+        if(d == NULL) return -KHTTP_ERR_OOM;
+        ctx->decoder = d;
+    }
+    d->encoding = type;
+    d->ended = 0;
+    d->member = 0;
+    d->in = 0;
+#ifdef KHTTP_ZLIB
+    if(type == KHTTP_ENC_GZIP || type == KHTTP_ENC_DEFLATE){
+        // 32 detects gzip or zlib header, raw deflate is retried on error
+        d->raw = 0;
+        if(d->zs_init) return inflateReset2(&d->zs, 15 + 32) == Z_OK ? 1 : -KHTTP_ERR_UNKNOWN;
+        d->zs.zalloc = khttp_zalloc;
+        d->zs.zfree = khttp_zfree;
+        d->zs.opaque = NULL;
+        d->zs.next_in = NULL;
+        d->zs.avail_in = 0;
+        if(inflateInit2(&d->zs, 15 + 32) != Z_OK){
+            LOG_ERROR("khttp inflate init failure\n");
+            return -KHTTP_ERR_OOM;
+        }
+        d->zs_init = 1;
+        return 1;
+    }
+#endif
+#ifdef KHTTP_BROTLI
+    if(type == KHTTP_ENC_BR){
+        // No reset in the brotli API, a fresh instance per response
+        if(d->br) BrotliDecoderDestroyInstance(d->br);
+        d->br = BrotliDecoderCreateInstance(khttp_br_alloc, khttp_br_free, NULL);
+        if(d->br == NULL) return -KHTTP_ERR_OOM;
+        return 1;
+    }
+#endif
+    return 0;
+}
+
+#ifdef KHTTP_ZLIB
+static int khttp_decode_zlib(khttp_ctx *ctx, const char *buf, size_t len, khttp_decode_out out)
+{
+    khttp_decoder *d = ctx->decoder;
+    char tmp[KHTTP_NETWORK_BUF];
+    // Bytes after a finished member start the next one
+    if(d->member && len > 0){
+        if(inflateReset(&d->zs) != Z_OK) return -KHTTP_ERR_UNKNOWN;
+        d->member = 0;
+    }
+    int first = d->zs.total_in == 0 && d->zs.total_out == 0;
+    d->zs.next_in = (Bytef *)buf;
+    d->zs.avail_in = len;
+    d->zs.avail_out = 0;
+    // A full output buffer may leave decoded bytes inside zlib
+    while((d->zs.avail_in > 0 || d->zs.avail_out == 0) && !d->ended){
+        d->zs.next_out = (Bytef *)tmp;
+        d->zs.avail_out = sizeof(tmp);
+        int ret = inflate(&d->zs, Z_NO_FLUSH);
+        if(ret == Z_DATA_ERROR && first && d->zs.total_out == 0 && d->encoding == KHTTP_ENC_DEFLATE && !d->raw){
+            // Some servers send deflate without the zlib header
+            if(inflateReset2(&d->zs, -15) != Z_OK) return -KHTTP_ERR_UNKNOWN;
+            d->raw = 1;
+            d->zs.next_in = (Bytef *)buf;
+            d->zs.avail_in = len;
+            continue;
+        }
+        if(ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR){
+            LOG_ERROR("khttp inflate failure %d %s\n", ret, d->zs.msg ? d->zs.msg : "");
+            return -KHTTP_ERR_RECV;
+        }
+        size_t n = sizeof(tmp) - d->zs.avail_out;
+        if(n > 0 && out(ctx, tmp, n) != KHTTP_ERR_OK) return -KHTTP_ERR_WRITE;
+        if(ret == Z_BUF_ERROR) break;
+        if(ret == Z_STREAM_END){
+            // Concatenated gzip members decode as one body, the next may
+            // come with a later read
+            if(d->encoding == KHTTP_ENC_GZIP && d->zs.avail_in > 0){
+                if(inflateReset(&d->zs) != Z_OK) return -KHTTP_ERR_UNKNOWN;
+                continue;
+            }
+            if(d->encoding == KHTTP_ENC_GZIP){
+                d->member = 1;
+                break;
+            }
+            d->ended = 1;
+        }
+    }
+    if(d->ended && d->zs.avail_in > 0){
+        LOG_WARN("khttp ignore %u bytes after compressed body\n", d->zs.avail_in);
+    }
+    return KHTTP_ERR_OK;
+}
+#endif
+
+#ifdef KHTTP_BROTLI
+static int khttp_decode_br(khttp_ctx *ctx, const char *buf, size_t len, khttp_decode_out out)
+{
+    khttp_decoder *d = ctx->decoder;
+    char tmp[KHTTP_NETWORK_BUF];
+    const uint8_t *next_in = (const uint8_t *)buf;
+    size_t avail_in = len;
+    BrotliDecoderResult ret = BROTLI_DECODER_RESULT_NEEDS_MORE_OUTPUT;
+    while(!d->ended && (avail_in > 0 || ret == BROTLI_DECODER_RESULT_NEEDS_MORE_OUTPUT)){
+        uint8_t *next_out = (uint8_t *)tmp;
+        size_t avail_out = sizeof(tmp);
+        ret = BrotliDecoderDecompressStream(d->br, &avail_in, &next_in, &avail_out, &next_out, NULL);
+        if(ret == BROTLI_DECODER_RESULT_ERROR){
+            LOG_ERROR("khttp brotli decode failure %s\n",
+                    BrotliDecoderErrorString(BrotliDecoderGetErrorCode(d->br)));
+            return -KHTTP_ERR_RECV;
+        }
+        size_t n = sizeof(tmp) - avail_out;
+        if(n > 0 && out(ctx, tmp, n) != KHTTP_ERR_OK) return -KHTTP_ERR_WRITE;
+        if(ret == BROTLI_DECODER_RESULT_SUCCESS) d->ended = 1;
+        if(ret == BROTLI_DECODER_RESULT_NEEDS_MORE_INPUT) break;
+    }
+    if(d->ended && avail_in > 0){
+        LOG_WARN("khttp ignore %zu bytes after compressed body\n", avail_in);
+    }
+    return KHTTP_ERR_OK;
+}
+#endif
+
+// Decode one piece of the body and pass the output to out
+int khttp_decode(khttp_ctx *ctx, const char *buf, size_t len, khttp_decode_out out)
+{
+    khttp_decoder *d = ctx->decoder;
+    d->in += len;
+    // Trailing bytes after the stream end are dropped
+    if(d->ended) return KHTTP_ERR_OK;
+#ifdef KHTTP_ZLIB
+    if(d->encoding == KHTTP_ENC_GZIP || d->encoding == KHTTP_ENC_DEFLATE){
+        return khttp_decode_zlib(ctx, buf, len, out);
+    }
+#endif
+#ifdef KHTTP_BROTLI
+    if(d->encoding == KHTTP_ENC_BR) return khttp_decode_br(ctx, buf, len, out);
+#endif
+    return -KHTTP_ERR_NOT_SUPP;
+}
+
+// Body complete. A compressed stream cut short is an error, gzip may end
+// on any member boundary.
+int khttp_decode_end(khttp_ctx *ctx)
+{
+    khttp_decoder *d = ctx->decoder;
+    if(d->in > 0 && !d->ended && !d->member){
+        LOG_ERROR("khttp compressed body truncated after %zu bytes\n", d->in);
+        return -KHTTP_ERR_RECV;
+    }
+    return KHTTP_ERR_OK;
+}
+
+void khttp_decode_free(khttp_ctx *ctx)
+{
+    khttp_decoder *d = ctx->decoder;
+    if(d == NULL) return;
+#ifdef KHTTP_ZLIB
+    if(d->zs_init) inflateEnd(&d->zs);
+#endif
+#ifdef KHTTP_BROTLI
+    if(d->br) BrotliDecoderDestroyInstance(d->br);
+#endif
+    khttp_free(d);
+    ctx->decoder = NULL;
+}
@@ -0,0 +1,439 @@
+#ifdef __linux__
+// pipe2()
+#define _GNU_SOURCE
+#endif
+#include "khttp.h"
+#include "log.h"
+#include <pthread.h>
+
+uint64_t khttp_now_ms();
+int khttp_socket_nonblock(int fd, int enable);
+
+/*
+ * Process-wide resolver cache. Positive answers live dns_ttl ms, failures
+ * dns_neg_ttl ms. Non-blocking transfers resolve on a small thread pool and
+ * wait on a pipe that the worker writes to once the answer is cached.
+ */
+
+typedef struct khttp_dns_entry {
+    char                    *host;
+    int                     err;                        //getaddrinfo error, 0 on success
+    int                     count;
+    khttp_addr              addr[KHTTP_DNS_ADDR_MAX];
+    uint64_t                expire;
+    int                     pending;                    //Queued or being resolved
+    struct khttp_dns_query  *waiters;
+    struct khttp_dns_entry  *next;
+    struct khttp_dns_entry  *job_next;
+}khttp_dns_entry;
+
+struct khttp_dns_query {
+    int                     ref;
+    int                     fd[2];
+    int                     err;
+    int                     count;
+    khttp_addr              addr[KHTTP_DNS_ADDR_MAX];
+    struct khttp_dns_query  *next;
+};
+
+static pthread_mutex_t dns_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dns_cond = PTHREAD_COND_INITIALIZER;
+static khttp_dns_entry *dns_head = NULL;
+static int dns_entries = 0;
+static khttp_dns_entry *job_head = NULL;
+static khttp_dns_entry *job_tail = NULL;
+static pthread_t dns_worker[KHTTP_DNS_THREADS_MAX];
+static int dns_workers = 0;
+static int dns_threads = KHTTP_DNS_THREADS;
+static int dns_stop = 0;
+static int dns_ttl = KHTTP_DNS_TTL;
+static int dns_neg_ttl = KHTTP_DNS_NEG_TTL;
+static unsigned long dns_hits = 0;
+static unsigned long dns_misses = 0;
+
+int khttp_dns_set_ttl(int ttl, int neg_ttl)
+{
+    if(ttl < 0 || neg_ttl < 0) return -KHTTP_ERR_PARAM;
+    pthread_mutex_lock(&dns_lock);
+    dns_ttl = ttl;
+    dns_neg_ttl = neg_ttl;
+    pthread_mutex_unlock(&dns_lock);
+    return KHTTP_ERR_OK;
+}
+
+int khttp_dns_set_threads(int threads)
+{
+    if(threads < 1 || threads > KHTTP_DNS_THREADS_MAX) return -KHTTP_ERR_PARAM;
+    pthread_mutex_lock(&dns_lock);
+    dns_threads = threads;
+    pthread_mutex_unlock(&dns_lock);
+    return KHTTP_ERR_OK;
+}
+
+void khttp_dns_stats(unsigned long *hits, unsigned long *misses)
+{
+    pthread_mutex_lock(&dns_lock);
+    if(hits) *hits = dns_hits;
+    if(misses) *misses = dns_misses;
+    pthread_mutex_unlock(&dns_lock);
+}
+
+// Temporary failures are worth retrying at once, do not cache them
+static int khttp_dns_cacheable(int err)
+{
+    return err != EAI_AGAIN && err != EAI_SYSTEM && err != EAI_MEMORY;
+}
+
+// Interleave address families, first family as the resolver sorted it (RFC 8305)
+static int khttp_dns_getaddrinfo(const char *host, khttp_addr *addr, int *count)
+{
+    struct addrinfo hints;
+    struct addrinfo *res = NULL;
+    struct addrinfo *ai[2] = {NULL, NULL};
+    int n = 0;
+    int k = 0;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_family = AF_UNSPEC;
+    int err = getaddrinfo(host, NULL, &hints, &res);
+    if(err != 0){
+        LOG_ERROR("khttp DNS lookup failure. getaddrinfo: %s\n", gai_strerror(err));
+        return err;
+    }
+    ai[0] = res;
+    for(ai[1] = res; ai[1] != NULL && ai[1]->ai_family == res->ai_family; ai[1] = ai[1]->ai_next);
+    while(n < KHTTP_DNS_ADDR_MAX && (ai[0] || ai[1])){
+        struct addrinfo *curr = ai[k];
+        k = !k;
+        if(curr == NULL) continue;
+        // Advance this family to its next entry
+        int family = curr->ai_family;
+        struct addrinfo *next = curr->ai_next;
+        while(next && ((family == res->ai_family) != (next->ai_family == res->ai_family))) next = next->ai_next;
+        ai[!k] = next;
+        if((curr->ai_family != AF_INET && curr->ai_family != AF_INET6) ||
+                curr->ai_addrlen > sizeof(addr[n].sa)) continue;
+        memcpy(&addr[n].sa, curr->ai_addr, curr->ai_addrlen);
+        addr[n].len = curr->ai_addrlen;
+        n++;
+    }
+    freeaddrinfo(res);
+    *count = n;
+    return n ? 0 : EAI_NONAME;
+}
+
+// Call with dns_lock held
+static khttp_dns_entry *khttp_dns_find(const char *host)
+{
+    khttp_dns_entry *e = NULL;
+    for(e = dns_head; e != NULL; e = e->next){
+        if(strcasecmp(e->host, host) == 0) return e;
+    }
+    return NULL;
+}
+
+// Call with dns_lock held
+static void khttp_dns_evict(khttp_dns_entry **pp)
+{
+    khttp_dns_entry *e = *pp;
+    *pp = e->next;
+    khttp_free(e->host);
+    khttp_free(e);
+    dns_entries --;
+}
+
+/*
+ * Call with dns_lock held. A full cache drops expired idle entries first,
+ * then the idle entry closest to expiry. NULL when every entry is pending.
+ */
+static khttp_dns_entry *khttp_dns_insert(const char *host)
+{
+    khttp_dns_entry **pp = &dns_head;
+    khttp_dns_entry **oldest = NULL;
+    uint64_t now = khttp_now_ms();
+    while(dns_entries >= KHTTP_DNS_CACHE_MAX && *pp){
+        khttp_dns_entry *e = *pp;
+        if(!e->pending && e->expire <= now){
+            khttp_dns_evict(pp);
+        }else{
+            // Newest entries are first, ties go to the older one
+            if(!e->pending && (oldest == NULL || e->expire <= (*oldest)->expire)) oldest = pp;
+            pp = &e->next;
+        }
+    }
+    if(dns_entries >= KHTTP_DNS_CACHE_MAX){
+        if(oldest == NULL) return NULL;
+        khttp_dns_evict(oldest);
+    }
+    khttp_dns_entry *e = khttp_calloc(1, sizeof(khttp_dns_entry));
+    if(!e) return NULL;
+    if((e->host = khttp_strdup(host)) == NULL){
+        khttp_free(e);
+        return NULL;
+    }
+    e->next = dns_head;
+    dns_head = e;
+    dns_entries ++;
+    return e;
+}
+
+// Call with dns_lock held
+static void khttp_dns_store(khttp_dns_entry *e, int err, khttp_addr *addr, int count)
+{
+    e->err = err;
+    e->count = err ? 0 : count;
+    if(e->count) memcpy(e->addr, addr, count * sizeof(khttp_addr));
+    if(err == 0){
+        e->expire = khttp_now_ms() + dns_ttl;
+    }else if(khttp_dns_cacheable(err)){
+        e->expire = khttp_now_ms() + dns_neg_ttl;
+    }else{
+        e->expire = 0;
+    }
+}
+
+static int khttp_dns_result(int err)
+{
+    return err == 0 ? KHTTP_ERR_OK : -KHTTP_ERR_DNS;
+}
+
+// Copy addresses and set the port of this transfer
+static int khttp_dns_copy(khttp_ctx *ctx, khttp_addr *addr, int count)
+{
+    int i = 0;
+    memcpy(ctx->addr, addr, count * sizeof(khttp_addr));
+    for(i = 0; i < count; i++){
+        if(ctx->addr[i].sa.ss_family == AF_INET6){
+            ((struct sockaddr_in6 *)&ctx->addr[i].sa)->sin6_port = htons(ctx->port);
+        }else{
+            ((struct sockaddr_in *)&ctx->addr[i].sa)->sin_port = htons(ctx->port);
+        }
+    }
+    ctx->addr_count = count;
+    ctx->addr_next = 0;
+    return KHTTP_ERR_OK;
+}
+
+// getaddrinfo() in this thread, the answer is not cached when every entry is pending
+static int khttp_dns_resolve(khttp_ctx *ctx)
+{
+    khttp_addr addr[KHTTP_DNS_ADDR_MAX];
+    int count = 0;
+    int err = khttp_dns_getaddrinfo(ctx->host, addr, &count);
+    pthread_mutex_lock(&dns_lock);
+    khttp_dns_entry *e = khttp_dns_find(ctx->host);
+    if(e == NULL) e = khttp_dns_insert(ctx->host);
+    // A worker resolving the same host stores its own answer
+    if(e && !e->pending) khttp_dns_store(e, err, addr, count);
+    pthread_mutex_unlock(&dns_lock);
+    if(err == 0) khttp_dns_copy(ctx, addr, count);
+    return khttp_dns_result(err);
+}
+
+/*
+ * Resolve ctx->host through the cache, calling getaddrinfo() in this thread
+ * on a miss. Fills ctx->addr.
+ */
+int khttp_dns_lookup(khttp_ctx *ctx)
+{
+    int err = 0;
+    pthread_mutex_lock(&dns_lock);
+    khttp_dns_entry *e = khttp_dns_find(ctx->host);
+    if(e && !e->pending && e->expire > khttp_now_ms()){
+        dns_hits ++;
+        err = e->err;
+        if(err == 0) khttp_dns_copy(ctx, e->addr, e->count);
+        pthread_mutex_unlock(&dns_lock);
+        return khttp_dns_result(err);
+    }
+    dns_misses ++;
+    pthread_mutex_unlock(&dns_lock);
+    return khttp_dns_resolve(ctx);
+}
+
+static void khttp_dns_query_unref(khttp_dns_query *q)
+{
+    if(__sync_sub_and_fetch(&q->ref, 1) != 0) return;
+    close(q->fd[0]);
+    close(q->fd[1]);
+    khttp_free(q);
+}
+
+static void *khttp_dns_worker(void *arg)
+{
+    khttp_addr addr[KHTTP_DNS_ADDR_MAX];
+    int count = 0;
+    pthread_mutex_lock(&dns_lock);
+    while(1){
+        while(job_head == NULL && !dns_stop) pthread_cond_wait(&dns_cond, &dns_lock);
+        if(dns_stop) break;
+        khttp_dns_entry *e = job_head;
+        job_head = e->job_next;
+        if(job_head == NULL) job_tail = NULL;
+        e->job_next = NULL;
+        pthread_mutex_unlock(&dns_lock);
+        int err = khttp_dns_getaddrinfo(e->host, addr, &count);
+        pthread_mutex_lock(&dns_lock);
+        khttp_dns_store(e, err, addr, count);
+        e->pending = 0;
+        khttp_dns_query *q = e->waiters;
+        e->waiters = NULL;
+        while(q){
+            khttp_dns_query *next = q->next;
+            q->err = e->err;
+            q->count = e->count;
+            memcpy(q->addr, e->addr, e->count * sizeof(khttp_addr));
+            if(write(q->fd[1], "", 1) < 0){
+                LOG_ERROR("khttp DNS notify failure %d(%s)\n", errno, strerror(errno));
+            }
+            khttp_dns_query_unref(q);
+            q = next;
+        }
+    }
+    pthread_mutex_unlock(&dns_lock);
+    return NULL;
+}
+
+/*
+ * Start resolving ctx->host without blocking. Returns KHTTP_ERR_OK with
+ * ctx->addr filled on a cache hit, -KHTTP_ERR_AGAIN with ctx->dns set while
+ * the answer is pending. Wait for khttp_dns_fd() to become readable and
+ * call khttp_dns_finish().
+ */
+int khttp_dns_lookup_async(khttp_ctx *ctx)
+{
+    int err = 0;
+    khttp_dns_query *q = NULL;
+    pthread_mutex_lock(&dns_lock);
+    khttp_dns_entry *e = khttp_dns_find(ctx->host);
+    if(e && !e->pending && e->expire > khttp_now_ms()){
+        dns_hits ++;
+        err = e->err;
+        if(err == 0) khttp_dns_copy(ctx, e->addr, e->count);
+        pthread_mutex_unlock(&dns_lock);
+        return khttp_dns_result(err);
+    }
+    dns_misses ++;
+    if(e == NULL && (e = khttp_dns_insert(ctx->host)) == NULL){
+        if(dns_entries < KHTTP_DNS_CACHE_MAX) goto oom;
+        // Cache full of lookups in flight, resolve here without caching
+        pthread_mutex_unlock(&dns_lock);
+        LOG_WARN("khttp DNS cache full, resolve %s in place\n", ctx->host);
+        return khttp_dns_resolve(ctx);
+    }
+    if((q = khttp_calloc(1, sizeof(khttp_dns_query))) == NULL) goto oom;
+    // Not inherited by children of a host process that forks and execs
+#ifdef __linux__
+    if(pipe2(q->fd, O_CLOEXEC | O_NONBLOCK) != 0){
+#else
+    if(pipe(q->fd) != 0){
+#endif
+        LOG_ERROR("khttp DNS pipe failure %d(%s)\n", errno, strerror(errno));
+        khttp_free(q);
+        pthread_mutex_unlock(&dns_lock);
+        return -KHTTP_ERR_NO_FD;
+    }
+#ifndef __linux__
+    fcntl(q->fd[0], F_SETFD, FD_CLOEXEC);
+    fcntl(q->fd[1], F_SETFD, FD_CLOEXEC);
+    khttp_socket_nonblock(q->fd[0], 1);
+    khttp_socket_nonblock(q->fd[1], 1);
+#endif
+    // One reference for ctx, one for the worker
+    q->ref = 2;
+    q->next = e->waiters;
+    e->waiters = q;
+    if(!e->pending){
+        // Lookups of the same host share one getaddrinfo call
+        e->pending = 1;
+        if(job_tail) job_tail->job_next = e;
+        else job_head = e;
+        job_tail = e;
+        while(dns_workers < dns_threads){
+            if(pthread_create(&dns_worker[dns_workers], NULL, khttp_dns_worker, NULL) != 0){
+                LOG_ERROR("khttp DNS worker create failure\n");
+                break;
+            }
+            dns_workers ++;
+        }
+        pthread_cond_signal(&dns_cond);
+    }
+    pthread_mutex_unlock(&dns_lock);
+    ctx->dns = q;
+    return -KHTTP_ERR_AGAIN;
+oom:
+    pthread_mutex_unlock(&dns_lock);
+    return -KHTTP_ERR_OOM;
+}
+
+int khttp_dns_fd(khttp_dns_query *q)
+{
+    return q->fd[0];
+}
+
+// Collect a pending answer. -KHTTP_ERR_AGAIN if the worker is not done yet.
+int khttp_dns_finish(khttp_ctx *ctx)
+{
+    char c = 0;
+    khttp_dns_query *q = ctx->dns;
+    if(q == NULL) return -KHTTP_ERR_PARAM;
+    if(read(q->fd[0], &c, 1) != 1){
+        ctx->want = KHTTP_WANT_READ;
+        return -KHTTP_ERR_AGAIN;
+    }
+    int err = q->err;
+    if(err == 0) khttp_dns_copy(ctx, q->addr, q->count);
+    khttp_dns_release(ctx);
+    return khttp_dns_result(err);
+}
+
+// Drop interest in a pending lookup. The worker still caches the answer.
+void khttp_dns_release(khttp_ctx *ctx)
+{
+    if(ctx->dns == NULL) return;
+    if(ctx->multi) khttp_multi_unwatch(ctx);
+    khttp_dns_query_unref(ctx->dns);
+    ctx->dns = NULL;
+}
+
+void khttp_dns_cleanup()
+{
+    int i = 0;
+    pthread_mutex_lock(&dns_lock);
+    dns_stop = 1;
+    pthread_cond_broadcast(&dns_cond);
+    pthread_mutex_unlock(&dns_lock);
+    for(i = 0; i < dns_workers; i++){
+        pthread_join(dns_worker[i], NULL);
+    }
+    pthread_mutex_lock(&dns_lock);
+    dns_workers = 0;
+    dns_stop = 0;
+    while(job_head){
+        khttp_dns_entry *e = job_head;
+        job_head = e->job_next;
+        e->job_next = NULL;
+        e->pending = 0;
+        // Queued lookups will never be answered, wake waiters with an error
+        while(e->waiters){
+            khttp_dns_query *q = e->waiters;
+            e->waiters = q->next;
+            q->err = EAI_FAIL;
+            if(write(q->fd[1], "", 1) < 0){
+                LOG_ERROR("khttp DNS notify failure %d(%s)\n", errno, strerror(errno));
+            }
+            khttp_dns_query_unref(q);
+        }
+    }
+    job_tail = NULL;
+    while(dns_head){
+        khttp_dns_entry *e = dns_head;
+        dns_head = e->next;
+        khttp_free(e->host);
+        khttp_free(e);
+    }
+    dns_entries = 0;
+    dns_hits = 0;
+    dns_misses = 0;
+    pthread_mutex_unlock(&dns_lock);
+}
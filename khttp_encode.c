@@ -0,0 +1,117 @@
+#include "khttp.h"
+#include "log.h"
+#ifdef KHTTP_ZLIB
+#include <zlib.h>
+#endif
+
+/*
+ * gzip request bodies. The sender pulls compressed output one chunk at a
+ * time as the socket drains, so only the zlib window and one chunk are
+ * held whatever the body size. The deflate state is kept per ctx and reset
+ * for the next request.
+ */
+
+struct khttp_encoder {
+    int                 ended;                          //Stream trailer produced
+#ifdef KHTTP_ZLIB
+    z_stream            zs;
+    int                 zs_init;
+#endif
+};
+
+#ifdef KHTTP_ZLIB
+static voidpf khttp_zalloc(voidpf opaque, uInt items, uInt size)
+{
+    if(size != 0 && items > SIZE_MAX / size) return NULL;
+    return khttp_malloc((size_t)items * size);
+}
+
+static void khttp_zfree(voidpf opaque, voidpf ptr)
+{
+    khttp_free(ptr);
+}
+#endif
+
+// Content-Encoding of compressed request bodies, NULL when built without zlib
+const char *khttp_encode_name()
+{
+#ifdef KHTTP_ZLIB
+    return "gzip";
+#else
+    return NULL;
+#endif
+}
+
+int khttp_encode_begin(khttp_ctx *ctx)
+{
+#ifdef KHTTP_ZLIB
+    khttp_encoder *e = ctx->encoder;
+    if(e == NULL){
+        e = khttp_calloc(1, sizeof(khttp_encoder));
+        if(e == NULL) return -KHTTP_ERR_OOM;
+        ctx->encoder = e;
+    }
+    e->ended = 0;
+    if(e->zs_init) return deflateReset(&e->zs) == Z_OK ? KHTTP_ERR_OK : -KHTTP_ERR_UNKNOWN;
+    e->zs.zalloc = khttp_zalloc;
+    e->zs.zfree = khttp_zfree;
+    e->zs.opaque = NULL;
+    // 16 asks for the gzip wrapper
+    if(deflateInit2(&e->zs, KHTTP_ENCODE_LEVEL, Z_DEFLATED, 16 + 15, 8, Z_DEFAULT_STRATEGY) != Z_OK){
+        LOG_ERROR("khttp deflate init failure\n");
+        return -KHTTP_ERR_OOM;
+    }
+    e->zs_init = 1;
+    return KHTTP_ERR_OK;
+#else
+    return -KHTTP_ERR_NOT_SUPP;
+#endif
+}
+
+/*
+ * Compress up to len bytes of buf into out. finish says buf holds the end
+ * of the body. *used gets the input bytes taken, the rest has to be passed
+ * again. Returns the bytes written to out.
+ */
+int khttp_encode(khttp_ctx *ctx, const char *buf, size_t len, int finish, char *out, size_t cap, size_t *used)
+{
+#ifdef KHTTP_ZLIB
+    khttp_encoder *e = ctx->encoder;
+    *used = 0;
+    if(e->ended) return 0;
+    if(len > UINT_MAX){
+        len = UINT_MAX;
+        finish = 0;
+    }
+    e->zs.next_in = (Bytef *)buf;
+    e->zs.avail_in = len;
+    e->zs.next_out = (Bytef *)out;
+    e->zs.avail_out = cap;
+    int ret = deflate(&e->zs, finish ? Z_FINISH : Z_NO_FLUSH);
+    if(ret == Z_STREAM_ERROR){
+        LOG_ERROR("khttp deflate failure\n");
+        return -KHTTP_ERR_UNKNOWN;
+    }
+    if(ret == Z_STREAM_END) e->ended = 1;
+    *used = len - e->zs.avail_in;
+    return cap - e->zs.avail_out;
+#else
+    return -KHTTP_ERR_NOT_SUPP;
+#endif
+}
+
+int khttp_encode_ended(khttp_ctx *ctx)
+{
+    return ctx->encoder && ctx->encoder->ended;
+}
+
+void khttp_encode_free(khttp_ctx *ctx)
+{
+    khttp_encoder *e = ctx->encoder;
+    if(e == NULL) return;
+#ifdef KHTTP_ZLIB
+    if(e->zs_init) deflateEnd(&e->zs);
+#endif
+    khttp_free(e);
+    ctx->encoder = NULL;
+}
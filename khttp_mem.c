@@ -0,0 +1,142 @@
+#include "khttp.h"
+#include "log.h"
+
+/*
+ * Every allocation of the library goes through these hooks. Set them before
+ * the first khttp call, memory allocated with one set must not be released
+ * with another. Hooks are called from resolver threads too.
+ */
+
+static void *khttp_libc_malloc(size_t size, void *userdata)
+{
+    return malloc(size);
+}
+
+static void *khttp_libc_realloc(void *ptr, size_t size, void *userdata)
+{
+    return realloc(ptr, size);
+}
+
+static void khttp_libc_free(void *ptr, void *userdata)
+{
+    free(ptr);
+}
+
+static khttp_malloc_fn mem_malloc = khttp_libc_malloc;
+static khttp_realloc_fn mem_realloc = khttp_libc_realloc;
+static khttp_free_fn mem_free = khttp_libc_free;
+static void *mem_userdata = NULL;
+
+// NULL hooks restore libc malloc/realloc/free
+int khttp_set_allocator(khttp_malloc_fn m, khttp_realloc_fn r, khttp_free_fn f, void *userdata)
+{
+    if((m == NULL) != (r == NULL) || (m == NULL) != (f == NULL)) return -KHTTP_ERR_PARAM;
+    mem_malloc = m ? m : khttp_libc_malloc;
+    mem_realloc = r ? r : khttp_libc_realloc;
+    mem_free = f ? f : khttp_libc_free;
+    mem_userdata = m ? userdata : NULL;
+    return KHTTP_ERR_OK;
+}
+
+void *khttp_malloc(size_t size)
+{
+    return mem_malloc(size, mem_userdata);
+}
+
+void *khttp_calloc(size_t n, size_t size)
+{
+    if(size && n > SIZE_MAX / size) return NULL;
+    void *ptr = mem_malloc(n * size, mem_userdata);
+    if(ptr) memset(ptr, 0, n * size);
+    return ptr;
+}
+
+void *khttp_realloc(void *ptr, size_t size)
+{
+    return mem_realloc(ptr, size, mem_userdata);
+}
+
+void khttp_free(void *ptr)
+{
+    if(ptr) mem_free(ptr, mem_userdata);
+}
+
+char *khttp_strdup(const char *str)
+{
+    size_t len = strlen(str) + 1;
+    char *dup = mem_malloc(len, mem_userdata);
+    if(dup) memcpy(dup, str, len);
+    return dup;
+}
+
+/*
+ * Bump allocator for memory that lives for one request. Blocks are kept
+ * across requests, reset only rewinds to the first one. Blocks beyond
+ * KHTTP_ARENA_KEEP are returned so one big request does not pin memory.
+ */
+struct khttp_arena_block {
+    struct khttp_arena_block    *next;
+    size_t                      size;
+    size_t                      used;
+};
+
+#define KHTTP_ARENA_ALIGN(n)    (((n) + 15) & ~(size_t)15)
+#define KHTTP_ARENA_HDR         KHTTP_ARENA_ALIGN(sizeof(khttp_arena_block))
+
+void *khttp_arena_alloc(khttp_arena *arena, size_t size)
+{
+    khttp_arena_block *blk = arena->curr;
+    size = KHTTP_ARENA_ALIGN(size);
+    // Next kept block may be big enough, else add one after current
+    while(blk && blk->used + size > blk->size){
+        blk = blk->next;
+        if(blk) blk->used = 0;
+    }
+    if(blk == NULL){
+        size_t cap = size > KHTTP_ARENA_BLOCK ? size : KHTTP_ARENA_BLOCK;
+        if((blk = khttp_malloc(KHTTP_ARENA_HDR + cap)) == NULL) return NULL;
+        blk->size = cap;
+        blk->used = 0;
+        if(arena->curr){
+            blk->next = arena->curr->next;
+            arena->curr->next = blk;
+        }else{
+            blk->next = arena->head;
+            arena->head = blk;
+        }
+        arena->total += cap;
+    }
+    arena->curr = blk;
+    void *ptr = (char *)blk + KHTTP_ARENA_HDR + blk->used;
+    blk->used += size;
+    return ptr;
+}
+
+void khttp_arena_reset(khttp_arena *arena)
+{
+    khttp_arena_block *blk = arena->head;
+    if(blk == NULL) return;
+    if(arena->total > KHTTP_ARENA_KEEP){
+        khttp_arena_block *next = blk->next;
+        blk->next = NULL;
+        arena->total = blk->size;
+        while(next){
+            khttp_arena_block *tmp = next->next;
+            khttp_free(next);
+            next = tmp;
+        }
+    }
+    blk->used = 0;
+    arena->curr = blk;
+}
+
+void khttp_arena_free(khttp_arena *arena)
+{
+    khttp_arena_block *blk = arena->head;
+    while(blk){
+        khttp_arena_block *next = blk->next;
+        khttp_free(blk);
+        blk = next;
+    }
+    memset(arena, 0, sizeof(khttp_arena));
+}
@@ -0,0 +1,305 @@
+#include "khttp.h"
+#include "log.h"
+#include <pthread.h>
+#include <stdarg.h>
+
+void khttp_dns_stats(unsigned long *hits, unsigned long *misses);
+
+/*
+ * Process wide metrics. Every thread records into its own shard, so a
+ * request costs a few plain stores and no lock or atomic read-modify-write.
+ * Shards of exited threads are handed to new threads with their counts, a
+ * snapshot adds all shards up.
+ */
+#define KHTTP_METRIC_METHODS    (KHTTP_DELETE + 1)
+#define KHTTP_METRIC_STATUS     6                       //No response, 1xx .. 5xx
+#define KHTTP_METRIC_ERRS       (KHTTP_ERR_UNKNOWN + 1)
+
+// Single writer per shard. Relaxed load/store keep readers race free and
+// compile to plain moves.
+#define KHTTP_METRIC_ADD(v, n)  __atomic_store_n(&(v), __atomic_load_n(&(v), __ATOMIC_RELAXED) + (n), __ATOMIC_RELAXED)
+#define KHTTP_METRIC_GET(v)     __atomic_load_n(&(v), __ATOMIC_RELAXED)
+
+typedef struct khttp_metrics_shard {
+    uint64_t                    requests[KHTTP_METRIC_METHODS][KHTTP_METRIC_STATUS];
+    uint64_t                    errors[KHTTP_METRIC_ERRS];
+    uint64_t                    bytes_sent;
+    uint64_t                    bytes_recv;
+    uint64_t                    count[KHTTP_COUNT_MAX];
+    khttp_hist                  phase[KHTTP_PHASE_MAX];
+    int                         live;                   //Owned by a running thread
+    struct khttp_metrics_shard  *next;
+}khttp_metrics_shard;
+
+static pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+static khttp_metrics_shard *metrics_head = NULL;
+static pthread_once_t metrics_once = PTHREAD_ONCE_INIT;
+static pthread_key_t metrics_key;
+static __thread khttp_metrics_shard *metrics_shard = NULL;
+
+static char *metrics_method[KHTTP_METRIC_METHODS] = {"GET", "POST", "PUT", "DELETE"};
+static char *metrics_status[KHTTP_METRIC_STATUS] = {"none", "1xx", "2xx", "3xx", "4xx", "5xx"};
+static char *metrics_err[KHTTP_METRIC_ERRS] = {
+    "ok", "timeout", "dns", "sock", "ssl", "oom", "send", "recv", "param",
+    "connect", "disconn", "no_fd", "not_supp", "no_file", "file_read",
+    "write", "again", "unknown"
+};
+static char *metrics_phase[KHTTP_PHASE_MAX] = {"dns", "connect", "tls", "ttfb", "total"};
+
+static int khttp_hist_index(uint64_t value)
+{
+    if(value < (2 << KHTTP_HIST_SUB_BITS)) return value;
+    int msb = 63 - __builtin_clzll(value);
+    int idx = (msb - KHTTP_HIST_SUB_BITS) * (1 << KHTTP_HIST_SUB_BITS) + (value >> (msb - KHTTP_HIST_SUB_BITS));
+    return idx < KHTTP_HIST_BUCKETS ? idx : KHTTP_HIST_BUCKETS - 1;
+}
+
+// Smallest value that lands in bucket idx
+static uint64_t khttp_hist_lowest(int idx)
+{
+    int sub = 1 << KHTTP_HIST_SUB_BITS;
+    if(idx < 2 * sub) return idx;
+    int shift = idx / sub - 1;
+    return (uint64_t)(idx % sub + sub) << shift;
+}
+
+void khttp_hist_record(khttp_hist *h, uint64_t value)
+{
+    KHTTP_METRIC_ADD(h->bucket[khttp_hist_index(value)], 1);
+    KHTTP_METRIC_ADD(h->count, 1);
+    KHTTP_METRIC_ADD(h->sum, value);
+    if(value > KHTTP_METRIC_GET(h->max)) __atomic_store_n(&h->max, value, __ATOMIC_RELAXED);
+}
+
+void khttp_hist_merge(khttp_hist *dst, const khttp_hist *src)
+{
+    int i = 0;
+    for(i = 0; i < KHTTP_HIST_BUCKETS; i++){
+        dst->bucket[i] += KHTTP_METRIC_GET(src->bucket[i]);
+    }
+    dst->count += KHTTP_METRIC_GET(src->count);
+    dst->sum += KHTTP_METRIC_GET(src->sum);
+    uint64_t max = KHTTP_METRIC_GET(src->max);
+    if(max > dst->max) dst->max = max;
+}
+
+// Highest value equivalent to quantile q (0..1), 0 when empty
+uint64_t khttp_hist_quantile(const khttp_hist *h, double q)
+{
+    uint64_t seen = 0;
+    int i = 0;
+    if(h->count == 0) return 0;
+    if(q < 0) q = 0;
+    if(q > 1) q = 1;
+    uint64_t rank = (uint64_t)(q * h->count + 0.5);
+    if(rank < 1) rank = 1;
+    for(i = 0; i < KHTTP_HIST_BUCKETS; i++){
+        seen += h->bucket[i];
+        if(seen < rank) continue;
+        if(i + 1 >= KHTTP_HIST_BUCKETS) return h->max;
+        uint64_t top = khttp_hist_lowest(i + 1) - 1;
+        return top < h->max ? top : h->max;
+    }
+    return h->max;
+}
+
+static void khttp_metrics_exit(void *ptr)
+{
+    khttp_metrics_shard *shard = ptr;
+    pthread_mutex_lock(&metrics_lock);
+    shard->live = 0;
+    pthread_mutex_unlock(&metrics_lock);
+}
+
+static void khttp_metrics_init()
+{
+    pthread_key_create(&metrics_key, khttp_metrics_exit);
+}
+
+static khttp_metrics_shard *khttp_metrics_shard_get()
+{
+    khttp_metrics_shard *shard = metrics_shard;
+    if(shard) return shard;
+    pthread_once(&metrics_once, khttp_metrics_init);
+    pthread_mutex_lock(&metrics_lock);
+    // Take over the shard of an exited thread, its counts stay in the total
+    for(shard = metrics_head; shard; shard = shard->next){
+        if(!shard->live) break;
+    }
+    if(shard == NULL && (shard = khttp_calloc(1, sizeof(khttp_metrics_shard))) != NULL){
+        shard->next = metrics_head;
+        metrics_head = shard;
+    }
+    if(shard) shard->live = 1;
+    pthread_mutex_unlock(&metrics_lock);
+    if(shard == NULL) return NULL;
+    pthread_setspecific(metrics_key, shard);
+    metrics_shard = shard;
+    return shard;
+}
+
+void khttp_metrics_count(int counter)
+{
+    khttp_metrics_shard *shard = khttp_metrics_shard_get();
+    if(shard == NULL || counter < 0 || counter >= KHTTP_COUNT_MAX) return;
+    KHTTP_METRIC_ADD(shard->count[counter], 1);
+}
+
+static void khttp_metrics_span(khttp_metrics_shard *shard, int phase, uint64_t from, uint64_t to)
+{
+    if(from == 0 || to < from) return;
+    khttp_hist_record(&shard->phase[phase], to - from);
+}
+
+// Called once when a transfer finishes, result is its return code
+void khttp_metrics_record(khttp_ctx *ctx, int result)
+{
+    khttp_metrics_shard *shard = khttp_metrics_shard_get();
+    const khttp_timings *t = &ctx->timings;
+    if(shard == NULL) return;
+    int status = ctx->hp.status_code / 100;
+    if(status < 1 || status >= KHTTP_METRIC_STATUS) status = 0;
+    if(ctx->method >= 0 && ctx->method < KHTTP_METRIC_METHODS){
+        KHTTP_METRIC_ADD(shard->requests[ctx->method][status], 1);
+    }
+    int err = result < 0 ? -result : result;
+    if(err >= KHTTP_METRIC_ERRS) err = KHTTP_ERR_UNKNOWN;
+    if(err != KHTTP_ERR_OK) KHTTP_METRIC_ADD(shard->errors[err], 1);
+    KHTTP_METRIC_ADD(shard->bytes_sent, t->bytes_sent);
+    KHTTP_METRIC_ADD(shard->bytes_recv, t->bytes_recv);
+    khttp_metrics_span(shard, KHTTP_PHASE_DNS, t->dns_start, t->dns_end);
+    khttp_metrics_span(shard, KHTTP_PHASE_CONNECT, t->connect_start, t->connect_end);
+    khttp_metrics_span(shard, KHTTP_PHASE_TLS, t->tls_start, t->tls_end);
+    if(t->first_byte) khttp_metrics_span(shard, KHTTP_PHASE_TTFB, t->sent, t->first_byte);
+    if(result == KHTTP_ERR_OK) khttp_metrics_span(shard, KHTTP_PHASE_TOTAL, t->start, t->done);
+}
+
+// Sum of all shards for one phase, in microseconds
+int khttp_metrics_phase(int phase, khttp_hist *out)
+{
+    khttp_metrics_shard *shard = NULL;
+    if(phase < 0 || phase >= KHTTP_PHASE_MAX || out == NULL) return -KHTTP_ERR_PARAM;
+    memset(out, 0, sizeof(khttp_hist));
+    pthread_mutex_lock(&metrics_lock);
+    for(shard = metrics_head; shard; shard = shard->next){
+        khttp_hist_merge(out, &shard->phase[phase]);
+    }
+    pthread_mutex_unlock(&metrics_lock);
+    return KHTTP_ERR_OK;
+}
+
+typedef struct {
+    char        *buf;
+    size_t      len;
+    size_t      used;                                   //Bytes the full text needs
+}khttp_metrics_out;
+
+static void khttp_metrics_printf(khttp_metrics_out *o, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(o->used < o->len ? o->buf + o->used : NULL,
+            o->used < o->len ? o->len - o->used : 0, fmt, ap);
+    va_end(ap);
+    if(n > 0) o->used += n;
+}
+
+// Short name of a KHTTP_ERR_* code, either sign
+const char *khttp_strerror(int err)
+{
+    if(err < 0) err = -err;
+    if(err >= KHTTP_METRIC_ERRS) err = KHTTP_ERR_UNKNOWN;
+    return metrics_err[err];
+}
+
+/*
+ * Prometheus text exposition of all metrics into buf. Returns the length of
+ * the full text like snprintf, output is cut when it is >= len.
+ */
+int khttp_metrics_export(char *buf, size_t len)
+{
+    khttp_metrics_shard *shard = NULL;
+    khttp_metrics_shard *sum = NULL;
+    khttp_metrics_out o = {buf, len, 0};
+    unsigned long hits = 0;
+    unsigned long misses = 0;
+    int i = 0, j = 0;
+    if(buf == NULL && len > 0) return -KHTTP_ERR_PARAM;
+    if(len > 0) buf[0] = 0;
+    if((sum = khttp_calloc(1, sizeof(khttp_metrics_shard))) == NULL) return -KHTTP_ERR_OOM;
+    pthread_mutex_lock(&metrics_lock);
+    for(shard = metrics_head; shard; shard = shard->next){
+        for(i = 0; i < KHTTP_METRIC_METHODS; i++){
+            for(j = 0; j < KHTTP_METRIC_STATUS; j++) sum->requests[i][j] += KHTTP_METRIC_GET(shard->requests[i][j]);
+        }
+        for(i = 0; i < KHTTP_METRIC_ERRS; i++) sum->errors[i] += KHTTP_METRIC_GET(shard->errors[i]);
+        for(i = 0; i < KHTTP_COUNT_MAX; i++) sum->count[i] += KHTTP_METRIC_GET(shard->count[i]);
+        for(i = 0; i < KHTTP_PHASE_MAX; i++) khttp_hist_merge(&sum->phase[i], &shard->phase[i]);
+        sum->bytes_sent += KHTTP_METRIC_GET(shard->bytes_sent);
+        sum->bytes_recv += KHTTP_METRIC_GET(shard->bytes_recv);
+    }
+    pthread_mutex_unlock(&metrics_lock);
+    khttp_dns_stats(&hits, &misses);
+
+    khttp_metrics_printf(&o, "# HELP khttp_requests_total Finished transfers by method and response status class.\n"
+            "# TYPE khttp_requests_total counter\n");
+    for(i = 0; i < KHTTP_METRIC_METHODS; i++){
+        for(j = 0; j < KHTTP_METRIC_STATUS; j++){
+            if(sum->requests[i][j] == 0) continue;
+            khttp_metrics_printf(&o, "khttp_requests_total{method=\"%s\",status=\"%s\"} %llu\n",
+                    metrics_method[i], metrics_status[j], (unsigned long long)sum->requests[i][j]);
+        }
+    }
+    khttp_metrics_printf(&o, "# HELP khttp_errors_total Failed transfers by KHTTP_ERR code.\n"
+            "# TYPE khttp_errors_total counter\n");
+    for(i = 1; i < KHTTP_METRIC_ERRS; i++){
+        khttp_metrics_printf(&o, "khttp_errors_total{code=\"%s\"} %llu\n", metrics_err[i], (unsigned long long)sum->errors[i]);
+    }
+    khttp_metrics_printf(&o, "# HELP khttp_bytes_sent_total Request bytes written to connections.\n"
+            "# TYPE khttp_bytes_sent_total counter\n"
+            "khttp_bytes_sent_total %llu\n"
+            "# HELP khttp_bytes_received_total Response bytes read from connections.\n"
+            "# TYPE khttp_bytes_received_total counter\n"
+            "khttp_bytes_received_total %llu\n",
+            (unsigned long long)sum->bytes_sent, (unsigned long long)sum->bytes_recv);
+    khttp_metrics_printf(&o, "# HELP khttp_connections_total Connections opened or taken from the pool.\n"
+            "# TYPE khttp_connections_total counter\n"
+            "khttp_connections_total{state=\"opened\"} %llu\n"
+            "khttp_connections_total{state=\"reused\"} %llu\n",
+            (unsigned long long)sum->count[KHTTP_COUNT_CONN_OPEN], (unsigned long long)sum->count[KHTTP_COUNT_CONN_REUSE]);
+    khttp_metrics_printf(&o, "# HELP khttp_tls_handshakes_total TLS handshakes by type.\n"
+            "# TYPE khttp_tls_handshakes_total counter\n"
+            "khttp_tls_handshakes_total{type=\"full\"} %llu\n"
+            "khttp_tls_handshakes_total{type=\"resumed\"} %llu\n",
+            (unsigned long long)sum->count[KHTTP_COUNT_TLS_FULL], (unsigned long long)sum->count[KHTTP_COUNT_TLS_RESUMED]);
+    khttp_metrics_printf(&o, "# HELP khttp_dns_cache_total DNS cache lookups.\n"
+            "# TYPE khttp_dns_cache_total counter\n"
+            "khttp_dns_cache_total{result=\"hit\"} %lu\n"
+            "khttp_dns_cache_total{result=\"miss\"} %lu\n", hits, misses);
+    khttp_metrics_printf(&o, "# HELP khttp_phase_duration_seconds Time spent in each transfer phase, "
+            "in whole microseconds, le bounds are 2^k-1 us.\n"
+            "# TYPE khttp_phase_duration_seconds histogram\n");
+    for(i = 0; i < KHTTP_PHASE_MAX; i++){
+        khttp_hist *h = &sum->phase[i];
+        uint64_t seen = 0;
+        int idx = 0;
+        int k = 0;
+        // Fixed le set, one per power of 2 from 16us to 2^36us. Samples are
+        // whole us, a bucket ending below 2^k holds everything up to 2^k-1
+        // and le is inclusive, so that is the bound exported.
+        for(k = 4; k <= 36; k++){
+            int end = khttp_hist_index((uint64_t)1 << k);
+            for(; idx < end; idx++) seen += h->bucket[idx];
+            khttp_metrics_printf(&o, "khttp_phase_duration_seconds_bucket{phase=\"%s\",le=\"%.6f\"} %llu\n",
+                    metrics_phase[i], (double)(khttp_hist_lowest(end) - 1) / 1e6, (unsigned long long)seen);
+        }
+        khttp_metrics_printf(&o, "khttp_phase_duration_seconds_bucket{phase=\"%s\",le=\"+Inf\"} %llu\n"
+                "khttp_phase_duration_seconds_sum{phase=\"%s\"} %.6f\n"
+                "khttp_phase_duration_seconds_count{phase=\"%s\"} %llu\n",
+                metrics_phase[i], (unsigned long long)h->count,
+                metrics_phase[i], (double)h->sum / 1e6,
+                metrics_phase[i], (unsigned long long)h->count);
+    }
+    khttp_free(sum);
+    return o.used > INT_MAX ? INT_MAX : (int)o.used;
+}
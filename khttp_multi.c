@@ -0,0 +1,244 @@
+#include "khttp.h"
+#include "log.h"
+
+uint64_t khttp_now_ms();
+void khttp_close(khttp_ctx *ctx);
+
+#ifdef __linux__
+#include <sys/epoll.h>
+
+#define KHTTP_MULTI_EVENTS  64
+
+struct khttp_multi {
+    int                 epfd;
+    int                 running;
+    khttp_ctx           *active;                        //Transfers in progress
+    khttp_ctx           *done;                          //Finished, not yet collected
+    khttp_ctx           *done_tail;
+};
+
+khttp_multi *khttp_multi_new()
+{
+    khttp_multi *m = khttp_calloc(1, sizeof(khttp_multi));
+    if(!m){
+        LOG_ERROR("khttp multi create failure out of memory\n");
+        return NULL;
+    }
+    if((m->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0){
+        LOG_ERROR("khttp epoll create failure %d(%s)\n", errno, strerror(errno));
+        khttp_free(m);
+        return NULL;
+    }
+    return m;
+}
+
+void khttp_multi_unwatch(khttp_ctx *ctx)
+{
+    if(ctx->multi == NULL || ctx->multi_fd < 0) return;
+    epoll_ctl(ctx->multi->epfd, EPOLL_CTL_DEL, ctx->multi_fd, NULL);
+    ctx->multi_fd = -1;
+    ctx->multi_events = 0;
+}
+
+static int khttp_multi_watch(khttp_multi *m, khttp_ctx *ctx)
+{
+    struct epoll_event ev;
+    int events = ctx->want == KHTTP_WANT_WRITE ? EPOLLOUT : EPOLLIN;
+    if(ctx->multi_fd != ctx->wait_fd) khttp_multi_unwatch(ctx);
+    if(ctx->multi_fd == ctx->wait_fd && ctx->multi_events == events) return KHTTP_ERR_OK;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = ctx;
+    if(ctx->multi_fd == ctx->wait_fd){
+        if(epoll_ctl(m->epfd, EPOLL_CTL_MOD, ctx->wait_fd, &ev) == 0){
+            ctx->multi_events = events;
+            return KHTTP_ERR_OK;
+        }
+        if(errno != ENOENT) goto err;
+    }
+    if(epoll_ctl(m->epfd, EPOLL_CTL_ADD, ctx->wait_fd, &ev) != 0) goto err;
+    ctx->multi_fd = ctx->wait_fd;
+    ctx->multi_events = events;
+    return KHTTP_ERR_OK;
+err:
+    LOG_ERROR("khttp epoll_ctl failure %d(%s)\n", errno, strerror(errno));
+    return -KHTTP_ERR_UNKNOWN;
+}
+
+// Move a finished transfer to the done queue
+static void khttp_multi_finish(khttp_multi *m, khttp_ctx *ctx)
+{
+    khttp_ctx **pp = &m->active;
+    while(*pp && *pp != ctx) pp = &(*pp)->multi_next;
+    if(*pp == NULL) return;
+    *pp = ctx->multi_next;
+    ctx->multi_next = NULL;
+    if(m->done_tail) m->done_tail->multi_next = ctx;
+    else m->done = ctx;
+    m->done_tail = ctx;
+    m->running --;
+}
+
+// Register what the transfer waits for after a step
+static void khttp_multi_update(khttp_multi *m, khttp_ctx *ctx, int ret)
+{
+    if(ret == -KHTTP_ERR_AGAIN){
+        if(khttp_multi_watch(m, ctx) == KHTTP_ERR_OK) return;
+        khttp_close(ctx);
+        ctx->state = KHTTP_STATE_ERROR;
+        ctx->result = -KHTTP_ERR_UNKNOWN;
+    }
+    khttp_multi_unwatch(ctx);
+    khttp_multi_finish(m, ctx);
+}
+
+int khttp_multi_add(khttp_multi *m, khttp_ctx *ctx)
+{
+    if(m == NULL || ctx == NULL || ctx->multi != NULL) return -KHTTP_ERR_PARAM;
+    ctx->multi = m;
+    ctx->multi_fd = -1;
+    ctx->multi_events = 0;
+    ctx->multi_next = m->active;
+    m->active = ctx;
+    m->running ++;
+    int ret = khttp_start(ctx);
+    if(ret == KHTTP_ERR_OK) ret = khttp_step(ctx);
+    khttp_multi_update(m, ctx, ret);
+    return KHTTP_ERR_OK;
+}
+
+int khttp_multi_remove(khttp_multi *m, khttp_ctx *ctx)
+{
+    khttp_ctx **pp = NULL;
+    khttp_ctx *prev = NULL;
+    if(m == NULL || ctx == NULL || ctx->multi != m) return -KHTTP_ERR_PARAM;
+    khttp_multi_unwatch(ctx);
+    for(pp = &m->active; *pp && *pp != ctx; pp = &(*pp)->multi_next);
+    if(*pp){
+        *pp = ctx->multi_next;
+        m->running --;
+        // Abort transfer in progress, connection state is unknown
+        khttp_close(ctx);
+        ctx->state = KHTTP_STATE_ERROR;
+        ctx->result = -KHTTP_ERR_UNKNOWN;
+    }else{
+        for(pp = &m->done; *pp && *pp != ctx; pp = &(*pp)->multi_next) prev = *pp;
+        if(*pp){
+            *pp = ctx->multi_next;
+            if(m->done_tail == ctx) m->done_tail = prev;
+        }
+    }
+    ctx->multi_next = NULL;
+    ctx->multi = NULL;
+    return KHTTP_ERR_OK;
+}
+
+khttp_ctx *khttp_multi_done(khttp_multi *m, int *result)
+{
+    if(m == NULL || m->done == NULL) return NULL;
+    khttp_ctx *ctx = m->done;
+    m->done = ctx->multi_next;
+    if(m->done == NULL) m->done_tail = NULL;
+    ctx->multi_next = NULL;
+    ctx->multi = NULL;
+    if(result) *result = ctx->result;
+    return ctx;
+}
+
+/*
+ * Wait up to timeout_ms (-1 forever) for socket events, drive the ready
+ * transfers and time out the overdue ones. Return number of running transfers.
+ */
+int khttp_multi_poll(khttp_multi *m, int timeout_ms)
+{
+    struct epoll_event events[KHTTP_MULTI_EVENTS];
+    khttp_ctx *ctx = NULL;
+    khttp_ctx *next = NULL;
+    uint64_t now = khttp_now_ms();
+    int i = 0;
+    int n = 0;
+    if(m == NULL) return -KHTTP_ERR_PARAM;
+    if(m->running == 0) return 0;
+    // Sleep no longer than the nearest transfer deadline
+    for(ctx = m->active; ctx; ctx = ctx->multi_next){
+        int left = ctx->deadline > now ? (int)(ctx->deadline - now) : 0;
+        if(timeout_ms < 0 || left < timeout_ms) timeout_ms = left;
+    }
+    n = epoll_wait(m->epfd, events, KHTTP_MULTI_EVENTS, timeout_ms);
+    if(n < 0 && errno != EINTR){
+        LOG_ERROR("khttp epoll_wait failure %d(%s)\n", errno, strerror(errno));
+        return -KHTTP_ERR_UNKNOWN;
+    }
+    for(i = 0; i < n; i++){
+        ctx = events[i].data.ptr;
+        khttp_multi_update(m, ctx, khttp_step(ctx));
+    }
+    now = khttp_now_ms();
+    for(ctx = m->active; ctx; ctx = next){
+        next = ctx->multi_next;
+        if(ctx->deadline <= now){
+            khttp_multi_update(m, ctx, khttp_expire(ctx));
+        }
+    }
+    return m->running;
+}
+
+int khttp_multi_perform(khttp_multi *m, int *running)
+{
+    int ret = khttp_multi_poll(m, 0);
+    if(ret < 0) return ret;
+    if(running) *running = ret;
+    return KHTTP_ERR_OK;
+}
+
+void khttp_multi_destroy(khttp_multi *m)
+{
+    if(!m) return;
+    while(m->active) khttp_multi_remove(m, m->active);
+    while(m->done) khttp_multi_done(m, NULL);
+    close(m->epfd);
+    khttp_free(m);
+}
+
+#else
+
+// No epoll on this platform, multi interface is not available
+khttp_multi *khttp_multi_new()
+{
+    return NULL;
+}
+
+void khttp_multi_unwatch(khttp_ctx *ctx)
+{
+}
+
+void khttp_multi_destroy(khttp_multi *m)
+{
+}
+
+int khttp_multi_add(khttp_multi *m, khttp_ctx *ctx)
+{
+    return -KHTTP_ERR_NOT_SUPP;
+}
+
+int khttp_multi_remove(khttp_multi *m, khttp_ctx *ctx)
+{
+    return -KHTTP_ERR_NOT_SUPP;
+}
+
+int khttp_multi_perform(khttp_multi *m, int *running)
+{
+    return -KHTTP_ERR_NOT_SUPP;
+}
+
+int khttp_multi_poll(khttp_multi *m, int timeout_ms)
+{
+    return -KHTTP_ERR_NOT_SUPP;
+}
+
+khttp_ctx *khttp_multi_done(khttp_multi *m, int *result)
+{
+    return NULL;
+}
+
+#endif
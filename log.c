@@ -4,15 +4,45 @@
 #include <sys/time.h>
 #include <time.h>
 #include <stdarg.h>
+#include <pthread.h>
 #include "log.h"
 
-static char curr_time[32];
 static int  log2screen = 1;
 static int  log2file;
 static char log_file_name[128];
 static FILE *log_fp = NULL;
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;   //Guards log_fp
 static int  log_level = DEBUG;
 
+/*
+ * Async mode: callers copy the formatted line into a ring and return, a
+ * background thread writes what piled up in one batch per sink. A full ring
+ * drops lines instead of blocking the caller and the loss is reported.
+ */
+#define LOG_RING_SIZE       (1024 * 1024)
+#define LOG_FLUSH_MS        50
+#define LOG_OUT_BUF         65536
+
+typedef struct {
+    unsigned short  len;                                //Text bytes after this header
+    unsigned char   level;
+    unsigned char   pad;
+}log_entry;
+
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ring_cond = PTHREAD_COND_INITIALIZER;
+static char *ring = NULL;
+static size_t ring_head = 0;                            //Write position, grows forever
+static size_t ring_tail = 0;                            //Read position
+static unsigned long ring_dropped = 0;
+static int ring_stop = 0;
+static int log_async = 0;
+static pthread_t log_thread;
+
+// Per thread, localtime and strftime only run when the second changes
+static __thread time_t time_sec = -1;
+static __thread char time_text[32];
+
 struct {
     char text[8];
     char ctext[16];
@@ -29,17 +59,18 @@ static char *print_lv_text(int lv, int color){
     else return log_text[lv].text;
 }
 
-static char *print_time()
+// Caller owns curr_time, so concurrent log calls never share it
+static char *print_time(char *curr_time, size_t len)
 {
-    time_t now;
     struct timeval tv;
-    struct tm *nowtm;
+    struct tm nowtm;
     gettimeofday(&tv, NULL);
-    now = tv.tv_sec;
-    nowtm = localtime(&now);
-    char timebuf[32];
-    strftime(timebuf, 32, "%Y-%m-%d %H:%M:%S", nowtm);
-    snprintf(curr_time, 32, "%s %06ld",timebuf, (long)tv.tv_usec);
+    if(tv.tv_sec != time_sec){
+        time_sec = tv.tv_sec;
+        localtime_r(&time_sec, &nowtm);
+        strftime(time_text, sizeof(time_text), "%Y-%m-%d %H:%M:%S", &nowtm);
+    }
+    snprintf(curr_time, len, "%s %06ld", time_text, (long)tv.tv_usec);
     return curr_time;
 }
 
@@ -53,14 +84,18 @@ int log_set_opt(int opt);
 
 static int log_open_file()
 {
-    log_fp = fopen(log_file_name, "w");
+    FILE *fp = fopen(log_file_name, "w");
+    pthread_mutex_lock(&log_lock);
+    if(log_fp) fclose(log_fp);
+    log_fp = fp;
+    pthread_mutex_unlock(&log_lock);
     LOG(INFO, "Log file save to %s\n", log_file_name);
     return 0;
 }
 
 int log_set_file(char *file)
 {
-    strncpy(log_file_name, file, 128);
+    snprintf(log_file_name, sizeof(log_file_name), "%s", file);
     log2file = 1;
     log_open_file();
     return 0;
@@ -68,32 +103,217 @@ int log_set_file(char *file)
 
 int log_close_file()
 {
+    pthread_mutex_lock(&log_lock);
     if(log_fp){
         fclose(log_fp);
         log_fp = NULL;
     }
+    pthread_mutex_unlock(&log_lock);
     return 0;
 }
 
-void log_print(int level, char *file, int line, char *fmt, ...)
+static void log_ring_read(char *dst, size_t pos, size_t len)
+{
+    size_t off = pos % LOG_RING_SIZE;
+    size_t first = LOG_RING_SIZE - off < len ? LOG_RING_SIZE - off : len;
+    memcpy(dst, ring + off, first);
+    memcpy(dst + first, ring, len - first);
+}
+
+static void log_ring_write(size_t pos, const void *src, size_t len)
+{
+    size_t off = pos % LOG_RING_SIZE;
+    size_t first = LOG_RING_SIZE - off < len ? LOG_RING_SIZE - off : len;
+    memcpy(ring + off, src, first);
+    memcpy(ring, (const char *)src + first, len - first);
+}
+
+// Queue one line. -1 when the writer thread is not running.
+static int log_ring_put(int level, const char *text, size_t len)
+{
+    log_entry e = {len, level, 0};
+    pthread_mutex_lock(&ring_lock);
+    if(ring == NULL || ring_stop){
+        pthread_mutex_unlock(&ring_lock);
+        return -1;
+    }
+    size_t used = ring_head - ring_tail;
+    if(used + sizeof(e) + len > LOG_RING_SIZE){
+        ring_dropped ++;
+    }else{
+        log_ring_write(ring_head, &e, sizeof(e));
+        log_ring_write(ring_head + sizeof(e), text, len);
+        ring_head += sizeof(e) + len;
+        // Wake the writer early only when the ring fills up
+        if(used < LOG_RING_SIZE / 2 && ring_head - ring_tail >= LOG_RING_SIZE / 2){
+            pthread_cond_signal(&ring_cond);
+        }
+    }
+    pthread_mutex_unlock(&ring_lock);
+    return 0;
+}
+
+static void log_write(int level, const char *text, size_t len)
 {
-    char buf[LOG_MAX_CHAR];
-    va_list vl;
-    va_start(vl, fmt);
-    vsnprintf(buf, sizeof(buf),fmt, vl);
-    va_end(vl);
     if(log2screen){
-		if(level < log_level) return;
+        // One fprintf per line, stdio locks the stream so threads do not interleave
+#ifdef COLOR_LOG
+        fprintf(stderr, "%16s| %.*s\033[0m", print_lv_text(level, 1), (int)len, text);
+#else
+        fprintf(stderr, "%8s| %.*s", print_lv_text(level, 0), (int)len, text);
+#endif
+    }
+    if(log2file){
+        pthread_mutex_lock(&log_lock);
+        if(log_fp) fprintf(log_fp, "%s %.*s", print_lv_text(level, 0), (int)len, text);
+        pthread_mutex_unlock(&log_lock);
+    }
+}
+
+// Write a batch of ring entries to one sink in few large writes
+static void log_write_sink(FILE *fp, const char *batch, size_t len, unsigned long dropped, int color)
+{
+    char out[LOG_OUT_BUF];
+    size_t used = 0;
+    size_t pos = 0;
+    while(pos < len){
+        log_entry e;
+        memcpy(&e, batch + pos, sizeof(e));
+        const char *text = batch + pos + sizeof(e);
+        pos += sizeof(e) + e.len;
+        if(used + e.len + 32 > sizeof(out)){
+            fwrite(out, 1, used, fp);
+            used = 0;
+        }
+        if(color){
+            used += snprintf(out + used, sizeof(out) - used, "%16s| %.*s\033[0m", print_lv_text(e.level, 1), e.len, text);
+        }else if(fp == stderr){
+            used += snprintf(out + used, sizeof(out) - used, "%8s| %.*s", print_lv_text(e.level, 0), e.len, text);
+        }else{
+            used += snprintf(out + used, sizeof(out) - used, "%s %.*s", print_lv_text(e.level, 0), e.len, text);
+        }
+    }
+    if(dropped){
+        if(used + 64 > sizeof(out)){
+            fwrite(out, 1, used, fp);
+            used = 0;
+        }
+        used += snprintf(out + used, sizeof(out) - used, "log ring full, %lu lines dropped\n", dropped);
+    }
+    if(used) fwrite(out, 1, used, fp);
+}
+
+static void *log_thread_run(void *arg)
+{
+    char *batch = malloc(LOG_RING_SIZE);
+    int stop = 0;
+    while(!stop){
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += LOG_FLUSH_MS * 1000000L;
+        if(ts.tv_nsec >= 1000000000L){
+            ts.tv_sec ++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        pthread_mutex_lock(&ring_lock);
+        if(ring_head == ring_tail && !ring_stop) pthread_cond_timedwait(&ring_cond, &ring_lock, &ts);
+        size_t len = ring_head - ring_tail;
+        if(batch) log_ring_read(batch, ring_tail, len);
+        ring_tail = ring_head;
+        unsigned long dropped = ring_dropped;
+        ring_dropped = 0;
+        stop = ring_stop;
+        pthread_mutex_unlock(&ring_lock);
+        if(batch == NULL || (len == 0 && dropped == 0)) continue;
+        if(log2screen){
 #ifdef COLOR_LOG
-        fprintf(stderr, "%16s| %s ( %s:%d ) %s", print_lv_text(level, 1), print_time(), file, line, buf);
-        fprintf(stderr, "\033[0m");
+            log_write_sink(stderr, batch, len, dropped, 1);
 #else
-        fprintf(stderr, "%8s| %s ( %s:%d ) %s", print_lv_text(level, 0), print_time(), file, line, buf);
+            log_write_sink(stderr, batch, len, dropped, 0);
 #endif
+        }
+        if(log2file){
+            pthread_mutex_lock(&log_lock);
+            if(log_fp){
+                log_write_sink(log_fp, batch, len, dropped, 0);
+                fflush(log_fp);
+            }
+            pthread_mutex_unlock(&log_lock);
+        }
     }
-    if(log2file && log_fp){
-		if(level < log_level) return;
-        fprintf(log_fp, "%s %s ( %s:%d ) %s", print_lv_text(level, 0), print_time(), file, line, buf);
+    free(batch);
+    return NULL;
+}
+
+static void log_async_exit()
+{
+    log_set_async(0);
+}
+
+/*
+ * Hand lines to a background writer. Turning it off writes out what is
+ * queued before returning, lines still queued at exit() are written too.
+ */
+int log_set_async(int enable)
+{
+    static int exit_hook = 0;
+    if(enable){
+        pthread_mutex_lock(&ring_lock);
+        if(ring){
+            pthread_mutex_unlock(&ring_lock);
+            return 0;
+        }
+        if((ring = malloc(LOG_RING_SIZE)) == NULL){
+            pthread_mutex_unlock(&ring_lock);
+            return -1;
+        }
+        ring_head = ring_tail = 0;
+        ring_stop = 0;
+        if(pthread_create(&log_thread, NULL, log_thread_run, NULL) != 0){
+            free(ring);
+            ring = NULL;
+            pthread_mutex_unlock(&ring_lock);
+            return -1;
+        }
+        if(!exit_hook) exit_hook = atexit(log_async_exit) == 0;
+        __atomic_store_n(&log_async, 1, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&ring_lock);
+        return 0;
     }
+    pthread_mutex_lock(&ring_lock);
+    if(ring == NULL || ring_stop){
+        pthread_mutex_unlock(&ring_lock);
+        return 0;
+    }
+    // Writer drains the ring once more and exits, new lines go out directly
+    ring_stop = 1;
+    __atomic_store_n(&log_async, 0, __ATOMIC_RELAXED);
+    pthread_cond_signal(&ring_cond);
+    pthread_mutex_unlock(&ring_lock);
+    pthread_join(log_thread, NULL);
+    pthread_mutex_lock(&ring_lock);
+    free(ring);
+    ring = NULL;
+    pthread_mutex_unlock(&ring_lock);
+    return 0;
 }
 
+void log_print(int level, char *file, int line, char *fmt, ...)
+{
+    char buf[LOG_MAX_CHAR];
+    // time_text, a space and the widest long print_time() may add
+    char curr_time[sizeof(time_text) + 21];
+    va_list vl;
+    // Filtered lines cost one compare, nothing is formatted
+    if(level < log_level || level < DEBUG || level > FATAL) return;
+    int len = snprintf(buf, sizeof(buf), "%s ( %s:%d ) ", print_time(curr_time, sizeof(curr_time)), file, line);
+    if(len < 0) return;
+    if(len >= sizeof(buf)) len = sizeof(buf) - 1;
+    va_start(vl, fmt);
+    int n = vsnprintf(buf + len, sizeof(buf) - len, fmt, vl);
+    va_end(vl);
+    if(n > 0) len += n;
+    if(len >= sizeof(buf)) len = sizeof(buf) - 1;
+    if(__atomic_load_n(&log_async, __ATOMIC_RELAXED) && log_ring_put(level, buf, len) == 0) return;
+    log_write(level, buf, len);
+}
@@ -9,18 +9,43 @@
 
 #define LOG_MAX_CHAR    2048
 
+/*
+ * Levels below LOG_COMPILE_LEVEL compile to nothing, arguments are not
+ * evaluated. Build with e.g. -DLOG_COMPILE_LEVEL=WARN for production.
+ */
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL   DEBUG
+#endif
+
 void log_print(int level, char *file, int line, char *fmt, ...);
-#define LOG(level, fmt, args...) log_print(level, __FILE__,__LINE__, fmt, ##args)
+#define LOG(level, fmt, args...) do{ if((level) >= LOG_COMPILE_LEVEL) log_print(level, __FILE__,__LINE__, fmt, ##args); }while(0)
 
+#if LOG_COMPILE_LEVEL <= DEBUG
 #define LOG_DEBUG(fmt, args...) log_print(DEBUG, __FILE__,__LINE__, fmt, ##args)
+#else
+#define LOG_DEBUG(fmt, args...) do{}while(0)
+#endif
+#if LOG_COMPILE_LEVEL <= INFO
 #define LOG_INFO(fmt, args...) log_print(INFO, __FILE__,__LINE__, fmt, ##args)
+#else
+#define LOG_INFO(fmt, args...) do{}while(0)
+#endif
+#if LOG_COMPILE_LEVEL <= WARN
 #define LOG_WARN(fmt, args...) log_print(WARN, __FILE__,__LINE__, fmt, ##args)
+#else
+#define LOG_WARN(fmt, args...) do{}while(0)
+#endif
+#if LOG_COMPILE_LEVEL <= ERROR
 #define LOG_ERROR(fmt, args...) log_print(ERROR, __FILE__,__LINE__, fmt, ##args)
+#else
+#define LOG_ERROR(fmt, args...) do{}while(0)
+#endif
 #define LOG_FATAL(fmt, args...) log_print(FATAL, __FILE__,__LINE__, fmt, ##args)
 
 
 int log_set_file(char *file);
 int log_close_file();
+int log_set_async(int enable);
 
 int	log_set_level(int level);
 int	log_set_opt(int opt);
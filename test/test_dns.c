@@ -0,0 +1,105 @@
+#include "khttp.h"
+#include "log.h"
+
+// Resolve names from /etc/hosts so no DNS server is needed
+void test_dns_cache()
+{
+    printf(">>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>%s<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<\n",__func__);
+    int i = 0;
+    unsigned long hits = 0;
+    unsigned long misses = 0;
+    khttp_ctx *ctx = khttp_new();
+    khttp_set_uri(ctx, "http://localhost:8888/");
+    for(i = 0; i < 3; i++){
+        if(khttp_dns_lookup(ctx) != KHTTP_ERR_OK) break;
+    }
+    khttp_dns_stats(&hits, &misses);
+    if(i == 3 && hits == 2 && misses == 1 && ctx->addr_count > 0){
+        printf("PASS\n");
+    }else{
+        printf("FAIL");
+    }
+    khttp_destroy(ctx);
+    khttp_dns_cleanup();
+}
+
+void test_dns_negative()
+{
+    printf(">>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>%s<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<\n",__func__);
+    unsigned long hits = 0;
+    unsigned long misses = 0;
+    khttp_ctx *ctx = khttp_new();
+    // Not a valid host name, rejected without asking a server
+    khttp_set_uri(ctx, "http://-/");
+    khttp_dns_lookup(ctx);
+    khttp_dns_lookup(ctx);
+    khttp_dns_stats(&hits, &misses);
+    if(hits == 1 && misses == 1){
+        printf("PASS\n");
+    }else{
+        printf("FAIL");
+    }
+    khttp_destroy(ctx);
+    khttp_dns_cleanup();
+}
+
+void test_dns_async()
+{
+    printf(">>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>%s<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<\n",__func__);
+    int result = -1;
+    int running = 0;
+    khttp_multi *m = khttp_multi_new();
+    khttp_ctx *ctx = khttp_new();
+    khttp_set_uri(ctx, "http://localhost:8888/");
+    khttp_multi_add(m, ctx);
+    do{
+        running = khttp_multi_poll(m, 1000);
+    }while(running > 0);
+    khttp_multi_done(m, &result);
+    if(result == KHTTP_ERR_OK && ctx->hp.status_code == 200){
+        printf("PASS\n");
+    }else{
+        printf("FAIL");
+    }
+    khttp_destroy(ctx);
+    khttp_multi_destroy(m);
+    khttp_dns_cleanup();
+}
+
+// Numeric hosts, one more than the cache holds. Filled again in the same
+// order every lookup misses, an uncapped cache would hit them all.
+void test_dns_cache_max()
+{
+    printf(">>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>%s<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<\n",__func__);
+    int i = 0;
+    int round = 0;
+    int failed = 0;
+    char uri[64];
+    unsigned long hits = 0;
+    unsigned long misses = 0;
+    khttp_ctx *ctx = khttp_new();
+    for(round = 0; round < 2; round++){
+        for(i = 0; i <= KHTTP_DNS_CACHE_MAX; i++){
+            snprintf(uri, sizeof(uri), "http://127.0.%d.%d/", i / 250, i % 250 + 1);
+            khttp_set_uri(ctx, uri);
+            if(khttp_dns_lookup(ctx) != KHTTP_ERR_OK) failed++;
+        }
+    }
+    khttp_dns_stats(&hits, &misses);
+    if(failed == 0 && hits == 0 && misses == 2 * (KHTTP_DNS_CACHE_MAX + 1)){
+        printf("PASS\n");
+    }else{
+        printf("FAIL");
+    }
+    khttp_destroy(ctx);
+    khttp_dns_cleanup();
+}
+
+int main()
+{
+    test_dns_cache();
+    test_dns_negative();
+    test_dns_async();
+    test_dns_cache_max();
+    return 0;
+}
@@ -4,9 +4,9 @@ void test_chunked_encode()
 {
     printf(">>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>%s<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<\n",__func__);
     khttp_ctx *ctx = khttp_new();
-    khttp_set_uri(ctx, "http://www.inside.com.tw");
+    khttp_set_uri(ctx, "http://localhost:8888/ping?size=100000&chunk=4096");
     khttp_perform(ctx);
-    if(ctx->hp.status_code == 200){
+    if(ctx->hp.status_code == 200 && ctx->body_len == 100000){
         printf("PASS\n");
     }else{
         printf("FAIL");
@@ -18,9 +18,9 @@ void test_content_length()
 {
     printf(">>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>%s<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<\n",__func__);
     khttp_ctx *ctx = khttp_new();
-    khttp_set_uri(ctx, "http://www.inside.com.tw");
+    khttp_set_uri(ctx, "http://localhost:8888/ping?size=100000");
     khttp_perform(ctx);
-    if(ctx->hp.status_code == 200){
+    if(ctx->hp.status_code == 200 && ctx->body_len == 100000){
         printf("PASS\n");
     }else{
         printf("FAIL");
@@ -43,6 +43,23 @@ void test_digest()
     khttp_destroy(ctx);
 }
 
+void test_digest_cached()
+{
+    printf(">>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>%s<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<\n",__func__);
+    khttp_ctx *ctx = khttp_new();
+    khttp_set_uri(ctx, "http://localhost:8888/digest");
+    khttp_set_username_password(ctx, "bob", "secret", KHTTP_AUTH_DIGEST);
+    khttp_perform(ctx);
+    // Second request answers the cached challenge without a 401
+    khttp_perform(ctx);
+    if(ctx->hp.status_code == 200 && ctx->count == 0){
+        printf("PASS\n");
+    }else{
+        printf("FAIL");
+    }
+    khttp_destroy(ctx);
+}
+
 void test_digest_fail()
 {
     printf(">>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>%s<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<\n",__func__);
@@ -117,16 +134,245 @@ void test_basic()
     khttp_destroy(ctx);
 }
 
+size_t test_write_count(const char *buf, size_t len, void *userdata)
+{
+    *(size_t *)userdata += len;
+    return len;
+}
+
+void test_write_cb()
+{
+    printf(">>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>%s<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<\n",__func__);
+    size_t total = 0;
+    khttp_ctx *ctx = khttp_new();
+    khttp_set_uri(ctx, "http://localhost:8888/");
+    khttp_set_write_cb(ctx, test_write_count, &total);
+    khttp_perform(ctx);
+    if(ctx->hp.status_code == 200 && total > 0 && ctx->body_len == 0){
+        printf("PASS\n");
+    }else{
+        printf("FAIL");
+    }
+    khttp_destroy(ctx);
+}
+
+void test_download_fd()
+{
+    printf(">>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>%s<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<\n",__func__);
+    FILE *fp = tmpfile();
+    khttp_ctx *ctx = khttp_new();
+    khttp_set_uri(ctx, "http://localhost:8888/");
+    khttp_set_download_fd(ctx, fileno(fp));
+    khttp_perform(ctx);
+    if(ctx->hp.status_code == 200 && ftell(fp) > 0 && ctx->body_len == 0){
+        printf("PASS\n");
+    }else{
+        printf("FAIL");
+    }
+    khttp_destroy(ctx);
+    fclose(fp);
+}
+
+void test_long_uri()
+{
+    printf(">>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>%s<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<\n",__func__);
+    char uri[4096];
+    int n = snprintf(uri, sizeof(uri), "http://localhost:8888/?q=");
+    memset(uri + n, 'a', sizeof(uri) - n - 1);
+    uri[sizeof(uri) - 1] = 0;
+    khttp_ctx *ctx = khttp_new();
+    khttp_set_uri(ctx, uri);
+    khttp_add_header(ctx, "X-Test", "khttp");
+    khttp_perform(ctx);
+    if(ctx->hp.status_code == 200){
+        printf("PASS\n");
+    }else{
+        printf("FAIL");
+    }
+    khttp_destroy(ctx);
+}
+
+void test_reset()
+{
+    printf(">>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>%s<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<\n",__func__);
+    khttp_ctx *ctx = khttp_new();
+    khttp_set_uri(ctx, "http://localhost:8888/post");
+    khttp_set_method(ctx, KHTTP_POST);
+    khttp_set_post_data(ctx, "data=khttp");
+    khttp_add_header(ctx, "X-Test", "khttp");
+    khttp_perform(ctx);
+    int first = ctx->hp.status_code;
+    // Same ctx, plain GET. POST method or body must not leak
+    khttp_reset(ctx);
+    khttp_set_uri(ctx, "http://localhost:8888/ping");
+    khttp_perform(ctx);
+    if(first == 200 && ctx->hp.status_code == 200 && ctx->method == KHTTP_GET &&
+            ctx->data == NULL && ctx->req_hdr == NULL){
+        printf("PASS\n");
+    }else{
+        printf("FAIL");
+    }
+    khttp_destroy(ctx);
+}
+
+void test_reset_host()
+{
+    printf(">>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>%s<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<\n",__func__);
+    char uri[KHTTP_HOST_LEN + 32];
+    khttp_ctx *ctx = khttp_new();
+    khttp_set_uri(ctx, "http://www.example.com/");
+    // Shorter host on the same ctx must not keep the tail of the old one
+    khttp_reset(ctx);
+    khttp_set_uri(ctx, "http://localhost:8888/ping");
+    khttp_perform(ctx);
+    int ok = ctx->hp.status_code == 200 && strcmp(ctx->host, "localhost") == 0;
+    int n = snprintf(uri, sizeof(uri), "http://");
+    memset(uri + n, 'a', KHTTP_HOST_LEN);
+    strcpy(uri + n + KHTTP_HOST_LEN, "/ping");
+    if(ok && khttp_set_uri(ctx, uri) == -KHTTP_ERR_PARAM){
+        printf("PASS\n");
+    }else{
+        printf("FAIL");
+    }
+    khttp_destroy(ctx);
+}
+
+void test_timings()
+{
+    printf(">>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>%s<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<\n",__func__);
+    // Connections of earlier tests would skip DNS and connect
+    khttp_pool_cleanup();
+    khttp_ctx *ctx = khttp_new();
+    khttp_set_uri(ctx, "http://localhost:8888/ping");
+    khttp_perform(ctx);
+    const khttp_timings *t = khttp_get_timings(ctx);
+    int first = ctx->hp.status_code == 200 && !t->conn_reused &&
+        t->start <= t->dns_start && t->dns_start <= t->dns_end && t->dns_end <= t->connect_start &&
+        t->connect_start <= t->connect_end && t->connect_end <= t->sent && t->sent <= t->first_byte &&
+        t->first_byte <= t->headers && t->headers <= t->done && t->bytes_sent > 0 && t->bytes_recv > 0;
+    printf("dns %llu connect %llu send %llu wait %llu total %llu us\n",
+            (unsigned long long)(t->dns_end - t->dns_start),
+            (unsigned long long)(t->connect_end - t->connect_start),
+            (unsigned long long)(t->sent - t->connect_end),
+            (unsigned long long)(t->first_byte - t->sent),
+            (unsigned long long)(t->done - t->start));
+    // Second request rides the pooled connection
+    khttp_perform(ctx);
+    if(first && ctx->hp.status_code == 200 && t->conn_reused && t->dns_start == 0 &&
+            t->connect_end == 0 && t->sent >= t->start && t->done >= t->headers){
+        printf("PASS\n");
+    }else{
+        printf("FAIL");
+    }
+    khttp_destroy(ctx);
+}
+
+// Compressed replies of the test server, pattern restarts every 64KB piece
+void test_decode()
+{
+    printf(">>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>%s<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<\n",__func__);
+    const char *uri[] = {
+        "http://localhost:8888/ping?size=200000&gzip=1",
+        "http://localhost:8888/ping?size=200000&gzip=1&chunk=1000",
+        "http://localhost:8888/ping?size=200000&deflate=1",
+        "http://localhost:8888/ping?size=200000&deflate=2&chunk=7",
+        // Second gzip member in a later read
+        "http://localhost:8888/ping?size=200000&gzip=2",
+    };
+    int fail = 0;
+    int i = 0;
+    size_t j = 0;
+    khttp_ctx *ctx = khttp_new();
+    if(khttp_set_decode(ctx, 1) != KHTTP_ERR_OK) fail++;
+    for(i = 0; i < sizeof(uri) / sizeof(uri[0]); i++){
+        khttp_reset(ctx);
+        khttp_set_uri(ctx, (char *)uri[i]);
+        if(khttp_perform(ctx) != KHTTP_ERR_OK || ctx->hp.status_code != 200 || ctx->body_len != 200000){
+            printf("%s body %zu\n", uri[i], ctx->body_len);
+            fail++;
+            continue;
+        }
+        for(j = 0; j < ctx->body_len && ((char *)ctx->body)[j] == 'a' + j % 65536 % 26; j++);
+        if(j != ctx->body_len) fail++;
+    }
+    // Streamed body is decoded as well
+    size_t total = 0;
+    khttp_reset(ctx);
+    khttp_set_uri(ctx, (char *)uri[1]);
+    khttp_set_write_cb(ctx, test_write_count, &total);
+    if(khttp_perform(ctx) != KHTTP_ERR_OK || total != 200000) fail++;
+    if(fail == 0){
+        printf("PASS\n");
+    }else{
+        printf("FAIL");
+    }
+    khttp_destroy(ctx);
+}
+
+static size_t test_alloc_count = 0;
+
+static void *test_malloc(size_t size, void *userdata)
+{
+    test_alloc_count++;
+    return malloc(size);
+}
+
+static void *test_realloc(void *ptr, size_t size, void *userdata)
+{
+    test_alloc_count++;
+    return realloc(ptr, size);
+}
+
+static void test_free(void *ptr, void *userdata)
+{
+    free(ptr);
+}
+
+void test_allocator()
+{
+    printf(">>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>%s<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<\n",__func__);
+    int i = 0;
+    int ok = 1;
+    khttp_set_allocator(test_malloc, test_realloc, test_free, NULL);
+    khttp_ctx *ctx = khttp_new();
+    khttp_set_uri(ctx, "http://localhost:8888/basic");
+    khttp_set_username_password(ctx, "bob", "secret", KHTTP_AUTH_BASIC);
+    // Warm up buffers, arena and connection
+    for(i = 0; i < 3; i++){
+        if(khttp_perform(ctx) != KHTTP_ERR_OK || ctx->hp.status_code != 200) ok = 0;
+    }
+    size_t warm = test_alloc_count;
+    for(i = 0; i < 10; i++){
+        if(khttp_perform(ctx) != KHTTP_ERR_OK || ctx->hp.status_code != 200) ok = 0;
+    }
+    printf("allocations for 10 keep-alive requests %zu\n", test_alloc_count - warm);
+    if(ok && warm > 0 && test_alloc_count == warm){
+        printf("PASS\n");
+    }else{
+        printf("FAIL");
+    }
+    khttp_destroy(ctx);
+    khttp_set_allocator(NULL, NULL, NULL, NULL);
+}
 int main()
 {
     //while(1){
         test_chunked_encode();
         test_content_length();
         test_digest();
+        test_digest_cached();
         test_digest_fail();
         test_basic();
         test_basic_fail();
         test_basic_but_digest();
         test_basic_but_digest_fail();
+        test_write_cb();
+        test_download_fd();
+        test_long_uri();
+        test_reset();
+        test_reset_host();
+        test_timings();
+        test_decode();
+        test_allocator();
     //}
 }
@@ -0,0 +1,137 @@
+#include "khttp.h"
+#include "log.h"
+#include <pthread.h>
+#include <openssl/ssl.h>
+
+#define TEST_KTLS_SIZE  (4 * 1024 * 1024 + 123)
+
+static int test_ktls_listen = -1;
+
+// One shot TLS server: read the request body, answer with its size and sum
+static void *test_ktls_server(void *arg)
+{
+    char buf[16384];
+    char resp[256];
+    size_t total = 0;
+    size_t body = 0;
+    size_t length = 0;
+    unsigned int sum = 0;
+    char *end = NULL;
+    SSL_CTX *sctx = SSL_CTX_new(TLS_server_method());
+    SSL_CTX_use_certificate_file(sctx, "test_server/ssl.cert", SSL_FILETYPE_PEM);
+    SSL_CTX_use_PrivateKey_file(sctx, "test_server/ssl.key", SSL_FILETYPE_PEM);
+    int fd = accept(test_ktls_listen, NULL, NULL);
+    SSL *ssl = SSL_new(sctx);
+    SSL_set_fd(ssl, fd);
+    if(SSL_accept(ssl) == 1){
+        // Header
+        while(end == NULL && total < sizeof(buf) - 1){
+            int n = SSL_read(ssl, buf + total, sizeof(buf) - 1 - total);
+            if(n <= 0) break;
+            total += n;
+            buf[total] = 0;
+            end = strstr(buf, "\r\n\r\n");
+        }
+        if(end){
+            char *cl = strstr(buf, "Content-Length: ");
+            if(cl) length = strtoul(cl + 16, NULL, 10);
+            char *p = end + 4;
+            for(; p < buf + total; p++, body++) sum += (unsigned char)*p;
+        }
+        // Body
+        while(end && body < length){
+            int n = SSL_read(ssl, buf, sizeof(buf));
+            if(n <= 0) break;
+            int i = 0;
+            for(i = 0; i < n; i++) sum += (unsigned char)buf[i];
+            body += n;
+        }
+        int len = snprintf(buf, sizeof(buf), "%zu %u", body, sum);
+        int hlen = snprintf(resp, sizeof(resp), "HTTP/1.1 200 OK\r\nContent-Length: %d\r\nConnection: close\r\n\r\n", len);
+        SSL_write(ssl, resp, hlen);
+        SSL_write(ssl, buf, len);
+        SSL_shutdown(ssl);
+    }
+    SSL_free(ssl);
+    close(fd);
+    SSL_CTX_free(sctx);
+    return NULL;
+}
+
+typedef struct {
+    khttp_ctx           *ctx;
+    int                 ktls;
+    char                body[64];
+    size_t              len;
+}test_ktls_resp;
+
+static size_t test_ktls_body(const char *buf, size_t len, void *userdata)
+{
+    test_ktls_resp *resp = userdata;
+    // Connection is still up while the response streams in
+    if(khttp_ssl_ktls_send(resp->ctx)) resp->ktls = 1;
+    if(resp->len + len >= sizeof(resp->body)) return 0;
+    memcpy(resp->body + resp->len, buf, len);
+    resp->len += len;
+    return len;
+}
+
+void test_ktls_upload()
+{
+    printf(">>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>%s<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<\n",__func__);
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    pthread_t server;
+    test_ktls_resp resp;
+    char uri[64];
+    char expect[64];
+    unsigned int sum = 0;
+    int i = 0;
+    FILE *fp = tmpfile();
+    for(i = 0; i < TEST_KTLS_SIZE; i++){
+        fputc(i % 251, fp);
+        sum += i % 251;
+    }
+    fflush(fp);
+    rewind(fp);
+    snprintf(expect, sizeof(expect), "%d %u", TEST_KTLS_SIZE, sum);
+    // Loopback listener on an ephemeral port
+    test_ktls_listen = socket(AF_INET, SOCK_STREAM, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    bind(test_ktls_listen, (struct sockaddr *)&addr, sizeof(addr));
+    listen(test_ktls_listen, 1);
+    getsockname(test_ktls_listen, (struct sockaddr *)&addr, &addr_len);
+    pthread_create(&server, NULL, test_ktls_server, NULL);
+    snprintf(uri, sizeof(uri), "https://127.0.0.1:%d/upload", ntohs(addr.sin_port));
+
+    khttp_ctx *ctx = khttp_new();
+    memset(&resp, 0, sizeof(resp));
+    resp.ctx = ctx;
+    khttp_set_uri(ctx, uri);
+    khttp_ssl_skip_auth(ctx);
+    khttp_set_method(ctx, KHTTP_PUT);
+    khttp_set_keepalive(ctx, KHTTP_DISABLE);
+    khttp_ssl_set_ktls(ctx, KHTTP_ENABLE);
+    khttp_set_upload_fd(ctx, fileno(fp));
+    khttp_set_write_cb(ctx, test_ktls_body, &resp);
+    int ret = khttp_perform(ctx);
+    // Either path must deliver the same bytes
+    printf("kTLS send offload %s\n", resp.ktls ? "on" : "off, user space TLS");
+    if(ret == KHTTP_ERR_OK && ctx->hp.status_code == 200 && strcmp(resp.body, expect) == 0){
+        printf("PASS\n");
+    }else{
+        printf("FAIL");
+    }
+    khttp_destroy(ctx);
+    pthread_join(server, NULL);
+    close(test_ktls_listen);
+    fclose(fp);
+}
+
+int main()
+{
+    test_ktls_upload();
+    return 0;
+}
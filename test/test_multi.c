@@ -0,0 +1,46 @@
+#include "khttp.h"
+#include "log.h"
+
+#define MAX_TRANSFER 200
+
+int main()
+{
+    int i = 0;
+    int result = 0;
+    int running = 0;
+    int pass = 0;
+    khttp_ctx *ctx[MAX_TRANSFER];
+    khttp_multi *m = khttp_multi_new();
+    if(m == NULL){
+        printf("FAIL\n");
+        return -1;
+    }
+    for(i = 0; i < MAX_TRANSFER; i++){
+        ctx[i] = khttp_new();
+        if(i % 2 == 0){
+            khttp_set_uri(ctx[i], "http://localhost:8888/");
+        }else{
+            khttp_set_uri(ctx[i], "https://localhost:8443/");
+            khttp_ssl_skip_auth(ctx[i]);
+        }
+        khttp_set_method(ctx[i], KHTTP_GET);
+        khttp_multi_add(m, ctx[i]);
+    }
+    do{
+        khttp_ctx *done = NULL;
+        running = khttp_multi_poll(m, 1000);
+        while((done = khttp_multi_done(m, &result)) != NULL){
+            if(result == KHTTP_ERR_OK && done->hp.status_code == 200) pass++;
+        }
+    }while(running > 0);
+    if(pass == MAX_TRANSFER){
+        printf("PASS\n");
+    }else{
+        printf("FAIL %d/%d\n", pass, MAX_TRANSFER);
+    }
+    for(i = 0; i < MAX_TRANSFER; i++){
+        khttp_destroy(ctx[i]);
+    }
+    khttp_multi_destroy(m);
+    return 0;
+}
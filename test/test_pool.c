@@ -0,0 +1,164 @@
+#include "khttp.h"
+#include "log.h"
+#include <pthread.h>
+
+/*
+ * Connection pool against a private loopback server that counts accepted
+ * connections and can drop them behind the client's back.
+ */
+enum {
+    POOL_KEEP,                                  //Reply and keep the connection
+    POOL_CLOSE,                                 //Reply, then close without Connection: close
+    POOL_DROP                                   //Reply once, close on the next request unanswered
+};
+
+static int pool_listen = -1;
+static int pool_port = 0;
+static int pool_mode = POOL_KEEP;
+static int pool_accepts = 0;
+
+static void *pool_conn(void *arg)
+{
+    int fd = (int)(intptr_t)arg;
+    char buf[4096];
+    size_t used = 0;
+    int served = 0;
+    for(;;){
+        ssize_t n = recv(fd, buf + used, sizeof(buf) - 1 - used, 0);
+        if(n <= 0) break;
+        used += n;
+        buf[used] = 0;
+        if(strstr(buf, "\r\n\r\n") == NULL) continue;
+        used = 0;
+        if(pool_mode == POOL_DROP && served) break;
+        const char *resp = "HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\nok";
+        if(send(fd, resp, strlen(resp), MSG_NOSIGNAL) <= 0) break;
+        served++;
+        if(pool_mode == POOL_CLOSE) break;
+    }
+    close(fd);
+    return NULL;
+}
+
+static void *pool_server(void *arg)
+{
+    for(;;){
+        int fd = accept(pool_listen, NULL, NULL);
+        if(fd < 0) break;
+        __sync_fetch_and_add(&pool_accepts, 1);
+        pthread_t tid;
+        pthread_create(&tid, NULL, pool_conn, (void *)(intptr_t)fd);
+        pthread_detach(tid);
+    }
+    return NULL;
+}
+
+// Two requests on one ctx, returns the connections the server accepted
+static int pool_run(khttp_ctx *ctx, int pause_ms, int *ok)
+{
+    char uri[64];
+    int start = __sync_fetch_and_add(&pool_accepts, 0);
+    snprintf(uri, sizeof(uri), "http://127.0.0.1:%d/", pool_port);
+    khttp_reset(ctx);
+    khttp_set_uri(ctx, uri);
+    *ok = khttp_perform(ctx) == KHTTP_ERR_OK && ctx->hp.status_code == 200;
+    // Let the server's FIN arrive before the connection is taken from the pool
+    usleep(pause_ms * 1000);
+    khttp_reset(ctx);
+    khttp_set_uri(ctx, uri);
+    *ok = *ok && khttp_perform(ctx) == KHTTP_ERR_OK && ctx->hp.status_code == 200;
+    return __sync_fetch_and_add(&pool_accepts, 0) - start;
+}
+
+void test_pool_reuse()
+{
+    printf(">>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>%s<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<\n",__func__);
+    int ok = 0;
+    khttp_ctx *ctx = khttp_new();
+    pool_mode = POOL_KEEP;
+    int conns = pool_run(ctx, 0, &ok);
+    if(ok && conns == 1 && khttp_get_timings(ctx)->conn_reused){
+        printf("PASS\n");
+    }else{
+        printf("FAIL");
+    }
+    khttp_destroy(ctx);
+    khttp_pool_cleanup();
+}
+
+// Server closed the idle connection, MSG_PEEK sees EOF and a new one is made
+void test_pool_stale()
+{
+    printf(">>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>%s<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<\n",__func__);
+    int ok = 0;
+    khttp_ctx *ctx = khttp_new();
+    pool_mode = POOL_CLOSE;
+    int conns = pool_run(ctx, 100, &ok);
+    if(ok && conns == 2 && !khttp_get_timings(ctx)->conn_reused){
+        printf("PASS\n");
+    }else{
+        printf("FAIL");
+    }
+    khttp_destroy(ctx);
+    khttp_pool_cleanup();
+}
+
+// Connection looks alive but is closed once the request is in, sent again
+void test_pool_retry()
+{
+    printf(">>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>%s<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<\n",__func__);
+    int ok = 0;
+    khttp_ctx *ctx = khttp_new();
+    pool_mode = POOL_DROP;
+    int conns = pool_run(ctx, 0, &ok);
+    if(ok && conns == 2){
+        printf("PASS\n");
+    }else{
+        printf("FAIL");
+    }
+    khttp_destroy(ctx);
+    khttp_pool_cleanup();
+}
+
+void test_pool_idle_timeout()
+{
+    printf(">>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>%s<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<\n",__func__);
+    int ok = 0;
+    khttp_ctx *ctx = khttp_new();
+    pool_mode = POOL_KEEP;
+    khttp_pool_set_limit(KHTTP_POOL_PER_HOST, 50);
+    int conns = pool_run(ctx, 150, &ok);
+    khttp_pool_set_limit(KHTTP_POOL_PER_HOST, KHTTP_POOL_IDLE_TIMEO);
+    if(ok && conns == 2){
+        printf("PASS\n");
+    }else{
+        printf("FAIL");
+    }
+    khttp_destroy(ctx);
+    khttp_pool_cleanup();
+}
+
+int main()
+{
+    pthread_t server;
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    log_set_level(FATAL);
+    pool_listen = socket(AF_INET, SOCK_STREAM, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    bind(pool_listen, (struct sockaddr *)&addr, sizeof(addr));
+    getsockname(pool_listen, (struct sockaddr *)&addr, &addr_len);
+    pool_port = ntohs(addr.sin_port);
+    listen(pool_listen, 16);
+    pthread_create(&server, NULL, pool_server, NULL);
+    test_pool_reuse();
+    test_pool_stale();
+    test_pool_retry();
+    test_pool_idle_timeout();
+    shutdown(pool_listen, SHUT_RDWR);
+    close(pool_listen);
+    pthread_join(server, NULL);
+    return 0;
+}
@@ -146,6 +146,75 @@ void test_digest_with_data()
     khttp_destroy(ctx);
 }
 
+void test_post_binary()
+{
+    printf(">>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>%s<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<\n",__func__);
+    const char data[] = "key\0value\0\xff";
+    khttp_ctx *ctx = khttp_new();
+    khttp_set_uri(ctx, "http://localhost:8888/post");
+    khttp_set_post_data_len(ctx, data, sizeof(data) - 1);
+    khttp_set_method(ctx, KHTTP_POST);
+    khttp_perform(ctx);
+    if(ctx->hp.status_code == 200 && ctx->body_len == sizeof(data) - 1 &&
+            memcmp(ctx->body, data, sizeof(data) - 1) == 0){
+        printf("PASS\n");
+    }else{
+        printf("FAIL");
+    }
+    khttp_destroy(ctx);
+}
+
+// Server inflates gzip request bodies and echoes them
+void test_post_encode()
+{
+    printf(">>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>%s<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<\n",__func__);
+    size_t len = 60000;
+    char *data = malloc(len);
+    int fail = 0;
+    size_t i = 0;
+    for(i = 0; i < len; i++) data[i] = i % 7 ? 'a' + i % 26 : 0;
+    khttp_ctx *ctx = khttp_new();
+    if(khttp_set_encode(ctx, 1, 1024) != KHTTP_ERR_OK) fail++;
+    // Digest round sends the body twice, both compressed
+    khttp_set_uri(ctx, "http://localhost:8888/post_digest");
+    khttp_set_username_password(ctx, "bob", "secret", KHTTP_AUTH_DIGEST);
+    khttp_set_post_data_len(ctx, data, len);
+    khttp_set_method(ctx, KHTTP_POST);
+    khttp_perform(ctx);
+    if(ctx->hp.status_code != 200 || ctx->body_len != len || memcmp(ctx->body, data, len) != 0 ||
+            khttp_get_timings(ctx)->bytes_sent > len / 4){
+        printf("post %d body %zu sent %llu\n", ctx->hp.status_code, ctx->body_len,
+                (unsigned long long)khttp_get_timings(ctx)->bytes_sent);
+        fail++;
+    }
+    // Upload fd, read in pieces while compressing
+    FILE *fp = tmpfile();
+    fwrite(data, 1, len, fp);
+    fflush(fp);
+    rewind(fp);
+    khttp_reset(ctx);
+    khttp_set_uri(ctx, "http://localhost:8888/put");
+    khttp_set_method(ctx, KHTTP_PUT);
+    khttp_set_upload_fd(ctx, fileno(fp));
+    khttp_perform(ctx);
+    if(ctx->hp.status_code != 200 || ctx->body_len != len || memcmp(ctx->body, data, len) != 0) fail++;
+    fclose(fp);
+    // Below the threshold the body goes as is
+    khttp_reset(ctx);
+    khttp_set_uri(ctx, "http://localhost:8888/post");
+    khttp_set_method(ctx, KHTTP_POST);
+    khttp_set_post_data_len(ctx, data, 100);
+    khttp_perform(ctx);
+    if(ctx->hp.status_code != 200 || ctx->body_len != 100 || ctx->encoding) fail++;
+    if(fail == 0){
+        printf("PASS\n");
+    }else{
+        printf("FAIL");
+    }
+    khttp_destroy(ctx);
+    free(data);
+}
+
 int main()
 {
     //while(1){
@@ -158,6 +227,8 @@ int main()
         test_basic_fail();
         test_basic_but_digest();
         test_basic_but_digest_fail();
+        test_post_binary();
+        test_post_encode();
     //}
     return 0;
 }
@@ -68,11 +68,37 @@ void test_post_form_digest()
     khttp_destroy(ctx);
 }
 
+size_t test_form_fill(char *buf, size_t len, size_t offset, void *userdata)
+{
+    memset(buf, 'k', len);
+    return len;
+}
+
+void test_post_form_stream()
+{
+    printf(">>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>%s<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<\n",__func__);
+    khttp_ctx *ctx = khttp_new();
+    int fd = open("test.bin", O_RDONLY);
+    khttp_set_uri(ctx, "http://localhost:8888/post");
+    khttp_set_post_form_fd(ctx, "file", "test.bin", fd);
+    khttp_set_post_form_cb(ctx, "gen", "gen.bin", 1024 * 1024, test_form_fill, NULL);
+    khttp_set_method(ctx, KHTTP_POST);
+    khttp_perform(ctx);
+    if(ctx->hp.status_code == 200){
+        printf("PASS\n");
+    }else{
+        printf("FAIL");
+    }
+    khttp_destroy(ctx);
+    if(fd >= 0) close(fd);
+}
+
 int main()
 {
     test_post_form();
     test_post_file();
     test_post_form_file();
     test_post_form_digest();
+    test_post_form_stream();
     return 0;
 }
@@ -51,10 +51,29 @@ void test_put_basic()
     khttp_destroy(ctx);
 }
 
+void test_put_fd()
+{
+    printf(">>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>%s<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<\n",__func__);
+    khttp_ctx *ctx = khttp_new();
+    int fd = open("test.bin", O_RDONLY);
+    khttp_set_uri(ctx, "http://localhost:8888/put");
+    khttp_set_method(ctx, KHTTP_PUT);
+    khttp_set_upload_fd(ctx, fd);
+    khttp_perform(ctx);
+    if(ctx->hp.status_code == 200){
+        printf("PASS\n");
+    }else{
+        printf("FAIL");
+    }
+    khttp_destroy(ctx);
+    if(fd >= 0) close(fd);
+}
+
 int main()
 {
     test_put();
     test_put_digest();
     test_put_basic();
+    test_put_fd();
     return 0;
 }
@@ -0,0 +1,1029 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <zlib.h>
+#include "http_parser.h"
+
+/*
+ * Loopback server for the tests and benchmarks, replaces server.js. Serves
+ * the same endpoints on 127.0.0.1 and ::1, users bob/secret and joe/birthday
+ * in realm "Users". Every worker thread runs its own epoll loop on its own
+ * SO_REUSEPORT listeners.
+ *
+ * gzip request bodies are inflated before they are echoed.
+ *
+ * Any path takes query parameters to shape the reply:
+ *   size=N     N generated body bytes instead of the usual body
+ *   chunk=N    chunked transfer encoding, N bytes per chunk
+ *   delay=MS   reply MS milliseconds after the request is read
+ *   status=N   reply with status N
+ *   close=1    close the connection after the reply
+ *   gzip=N     gzip Content-Encoding in N members, the second one is
+ *              sent 50ms after the first
+ *   deflate=N  deflate Content-Encoding, 1 zlib wrapped, 2 raw
+ *
+ *   ./test_server.exe [-p port] [-s tls_port] [-c cert] [-k key] [-w workers]
+ *                     [-K max_requests] [-i idle_sec] [-v]
+ */
+#define SRV_IN_BUF          16384
+#define SRV_PIECE           65536           //Generated body bytes per send
+#define SRV_ECHO_MAX        65536           //Larger bodies are counted, not echoed
+#define SRV_URL_MAX         65536
+#define SRV_AUTH_MAX        2048
+#define SRV_MAX_EVENTS      256
+#define SRV_REALM           "Users"
+
+enum {
+    SRV_AUTH_NONE,
+    SRV_AUTH_BASIC,
+    SRV_AUTH_DIGEST
+};
+
+enum {
+    SRV_REPLY_OK,
+    SRV_REPLY_EMPTY,
+    SRV_REPLY_ECHO,
+    SRV_REPLY_INDEX,
+    SRV_REPLY_FORM
+};
+
+typedef struct {
+    const char      *path;
+    int             method;
+    int             auth;
+    int             reply;
+} srv_route;
+
+static const srv_route srv_routes[] = {
+    {"/",                       HTTP_GET,       SRV_AUTH_NONE,      SRV_REPLY_INDEX},
+    {"/ping",                   HTTP_GET,       SRV_AUTH_NONE,      SRV_REPLY_EMPTY},
+    {"/form",                   HTTP_GET,       SRV_AUTH_NONE,      SRV_REPLY_FORM},
+    {"/digest",                 HTTP_GET,       SRV_AUTH_DIGEST,    SRV_REPLY_OK},
+    {"/basic",                  HTTP_GET,       SRV_AUTH_BASIC,     SRV_REPLY_OK},
+    {"/pdigest",                HTTP_POST,      SRV_AUTH_DIGEST,    SRV_REPLY_ECHO},
+    {"/pbasic",                 HTTP_POST,      SRV_AUTH_BASIC,     SRV_REPLY_ECHO},
+    {"/post",                   HTTP_POST,      SRV_AUTH_NONE,      SRV_REPLY_ECHO},
+    {"/post_digest",            HTTP_POST,      SRV_AUTH_DIGEST,    SRV_REPLY_ECHO},
+    {"/post_multipart",         HTTP_POST,      SRV_AUTH_NONE,      SRV_REPLY_ECHO},
+    {"/post_multipart_digest",  HTTP_POST,      SRV_AUTH_DIGEST,    SRV_REPLY_ECHO},
+    {"/put",                    HTTP_PUT,       SRV_AUTH_NONE,      SRV_REPLY_ECHO},
+    {"/putdigest",              HTTP_PUT,       SRV_AUTH_DIGEST,    SRV_REPLY_ECHO},
+    {"/putbasic",               HTTP_PUT,       SRV_AUTH_BASIC,     SRV_REPLY_ECHO},
+    {"/delete",                 HTTP_DELETE,    SRV_AUTH_NONE,      SRV_REPLY_ECHO},
+    {"/deletedigest",           HTTP_DELETE,    SRV_AUTH_DIGEST,    SRV_REPLY_ECHO},
+    {"/deletebasic",            HTTP_DELETE,    SRV_AUTH_BASIC,     SRV_REPLY_ECHO},
+    {NULL,                      0,              0,                  0}
+};
+
+static const char *srv_users[][2] = {
+    {"bob", "secret"},
+    {"joe", "birthday"},
+    {NULL, NULL}
+};
+
+static const char srv_index[] = "<html><body>khttp test server</body></html>\n";
+static const char srv_form[] = "<form action=\"/post\" method=\"post\">Enter name:"
+        "<input type=\"text\" name=\"user name\" placeholder=\"...\" /><br>"
+        "<button type=\"submit\">Submit</button></form>";
+
+typedef struct {
+    int             fd;
+    int             listen;                 //Listening socket, else a srv_conn
+    int             tls;
+} srv_sock;
+
+typedef struct srv_conn {
+    srv_sock        sock;
+    struct srv_conn *prev;
+    struct srv_conn *next;
+    SSL             *ssl;
+    int             handshake;              //TLS accept not finished
+    int             events;                 //Registered epoll events
+    long long       active;                 //Last I/O, ms
+    int             requests;
+    http_parser     hp;
+    char            in[SRV_IN_BUF];
+    size_t          in_off;
+    size_t          in_len;
+    char            *out;
+    size_t          out_len;
+    size_t          out_off;
+    size_t          out_cap;
+    // Request being read
+    char            *url;
+    size_t          url_len;
+    char            field[32];
+    size_t          field_len;
+    int             in_value;
+    int             header;                 //Header the value belongs to
+    char            auth[SRV_AUTH_MAX];
+    size_t          auth_len;
+    int             expect;
+    int             gzip;                   //Request body is gzip encoded
+    z_stream        zs;
+    int             zs_init;
+    char            *body;
+    size_t          body_len;
+    size_t          body_cap;
+    int             complete;               //Request read, parser paused
+    int             keep_alive;
+    long long       reply_at;               //Delayed reply, ms
+    // Reply being sent
+    int             replying;
+    int             close;                  //Close once the reply is out
+    const char      *src;                   //Body left to send, NULL for generated
+    size_t          left;
+    size_t          chunk;                  //Chunk size, 0 when not chunked
+    char            note[64];               //Reply text of big uploads
+    char            *zbody;                 //Compressed body
+    size_t          hold;                   //Pause when this much body is left
+    long long       resume_at;              //Paused reply goes on, ms
+} srv_conn;
+
+enum {
+    SRV_HDR_NONE,
+    SRV_HDR_AUTH,
+    SRV_HDR_EXPECT,
+    SRV_HDR_ENCODING
+};
+
+typedef struct {
+    int             epfd;
+    srv_sock        listener[4];
+    int             nlistener;
+    srv_conn        *conns;
+} srv_worker;
+
+static int srv_port = 8888;
+static int srv_tls_port = 8443;
+static const char *srv_cert = "test_server/ssl.cert";
+static const char *srv_key = "test_server/ssl.key";
+static int srv_workers = 1;
+static int srv_max_requests = 0;
+static int srv_idle = 0;
+static int srv_verbose = 0;
+static SSL_CTX *srv_ssl_ctx = NULL;
+static unsigned char srv_secret[16];
+static char srv_pattern[SRV_PIECE];
+static unsigned int srv_nonce_count = 0;
+
+static long long srv_now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void srv_md5_hex(const char *data, size_t len, char *hex)
+{
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned int md_len = 0;
+    unsigned int i = 0;
+    EVP_Digest(data, len, md, &md_len, EVP_md5(), NULL);
+    for(i = 0; i < md_len; i++) sprintf(hex + i * 2, "%02x", md[i]);
+}
+
+static int srv_out_reserve(srv_conn *c, size_t len)
+{
+    if(c->out_len + len <= c->out_cap) return 0;
+    size_t cap = c->out_cap ? c->out_cap : 4096;
+    while(cap < c->out_len + len) cap *= 2;
+    char *tmp = realloc(c->out, cap);
+    if(tmp == NULL) return -1;
+    c->out = tmp;
+    c->out_cap = cap;
+    return 0;
+}
+
+static int srv_out_add(srv_conn *c, const char *buf, size_t len)
+{
+    if(srv_out_reserve(c, len) != 0) return -1;
+    memcpy(c->out + c->out_len, buf, len);
+    c->out_len += len;
+    return 0;
+}
+
+static int srv_out_printf(srv_conn *c, const char *fmt, ...)
+{
+    char buf[1024];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    if(n < 0 || n >= sizeof(buf)) return -1;
+    return srv_out_add(c, buf, n);
+}
+
+// Value of a query parameter, def when absent
+static long long srv_query(const char *url, const char *key, long long def)
+{
+    const char *p = strchr(url, '?');
+    size_t klen = strlen(key);
+    while(p){
+        p++;
+        if(strncmp(p, key, klen) == 0 && p[klen] == '=') return strtoll(p + klen + 1, NULL, 10);
+        p = strchr(p, '&');
+    }
+    return def;
+}
+
+/*
+ * Nonce is a counter signed with a per process secret so any worker can check
+ * it without shared state. Replayed nonce counts are accepted.
+ */
+static void srv_nonce(char *nonce, unsigned int count)
+{
+    char buf[64];
+    char hex[33];
+    int n = snprintf(buf, sizeof(buf), "%08x", count);
+    memcpy(buf + n, srv_secret, sizeof(srv_secret));
+    srv_md5_hex(buf, n + sizeof(srv_secret), hex);
+    snprintf(nonce, 41, "%08x%.32s", count, hex);
+}
+
+// Next key="value" or key=value pair of an auth header
+static const char *srv_auth_param(const char *p, char *key, size_t key_len, char *val, size_t val_len)
+{
+    size_t n = 0;
+    while(*p == ' ' || *p == ',') p++;
+    if(*p == 0) return NULL;
+    while(*p && *p != '=' && *p != ','){
+        if(n + 1 < key_len) key[n++] = *p;
+        p++;
+    }
+    key[n] = 0;
+    n = 0;
+    if(*p == '=') p++;
+    int quoted = *p == '"';
+    if(quoted) p++;
+    while(*p && (quoted ? *p != '"' : *p != ',')){
+        if(n + 1 < val_len) val[n++] = *p;
+        p++;
+    }
+    val[n] = 0;
+    if(quoted && *p == '"') p++;
+    return p;
+}
+
+static const char *srv_password(const char *user)
+{
+    int i = 0;
+    for(i = 0; srv_users[i][0]; i++){
+        if(strcmp(srv_users[i][0], user) == 0) return srv_users[i][1];
+    }
+    return NULL;
+}
+
+static int srv_check_basic(srv_conn *c)
+{
+    unsigned char plain[SRV_AUTH_MAX];
+    if(strncmp(c->auth, "Basic ", 6) != 0) return 0;
+    int n = EVP_DecodeBlock(plain, (unsigned char *)c->auth + 6, c->auth_len - 6);
+    if(n <= 0) return 0;
+    // DecodeBlock counts the padding as zero bytes
+    while(n > 0 && plain[n - 1] == 0) n--;
+    plain[n] = 0;
+    char *colon = strchr((char *)plain, ':');
+    if(colon == NULL) return 0;
+    *colon = 0;
+    const char *pass = srv_password((char *)plain);
+    return pass && strcmp(pass, colon + 1) == 0;
+}
+
+static int srv_check_digest(srv_conn *c)
+{
+    char key[32];
+    char val[SRV_AUTH_MAX];
+    char user[64] = "", realm[64] = "", nonce[64] = "", uri[SRV_AUTH_MAX] = "";
+    char response[64] = "", qop[16] = "", nc[16] = "", cnonce[128] = "";
+    char ha1[33], ha2[33], expect[33];
+    char buf[SRV_AUTH_MAX * 2];
+    const char *p = c->auth + 7;
+    if(strncmp(c->auth, "Digest ", 7) != 0) return 0;
+    while((p = srv_auth_param(p, key, sizeof(key), val, sizeof(val))) != NULL){
+        if(strcmp(key, "username") == 0) snprintf(user, sizeof(user), "%s", val);
+        else if(strcmp(key, "realm") == 0) snprintf(realm, sizeof(realm), "%s", val);
+        else if(strcmp(key, "nonce") == 0) snprintf(nonce, sizeof(nonce), "%s", val);
+        else if(strcmp(key, "uri") == 0) snprintf(uri, sizeof(uri), "%s", val);
+        else if(strcmp(key, "response") == 0) snprintf(response, sizeof(response), "%s", val);
+        else if(strcmp(key, "qop") == 0) snprintf(qop, sizeof(qop), "%s", val);
+        else if(strcmp(key, "nc") == 0) snprintf(nc, sizeof(nc), "%s", val);
+        else if(strcmp(key, "cnonce") == 0) snprintf(cnonce, sizeof(cnonce), "%s", val);
+    }
+    const char *pass = srv_password(user);
+    if(pass == NULL || strcmp(realm, SRV_REALM) != 0 || strlen(nonce) != 40) return 0;
+    char count[9];
+    char check[41];
+    memcpy(count, nonce, 8);
+    count[8] = 0;
+    srv_nonce(check, strtoul(count, NULL, 16));
+    if(strcmp(nonce, check) != 0) return 0;
+    int n = snprintf(buf, sizeof(buf), "%s:%s:%s", user, realm, pass);
+    srv_md5_hex(buf, n, ha1);
+    n = snprintf(buf, sizeof(buf), "%s:%s", http_method_str(c->hp.method), uri);
+    srv_md5_hex(buf, n, ha2);
+    if(qop[0]){
+        n = snprintf(buf, sizeof(buf), "%s:%s:%s:%s:%s:%s", ha1, nonce, nc, cnonce, qop, ha2);
+    }else{
+        n = snprintf(buf, sizeof(buf), "%s:%s:%s", ha1, nonce, ha2);
+    }
+    srv_md5_hex(buf, n, expect);
+    return strcmp(expect, response) == 0;
+}
+
+static const char *srv_reason(int status)
+{
+    switch(status){
+        case 200: return "OK";
+        case 204: return "No Content";
+        case 400: return "Bad Request";
+        case 401: return "Unauthorized";
+        case 404: return "Not Found";
+        case 500: return "Internal Server Error";
+        case 503: return "Service Unavailable";
+    }
+    return "Status";
+}
+
+// Replace the body with its compressed form, bits as in deflateInit2
+static int srv_compress(srv_conn *c, int bits, int members)
+{
+    z_stream zs;
+    size_t off = 0;
+    size_t done = 0;                        //Compressed bytes of finished members
+    int member = 1;
+    memset(&zs, 0, sizeof(zs));
+    if(deflateInit2(&zs, 6, Z_DEFLATED, bits, 8, Z_DEFAULT_STRATEGY) != Z_OK) return -1;
+    size_t cap = deflateBound(&zs, c->left) + members * 64;
+    free(c->zbody);
+    c->zbody = malloc(cap);
+    if(c->zbody == NULL){
+        deflateEnd(&zs);
+        return -1;
+    }
+    zs.next_out = (Bytef *)c->zbody;
+    zs.avail_out = cap;
+    c->hold = 0;
+    // Generated bodies are compressed piece by piece as srv_fill sends them
+    do{
+        size_t end = c->left * member / members;
+        size_t n = end - off;
+        if(c->src == NULL && n > SRV_PIECE - off % SRV_PIECE) n = SRV_PIECE - off % SRV_PIECE;
+        zs.next_in = (Bytef *)(c->src ? c->src + off : srv_pattern + off % SRV_PIECE);
+        zs.avail_in = n;
+        off += n;
+        if(deflate(&zs, off == end ? Z_FINISH : Z_NO_FLUSH) == Z_STREAM_ERROR) break;
+        if(off == end && member < members){
+            // Next member starts a new gzip stream, sent after a pause
+            done += zs.total_out;
+            if(c->hold == 0) c->hold = done;
+            deflateReset(&zs);
+            member++;
+        }
+    }while(off < c->left);
+    c->src = c->zbody;
+    c->left = done + zs.total_out;
+    // hold counted the bytes sent before the pause, turn it into bytes left
+    if(c->hold) c->hold = c->left - c->hold;
+    deflateEnd(&zs);
+    return 0;
+}
+
+// Queue the reply of a complete request, the body is sent by srv_flush
+static int srv_reply(srv_conn *c)
+{
+    const srv_route *route = NULL;
+    size_t path_len = strcspn(c->url, "?");
+    int status = 200;
+    char challenge[128] = "";
+    int i = 0;
+    for(i = 0; srv_routes[i].path; i++){
+        if(strlen(srv_routes[i].path) == path_len && strncmp(srv_routes[i].path, c->url, path_len) == 0) break;
+    }
+    if(srv_routes[i].path) route = &srv_routes[i];
+    c->src = NULL;
+    c->left = 0;
+    if(route == NULL || route->method != c->hp.method){
+        status = 404;
+        c->src = "Not Found";
+    }else if((route->auth == SRV_AUTH_BASIC && !srv_check_basic(c)) ||
+            (route->auth == SRV_AUTH_DIGEST && !srv_check_digest(c))){
+        status = 401;
+        c->src = "Unauthorized";
+        if(route->auth == SRV_AUTH_BASIC){
+            snprintf(challenge, sizeof(challenge), "Basic realm=\"" SRV_REALM "\"");
+        }else{
+            char nonce[41];
+            srv_nonce(nonce, __sync_fetch_and_add(&srv_nonce_count, 1));
+            snprintf(challenge, sizeof(challenge), "Digest realm=\"" SRV_REALM "\", nonce=\"%s\", qop=\"auth\"", nonce);
+        }
+    }else{
+        switch(route->reply){
+            case SRV_REPLY_OK:      c->src = "OK";      break;
+            case SRV_REPLY_EMPTY:   c->src = "";        break;
+            case SRV_REPLY_INDEX:   c->src = srv_index; break;
+            case SRV_REPLY_FORM:    c->src = srv_form;  break;
+            case SRV_REPLY_ECHO:
+                if(c->body_len == 0){
+                    c->src = "OK";
+                }else if(c->body_len <= SRV_ECHO_MAX){
+                    c->src = c->body;
+                    c->left = c->body_len;
+                }else{
+                    snprintf(c->note, sizeof(c->note), "received %zu bytes", c->body_len);
+                    c->src = c->note;
+                }
+                break;
+        }
+        status = srv_query(c->url, "status", status);
+    }
+    if(c->left == 0 && c->src) c->left = strlen(c->src);
+    long long size = srv_query(c->url, "size", -1);
+    if(size >= 0 && status != 401){
+        c->src = NULL;
+        c->left = size;
+    }
+    long long chunk = srv_query(c->url, "chunk", 0);
+    c->chunk = chunk > 0 ? chunk : 0;
+    const char *encoding = NULL;
+    if(srv_query(c->url, "gzip", 0) && status != 401){
+        encoding = "gzip";
+        if(srv_compress(c, 16 + 15, srv_query(c->url, "gzip", 0)) != 0) return -1;
+    }else if(srv_query(c->url, "deflate", 0) && status != 401){
+        encoding = "deflate";
+        if(srv_compress(c, srv_query(c->url, "deflate", 0) == 2 ? -15 : 15, 1) != 0) return -1;
+    }
+    c->requests++;
+    c->close = !c->keep_alive || srv_query(c->url, "close", 0) ||
+            (srv_max_requests && c->requests >= srv_max_requests);
+    if(srv_out_printf(c, "HTTP/1.1 %d %s\r\nServer: khttp-test\r\nContent-Type: text/plain\r\n",
+                status, srv_reason(status)) != 0) return -1;
+    if(challenge[0] && srv_out_printf(c, "WWW-Authenticate: %s\r\n", challenge) != 0) return -1;
+    if(encoding && srv_out_printf(c, "Content-Encoding: %s\r\n", encoding) != 0) return -1;
+    if(c->chunk){
+        if(srv_out_printf(c, "Transfer-Encoding: chunked\r\n") != 0) return -1;
+    }else{
+        if(srv_out_printf(c, "Content-Length: %zu\r\n", c->left) != 0) return -1;
+    }
+    if(c->close && srv_out_printf(c, "Connection: close\r\n") != 0) return -1;
+    if(srv_out_add(c, "\r\n", 2) != 0) return -1;
+    // Small bodies go out with the header
+    if(c->chunk == 0 && c->src && c->left <= SRV_PIECE && c->hold == 0){
+        if(srv_out_add(c, c->src, c->left) != 0) return -1;
+        c->left = 0;
+    }
+    if(srv_verbose){
+        printf("%s %s %d\n", http_method_str(c->hp.method), c->url, status);
+    }
+    // Pipelined requests are read once this reply is out
+    c->replying = 1;
+    return 0;
+}
+
+// Next piece of the body into the output buffer, chunk framed if asked
+static int srv_fill(srv_conn *c)
+{
+    size_t n = c->left;
+    if(c->chunk && n > c->chunk) n = c->chunk;
+    if(n > SRV_PIECE) n = SRV_PIECE;
+    if(c->hold && c->left > c->hold && n > c->left - c->hold) n = c->left - c->hold;
+    if(c->chunk && srv_out_printf(c, "%zx\r\n", n) != 0) return -1;
+    if(srv_out_add(c, c->src ? c->src : srv_pattern, n) != 0) return -1;
+    if(c->src) c->src += n;
+    c->left -= n;
+    if(c->chunk && srv_out_add(c, "\r\n", 2) != 0) return -1;
+    if(c->chunk && c->left == 0){
+        if(srv_out_add(c, "0\r\n\r\n", 5) != 0) return -1;
+        c->chunk = 0;
+    }
+    return 0;
+}
+
+// Returns 1 when everything is sent, 0 when the socket is full, 2 on a pause
+static int srv_flush(srv_conn *c)
+{
+    for(;;){
+        while(c->out_off < c->out_len){
+            ssize_t n = 0;
+            if(c->ssl){
+                n = SSL_write(c->ssl, c->out + c->out_off, c->out_len - c->out_off);
+                if(n <= 0){
+                    int err = SSL_get_error(c->ssl, n);
+                    if(err == SSL_ERROR_WANT_WRITE || err == SSL_ERROR_WANT_READ) return 0;
+                    return -1;
+                }
+            }else{
+                n = send(c->sock.fd, c->out + c->out_off, c->out_len - c->out_off, MSG_NOSIGNAL);
+                if(n < 0){
+                    if(errno == EINTR) continue;
+                    if(errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+                    return -1;
+                }
+            }
+            c->out_off += n;
+        }
+        c->out_off = 0;
+        c->out_len = 0;
+        if(c->left == 0 && c->chunk == 0) return 1;
+        if(c->hold && c->left == c->hold){
+            // Everything before the pause is out in its own writes
+            c->hold = 0;
+            c->resume_at = srv_now_ms() + 50;
+            return 2;
+        }
+        if(srv_fill(c) != 0) return -1;
+    }
+}
+
+static int srv_url_cb(http_parser *hp, const char *at, size_t len)
+{
+    srv_conn *c = hp->data;
+    if(c->url_len + len >= SRV_URL_MAX) return -1;
+    char *tmp = realloc(c->url, c->url_len + len + 1);
+    if(tmp == NULL) return -1;
+    c->url = tmp;
+    memcpy(c->url + c->url_len, at, len);
+    c->url_len += len;
+    c->url[c->url_len] = 0;
+    return 0;
+}
+
+static int srv_header_field_cb(http_parser *hp, const char *at, size_t len)
+{
+    srv_conn *c = hp->data;
+    if(c->in_value){
+        c->in_value = 0;
+        c->field_len = 0;
+    }
+    size_t n = len < sizeof(c->field) - 1 - c->field_len ? len : sizeof(c->field) - 1 - c->field_len;
+    memcpy(c->field + c->field_len, at, n);
+    c->field_len += n;
+    c->field[c->field_len] = 0;
+    return 0;
+}
+
+static int srv_header_value_cb(http_parser *hp, const char *at, size_t len)
+{
+    srv_conn *c = hp->data;
+    if(!c->in_value){
+        c->in_value = 1;
+        c->header = SRV_HDR_NONE;
+        if(strcasecmp(c->field, "Authorization") == 0){
+            c->header = SRV_HDR_AUTH;
+            c->auth_len = 0;
+        }else if(strcasecmp(c->field, "Expect") == 0){
+            c->header = SRV_HDR_EXPECT;
+        }else if(strcasecmp(c->field, "Content-Encoding") == 0){
+            c->header = SRV_HDR_ENCODING;
+        }
+    }
+    if(c->header == SRV_HDR_AUTH){
+        if(c->auth_len + len >= sizeof(c->auth)) return -1;
+        memcpy(c->auth + c->auth_len, at, len);
+        c->auth_len += len;
+        c->auth[c->auth_len] = 0;
+    }else if(c->header == SRV_HDR_EXPECT){
+        c->expect = len >= 3 && strncmp(at, "100", 3) == 0;
+    }else if(c->header == SRV_HDR_ENCODING){
+        c->gzip = len == 4 && strncasecmp(at, "gzip", 4) == 0;
+    }
+    return 0;
+}
+
+static int srv_headers_complete_cb(http_parser *hp)
+{
+    srv_conn *c = hp->data;
+    if(c->expect) srv_out_add(c, "HTTP/1.1 100 Continue\r\n\r\n", 25);
+    if(c->gzip){
+        if(!c->zs_init && inflateInit2(&c->zs, 16 + 15) != Z_OK) return -1;
+        if(c->zs_init && inflateReset(&c->zs) != Z_OK) return -1;
+        c->zs_init = 1;
+    }
+    return 0;
+}
+
+static int srv_body_add(srv_conn *c, const char *at, size_t len)
+{
+    if(c->body_len + len <= SRV_ECHO_MAX){
+        if(c->body_len + len > c->body_cap){
+            size_t cap = c->body_cap ? c->body_cap : 1024;
+            while(cap < c->body_len + len) cap *= 2;
+            char *tmp = realloc(c->body, cap);
+            if(tmp == NULL) return -1;
+            c->body = tmp;
+            c->body_cap = cap;
+        }
+        memcpy(c->body + c->body_len, at, len);
+    }
+    c->body_len += len;
+    return 0;
+}
+
+static int srv_body_cb(http_parser *hp, const char *at, size_t len)
+{
+    srv_conn *c = hp->data;
+    char buf[16384];
+    if(!c->gzip) return srv_body_add(c, at, len);
+    c->zs.next_in = (Bytef *)at;
+    c->zs.avail_in = len;
+    do{
+        c->zs.next_out = (Bytef *)buf;
+        c->zs.avail_out = sizeof(buf);
+        int ret = inflate(&c->zs, Z_NO_FLUSH);
+        if(ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) return -1;
+        if(srv_body_add(c, buf, sizeof(buf) - c->zs.avail_out) != 0) return -1;
+        if(ret == Z_STREAM_END || ret == Z_BUF_ERROR) break;
+    }while(c->zs.avail_in > 0 || c->zs.avail_out == 0);
+    return 0;
+}
+
+static int srv_message_complete_cb(http_parser *hp)
+{
+    srv_conn *c = hp->data;
+    c->complete = 1;
+    c->keep_alive = http_should_keep_alive(hp);
+    long long delay = srv_query(c->url ? c->url : "", "delay", 0);
+    c->reply_at = delay > 0 ? srv_now_ms() + delay : 0;
+    // Stop at the end of this request, the rest of the buffer waits
+    http_parser_pause(hp, 1);
+    return 0;
+}
+
+static http_parser_settings srv_settings =
+{
+    .on_url                 = srv_url_cb
+    ,.on_header_field       = srv_header_field_cb
+    ,.on_header_value       = srv_header_value_cb
+    ,.on_headers_complete   = srv_headers_complete_cb
+    ,.on_body               = srv_body_cb
+    ,.on_message_complete   = srv_message_complete_cb
+};
+
+static void srv_request_reset(srv_conn *c)
+{
+    c->url_len = 0;
+    if(c->url) c->url[0] = 0;
+    c->field_len = 0;
+    c->in_value = 0;
+    c->header = SRV_HDR_NONE;
+    c->auth_len = 0;
+    c->auth[0] = 0;
+    c->expect = 0;
+    c->gzip = 0;
+    c->body_len = 0;
+    c->complete = 0;
+    c->reply_at = 0;
+    c->replying = 0;
+    c->hold = 0;
+}
+
+// Parse until a request is complete. Returns 1 when one is, 0 on EAGAIN.
+static int srv_read(srv_conn *c)
+{
+    while(!c->complete){
+        if(c->in_off == c->in_len){
+            ssize_t n = 0;
+            if(c->ssl){
+                n = SSL_read(c->ssl, c->in, sizeof(c->in));
+                if(n <= 0){
+                    int err = SSL_get_error(c->ssl, n);
+                    if(err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) return 0;
+                    return -1;
+                }
+            }else{
+                n = recv(c->sock.fd, c->in, sizeof(c->in), 0);
+                if(n < 0 && errno == EINTR) continue;
+                if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+                if(n <= 0) return -1;
+            }
+            c->in_off = 0;
+            c->in_len = n;
+        }
+        size_t parsed = http_parser_execute(&c->hp, &srv_settings, c->in + c->in_off, c->in_len - c->in_off);
+        c->in_off += parsed;
+        enum http_errno err = HTTP_PARSER_ERRNO(&c->hp);
+        if(err != HPE_OK && err != HPE_PAUSED){
+            if(srv_verbose) printf("parse error %s\n", http_errno_name(err));
+            return -1;
+        }
+    }
+    return 1;
+}
+
+static void srv_watch(srv_worker *w, srv_conn *c, int events)
+{
+    if(c->events == events) return;
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = c;
+    epoll_ctl(w->epfd, EPOLL_CTL_MOD, c->sock.fd, &ev);
+    c->events = events;
+}
+
+static void srv_close(srv_worker *w, srv_conn *c)
+{
+    if(c->ssl){
+        if(!c->handshake) SSL_shutdown(c->ssl);
+        SSL_free(c->ssl);
+    }
+    close(c->sock.fd);
+    if(c->prev) c->prev->next = c->next;
+    else w->conns = c->next;
+    if(c->next) c->next->prev = c->prev;
+    free(c->url);
+    free(c->body);
+    free(c->zbody);
+    if(c->zs_init) inflateEnd(&c->zs);
+    free(c->out);
+    free(c);
+}
+
+// Drive one connection as far as it goes without blocking
+static void srv_handle(srv_worker *w, srv_conn *c)
+{
+    int ret = 0;
+    c->active = srv_now_ms();
+    if(c->handshake){
+        ret = SSL_accept(c->ssl);
+        if(ret <= 0){
+            int err = SSL_get_error(c->ssl, ret);
+            if(err == SSL_ERROR_WANT_READ){
+                srv_watch(w, c, EPOLLIN);
+                return;
+            }
+            if(err == SSL_ERROR_WANT_WRITE){
+                srv_watch(w, c, EPOLLOUT);
+                return;
+            }
+            srv_close(w, c);
+            return;
+        }
+        c->handshake = 0;
+    }
+    for(;;){
+        if(c->out_len > 0 || c->left > 0 || c->chunk > 0){
+            ret = srv_flush(c);
+            if(ret < 0) break;
+            // Pipelined requests wait, input is not watched meanwhile
+            if(ret == 0){
+                srv_watch(w, c, EPOLLOUT);
+                return;
+            }
+            // Paused body, the timer scan comes back
+            if(ret == 2){
+                srv_watch(w, c, 0);
+                return;
+            }
+        }
+        if(c->replying){
+            if(c->close) break;
+            srv_request_reset(c);
+            http_parser_pause(&c->hp, 0);
+            continue;
+        }
+        if(c->complete){
+            // Delayed reply, the timer scan comes back
+            if(c->reply_at && c->reply_at > srv_now_ms()){
+                srv_watch(w, c, 0);
+                return;
+            }
+            if(srv_reply(c) != 0) break;
+            continue;
+        }
+        ret = srv_read(c);
+        if(ret < 0) break;
+        if(ret == 0 && c->out_len == 0){
+            srv_watch(w, c, EPOLLIN);
+            return;
+        }
+    }
+    srv_close(w, c);
+}
+
+static void srv_accept(srv_worker *w, srv_sock *l)
+{
+    for(;;){
+        int fd = accept4(l->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if(fd < 0) return;
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        srv_conn *c = calloc(1, sizeof(srv_conn));
+        if(c == NULL){
+            close(fd);
+            continue;
+        }
+        c->sock.fd = fd;
+        c->sock.tls = l->tls;
+        http_parser_init(&c->hp, HTTP_REQUEST);
+        c->hp.data = c;
+        if(l->tls){
+            c->ssl = SSL_new(srv_ssl_ctx);
+            SSL_set_fd(c->ssl, fd);
+            SSL_set_mode(c->ssl, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+            c->handshake = 1;
+        }
+        c->next = w->conns;
+        if(w->conns) w->conns->prev = c;
+        w->conns = c;
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = c;
+        c->events = EPOLLIN;
+        epoll_ctl(w->epfd, EPOLL_CTL_ADD, fd, &ev);
+        srv_handle(w, c);
+    }
+}
+
+static int srv_listen(srv_worker *w, int family, int port, int tls)
+{
+    struct sockaddr_storage addr;
+    socklen_t addr_len = 0;
+    int one = 1;
+    memset(&addr, 0, sizeof(addr));
+    if(family == AF_INET){
+        struct sockaddr_in *in = (struct sockaddr_in *)&addr;
+        in->sin_family = AF_INET;
+        in->sin_port = htons(port);
+        in->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr_len = sizeof(*in);
+    }else{
+        struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)&addr;
+        in6->sin6_family = AF_INET6;
+        in6->sin6_port = htons(port);
+        in6->sin6_addr = in6addr_loopback;
+        addr_len = sizeof(*in6);
+    }
+    int fd = socket(family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(fd < 0) return -1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+    if(family == AF_INET6) setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &one, sizeof(one));
+    if(bind(fd, (struct sockaddr *)&addr, addr_len) != 0 || listen(fd, 1024) != 0){
+        close(fd);
+        return -1;
+    }
+    srv_sock *l = &w->listener[w->nlistener++];
+    l->fd = fd;
+    l->listen = 1;
+    l->tls = tls;
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = l;
+    epoll_ctl(w->epfd, EPOLL_CTL_ADD, fd, &ev);
+    return 0;
+}
+
+// Replies that are due and idle connections, returns ms until the next reply
+static int srv_timers(srv_worker *w)
+{
+    long long now = srv_now_ms();
+    int wait = 1000;
+    srv_conn *c = w->conns;
+    while(c){
+        srv_conn *next = c->next;
+        if(c->resume_at){
+            if(c->resume_at <= now){
+                c->resume_at = 0;
+                srv_handle(w, c);
+                wait = 0;
+            }else if(c->resume_at - now < wait){
+                wait = c->resume_at - now;
+            }
+        }else if(c->complete && !c->replying && c->reply_at){
+            if(c->reply_at <= now){
+                // May be delayed again by a request read right after, rescan
+                srv_handle(w, c);
+                wait = 0;
+            }else if(c->reply_at - now < wait){
+                wait = c->reply_at - now;
+            }
+        }else if(srv_idle && !c->complete && c->out_len == 0 && now - c->active >= srv_idle * 1000LL){
+            srv_close(w, c);
+        }
+        c = next;
+    }
+    return wait;
+}
+
+static void *srv_worker_run(void *arg)
+{
+    srv_worker *w = arg;
+    struct epoll_event events[SRV_MAX_EVENTS];
+    int wait = 1000;
+    for(;;){
+        int n = epoll_wait(w->epfd, events, SRV_MAX_EVENTS, wait);
+        int i = 0;
+        for(i = 0; i < n; i++){
+            srv_sock *s = events[i].data.ptr;
+            if(s->listen){
+                srv_accept(w, s);
+            }else{
+                srv_handle(w, (srv_conn *)s);
+            }
+        }
+        wait = srv_timers(w);
+    }
+    return NULL;
+}
+
+static int srv_verify_any(int ok, X509_STORE_CTX *store)
+{
+    // Ask for a client certificate like server.js, accept whatever comes
+    return 1;
+}
+
+static int srv_ssl_init()
+{
+    srv_ssl_ctx = SSL_CTX_new(TLS_server_method());
+    if(srv_ssl_ctx == NULL) return -1;
+    // The test certificate is SHA1 signed
+    SSL_CTX_set_security_level(srv_ssl_ctx, 0);
+    if(SSL_CTX_use_certificate_file(srv_ssl_ctx, srv_cert, SSL_FILETYPE_PEM) != 1 ||
+            SSL_CTX_use_PrivateKey_file(srv_ssl_ctx, srv_key, SSL_FILETYPE_PEM) != 1){
+        ERR_print_errors_fp(stderr);
+        return -1;
+    }
+    SSL_CTX_set_verify(srv_ssl_ctx, SSL_VERIFY_PEER, srv_verify_any);
+    SSL_CTX_set_session_id_context(srv_ssl_ctx, (const unsigned char *)"khttp", 5);
+    return 0;
+}
+
+static void srv_usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-p port] [-s tls_port] [-c cert] [-k key] [-w workers]\n"
+            "          [-K max_requests] [-i idle_sec] [-v]\n"
+            "  port 0 disables a listener, defaults 8888 and 8443\n", name);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    int opt = 0;
+    int i = 0;
+    while((opt = getopt(argc, argv, "p:s:c:k:w:K:i:v")) != -1){
+        switch(opt){
+            case 'p': srv_port = atoi(optarg);          break;
+            case 's': srv_tls_port = atoi(optarg);      break;
+            case 'c': srv_cert = optarg;                break;
+            case 'k': srv_key = optarg;                 break;
+            case 'w': srv_workers = atoi(optarg);       break;
+            case 'K': srv_max_requests = atoi(optarg);  break;
+            case 'i': srv_idle = atoi(optarg);          break;
+            case 'v': srv_verbose = 1;                  break;
+            default: srv_usage(argv[0]);
+        }
+    }
+    if(srv_workers < 1) srv_usage(argv[0]);
+    signal(SIGPIPE, SIG_IGN);
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    if(RAND_bytes(srv_secret, sizeof(srv_secret)) != 1) return 1;
+    for(i = 0; i < SRV_PIECE; i++) srv_pattern[i] = 'a' + i % 26;
+    if(srv_tls_port && srv_ssl_init() != 0){
+        fprintf(stderr, "cannot load %s / %s\n", srv_cert, srv_key);
+        return 1;
+    }
+    srv_worker *workers = calloc(srv_workers, sizeof(srv_worker));
+    for(i = 0; i < srv_workers; i++){
+        srv_worker *w = &workers[i];
+        int ok = 1;
+        w->epfd = epoll_create1(EPOLL_CLOEXEC);
+        // ::1 is optional, IPv4 loopback is not
+        if(srv_port){
+            if(srv_listen(w, AF_INET, srv_port, 0) != 0) ok = 0;
+            srv_listen(w, AF_INET6, srv_port, 0);
+        }
+        if(srv_tls_port){
+            if(srv_listen(w, AF_INET, srv_tls_port, 1) != 0) ok = 0;
+            srv_listen(w, AF_INET6, srv_tls_port, 1);
+        }
+        if(!ok){
+            fprintf(stderr, "cannot listen on %d/%d: %s\n", srv_port, srv_tls_port, strerror(errno));
+            return 1;
+        }
+    }
+    printf("listening http %d https %d, %d workers\n", srv_port, srv_tls_port, srv_workers);
+    for(i = 1; i < srv_workers; i++){
+        pthread_t tid;
+        pthread_create(&tid, NULL, srv_worker_run, &workers[i]);
+    }
+    srv_worker_run(&workers[0]);
+    return 0;
+}
@@ -5,10 +5,10 @@ void test_chunked_encode_v2()
 {
     printf(">>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>%s<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<\n",__func__);
     khttp_ctx *ctx = khttp_new();
-    khttp_set_uri(ctx, "https://www.facebook.com/");
+    khttp_set_uri(ctx, "https://localhost:8443/ping?size=100000&chunk=100");
     khttp_ssl_skip_auth(ctx);
     khttp_perform(ctx);
-    if(ctx->hp.status_code == 200){
+    if(ctx->hp.status_code == 200 && ctx->body_len == 100000){
         printf("PASS\n");
     }else{
         printf("FAIL");
@@ -20,10 +20,10 @@ void test_chunked_encode()
 {
     printf(">>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>%s<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<\n",__func__);
     khttp_ctx *ctx = khttp_new();
-    khttp_set_uri(ctx, "https://www.paypal.com/tw/webapps/mpp/home");
+    khttp_set_uri(ctx, "https://localhost:8443/ping?size=100000&chunk=4096");
     khttp_ssl_skip_auth(ctx);
     khttp_perform(ctx);
-    if(ctx->hp.status_code == 200){
+    if(ctx->hp.status_code == 200 && ctx->body_len == 100000){
         printf("PASS\n");
     }else{
         printf("FAIL");
@@ -35,10 +35,10 @@ void test_content_length()
 {
     printf(">>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>%s<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<\n",__func__);
     khttp_ctx *ctx = khttp_new();
-    khttp_set_uri(ctx, "https://tw.news.yahoo.com/");
+    khttp_set_uri(ctx, "https://localhost:8443/ping?size=100000");
     khttp_ssl_skip_auth(ctx);
     khttp_perform(ctx);
-    if(ctx->hp.status_code == 200){
+    if(ctx->hp.status_code == 200 && ctx->body_len == 100000){
         printf("PASS\n");
     }else{
         printf("FAIL");
@@ -50,7 +50,7 @@ void test_digest()
 {
     printf(">>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>%s<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<\n",__func__);
     khttp_ctx *ctx = khttp_new();
-    khttp_set_uri(ctx, "https://localhost/digest");
+    khttp_set_uri(ctx, "https://localhost:8443/digest");
     khttp_set_username_password(ctx, "bob", "secret", KHTTP_AUTH_DIGEST);
     khttp_ssl_skip_auth(ctx);
     khttp_perform(ctx);
@@ -66,7 +66,7 @@ void test_digest_fail()
 {
     printf(">>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>%s<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<\n",__func__);
     khttp_ctx *ctx = khttp_new();
-    khttp_set_uri(ctx, "https://localhost/digest");
+    khttp_set_uri(ctx, "https://localhost:8443/digest");
     khttp_set_username_password(ctx, "bob", "secret1", KHTTP_AUTH_DIGEST);
     khttp_ssl_skip_auth(ctx);
     khttp_perform(ctx);
@@ -82,7 +82,7 @@ void test_basic_but_digest()
 {
     printf(">>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>%s<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<\n",__func__);
     khttp_ctx *ctx = khttp_new();
-    khttp_set_uri(ctx, "https://localhost/digest");
+    khttp_set_uri(ctx, "https://localhost:8443/digest");
     khttp_set_username_password(ctx, "bob", "secret", KHTTP_AUTH_BASIC);
     khttp_ssl_skip_auth(ctx);
     khttp_perform(ctx);
@@ -98,7 +98,7 @@ void test_basic_but_digest_fail()
 {
     printf(">>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>%s<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<\n",__func__);
     khttp_ctx *ctx = khttp_new();
-    khttp_set_uri(ctx, "https://localhost/digest");
+    khttp_set_uri(ctx, "https://localhost:8443/digest");
     khttp_set_username_password(ctx, "bob", "secret1", KHTTP_AUTH_BASIC);
     khttp_ssl_skip_auth(ctx);
     khttp_perform(ctx);
@@ -114,7 +114,7 @@ void test_basic_fail()
 {
     printf(">>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>%s<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<\n",__func__);
     khttp_ctx *ctx = khttp_new();
-    khttp_set_uri(ctx, "https://localhost/basic");
+    khttp_set_uri(ctx, "https://localhost:8443/basic");
     khttp_set_username_password(ctx, "bob", "secret1", KHTTP_AUTH_BASIC);
     khttp_ssl_skip_auth(ctx);
     khttp_perform(ctx);
@@ -129,7 +129,7 @@ void test_basic()
 {
     printf(">>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>%s<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<\n",__func__);
     khttp_ctx *ctx = khttp_new();
-    khttp_set_uri(ctx, "https://localhost/basic");
+    khttp_set_uri(ctx, "https://localhost:8443/basic");
     khttp_set_username_password(ctx, "bob", "secret", KHTTP_AUTH_BASIC);
     khttp_ssl_skip_auth(ctx);
     khttp_perform(ctx);
@@ -145,7 +145,7 @@ void test_digest_cert()
 {
     printf(">>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>%s<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<\n",__func__);
     khttp_ctx *ctx = khttp_new();
-    khttp_set_uri(ctx, "https://localhost/digest");
+    khttp_set_uri(ctx, "https://localhost:8443/digest");
     khttp_set_username_password(ctx, "bob", "secret", KHTTP_AUTH_DIGEST);
     khttp_ssl_set_cert_key(ctx, "f835dd000010.pem", "f835dd000010.pem", NULL);
     khttp_ssl_skip_auth(ctx);
@@ -162,7 +162,7 @@ void test_digest_fail_cert()
 {
     printf(">>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>%s<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<\n",__func__);
     khttp_ctx *ctx = khttp_new();
-    khttp_set_uri(ctx, "https://localhost/digest");
+    khttp_set_uri(ctx, "https://localhost:8443/digest");
     khttp_set_username_password(ctx, "bob", "secret1", KHTTP_AUTH_DIGEST);
     khttp_ssl_set_cert_key(ctx, "f835dd000010.pem", "f835dd000010.pem", NULL);
     khttp_ssl_skip_auth(ctx);
@@ -179,7 +179,7 @@ void test_basic_but_digest_cert()
 {
     printf(">>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>%s<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<\n",__func__);
     khttp_ctx *ctx = khttp_new();
-    khttp_set_uri(ctx, "https://localhost/digest");
+    khttp_set_uri(ctx, "https://localhost:8443/digest");
     khttp_set_username_password(ctx, "bob", "secret", KHTTP_AUTH_BASIC);
     khttp_ssl_set_cert_key(ctx, "f835dd000010.pem", "f835dd000010.pem", NULL);
     khttp_ssl_skip_auth(ctx);
@@ -196,7 +196,7 @@ void test_basic_but_digest_fail_cert()
 {
     printf(">>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>%s<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<\n",__func__);
     khttp_ctx *ctx = khttp_new();
-    khttp_set_uri(ctx, "https://localhost/digest");
+    khttp_set_uri(ctx, "https://localhost:8443/digest");
     khttp_set_username_password(ctx, "bob", "secret1", KHTTP_AUTH_BASIC);
     khttp_ssl_set_cert_key(ctx, "f835dd000010.pem", "f835dd000010.pem", NULL);
     khttp_ssl_skip_auth(ctx);
@@ -213,7 +213,7 @@ void test_basic_fail_cert()
 {
     printf(">>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>%s<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<\n",__func__);
     khttp_ctx *ctx = khttp_new();
-    khttp_set_uri(ctx, "https://localhost/basic");
+    khttp_set_uri(ctx, "https://localhost:8443/basic");
     khttp_set_username_password(ctx, "bob", "secret1", KHTTP_AUTH_BASIC);
     khttp_ssl_set_cert_key(ctx, "f835dd000010.pem", "f835dd000010.pem", NULL);
     khttp_ssl_skip_auth(ctx);
@@ -229,7 +229,7 @@ void test_basic_cert()
 {
     printf(">>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>%s<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<\n",__func__);
     khttp_ctx *ctx = khttp_new();
-    khttp_set_uri(ctx, "https://localhost/basic");
+    khttp_set_uri(ctx, "https://localhost:8443/basic");
     khttp_set_username_password(ctx, "bob", "secret", KHTTP_AUTH_BASIC);
     khttp_ssl_set_cert_key(ctx, "f835dd000010.pem", "f835dd000010.pem", NULL);
     khttp_ssl_skip_auth(ctx);
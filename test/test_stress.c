@@ -0,0 +1,216 @@
+#include "khttp.h"
+#include "log.h"
+#include <pthread.h>
+
+/*
+ * Many threads share the connection pool, DNS cache, digest cache, metrics
+ * and logger against a loopback server. Build with "make tsan" to run under
+ * ThreadSanitizer, any report fails the run.
+ */
+#define STRESS_THREAD   8
+#define STRESS_LOOP     200
+
+static int stress_listen = -1;
+static int stress_port = 0;
+static int stress_closed_port = 0;
+
+// Read one request, body included. Returns 0 on success.
+static int stress_read_request(int fd, char *buf, size_t size, size_t *used)
+{
+    char *end = NULL;
+    size_t length = 0;
+    while((end = strstr(buf, "\r\n\r\n")) == NULL){
+        if(*used >= size - 1) return -1;
+        ssize_t n = recv(fd, buf + *used, size - 1 - *used, 0);
+        if(n <= 0) return -1;
+        *used += n;
+        buf[*used] = 0;
+    }
+    char *cl = strstr(buf, "Content-Length: ");
+    if(cl && cl < end) length = strtoul(cl + 16, NULL, 10);
+    if(strstr(buf, "Expect: 100-continue")){
+        send(fd, "HTTP/1.1 100 Continue\r\n\r\n", 25, MSG_NOSIGNAL);
+    }
+    size_t head = end + 4 - buf;
+    size_t body = *used - head;
+    // Drain the body, only the head is looked at
+    while(body < length){
+        char tmp[16384];
+        size_t want = length - body < sizeof(tmp) ? length - body : sizeof(tmp);
+        ssize_t n = recv(fd, tmp, want, 0);
+        if(n <= 0) return -1;
+        body += n;
+    }
+    // Pipelined bytes are not expected from khttp
+    *used = head;
+    buf[head] = 0;
+    return 0;
+}
+
+static void *stress_conn(void *arg)
+{
+    int fd = (int)(intptr_t)arg;
+    char buf[16384];
+    char resp[512];
+    unsigned int nonce = 0;
+    for(;;){
+        size_t used = 0;
+        buf[0] = 0;
+        if(stress_read_request(fd, buf, sizeof(buf), &used) != 0) break;
+        int len = 0;
+        if(strncmp(strchr(buf, ' ') + 1, "/digest", 7) == 0 && !strstr(buf, "Authorization: Digest ")){
+            len = snprintf(resp, sizeof(resp), "HTTP/1.1 401 Unauthorized\r\n"
+                    "WWW-Authenticate: Digest realm=\"khttp\", qop=\"auth\", nonce=\"%08x%08x\", opaque=\"5ccc069c403ebaf9f0171e9517f40e41\"\r\n"
+                    "Content-Length: 0\r\n\r\n", fd, nonce++);
+        }else if(strncmp(strchr(buf, ' ') + 1, "/basic", 6) == 0 && !strstr(buf, "Authorization: Basic Ym9iOnNlY3JldA==")){
+            len = snprintf(resp, sizeof(resp), "HTTP/1.1 401 Unauthorized\r\n"
+                    "WWW-Authenticate: Basic realm=\"khttp\"\r\n"
+                    "Content-Length: 0\r\n\r\n");
+        }else{
+            len = snprintf(resp, sizeof(resp), "HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\nok");
+        }
+        if(send(fd, resp, len, MSG_NOSIGNAL) != len) break;
+    }
+    close(fd);
+    return NULL;
+}
+
+static void *stress_server(void *arg)
+{
+    for(;;){
+        int fd = accept(stress_listen, NULL, NULL);
+        if(fd < 0) break;
+        pthread_t tid;
+        pthread_create(&tid, NULL, stress_conn, (void *)(intptr_t)fd);
+        pthread_detach(tid);
+    }
+    return NULL;
+}
+
+static int stress_bind(int *port)
+{
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    getsockname(fd, (struct sockaddr *)&addr, &addr_len);
+    *port = ntohs(addr.sin_port);
+    return fd;
+}
+
+// One long lived ctx per thread, reset between requests
+static void *stress_client(void *arg)
+{
+    long fail = 0;
+    char uri[128];
+    int i = 0;
+    khttp_ctx *ctx = khttp_new();
+    for(i = 0; i < STRESS_LOOP; i++){
+        int expect = 200;
+        khttp_reset(ctx);
+        switch(i % 6){
+            case 0:
+                snprintf(uri, sizeof(uri), "http://127.0.0.1:%d/get", stress_port);
+                break;
+            case 1:
+                snprintf(uri, sizeof(uri), "http://127.0.0.1:%d/post", stress_port);
+                khttp_set_method(ctx, KHTTP_POST);
+                khttp_set_post_data(ctx, "data=khttp");
+                khttp_add_header(ctx, "X-Test", "khttp");
+                break;
+            case 2:
+                snprintf(uri, sizeof(uri), "http://127.0.0.1:%d/digest", stress_port);
+                khttp_set_username_password(ctx, "bob", "secret", KHTTP_AUTH_DIGEST);
+                break;
+            case 3:
+                snprintf(uri, sizeof(uri), "http://localhost:%d/basic", stress_port);
+                khttp_set_username_password(ctx, "bob", "secret", KHTTP_AUTH_BASIC);
+                break;
+            case 4:
+                snprintf(uri, sizeof(uri), "http://127.0.0.1:%d/form", stress_port);
+                khttp_set_method(ctx, KHTTP_POST);
+                khttp_set_post_form(ctx, "name", "khttp", KHTTP_FORM_STRING);
+                break;
+            case 5:
+                // Refused connect, error paths log from every thread
+                snprintf(uri, sizeof(uri), "http://127.0.0.1:%d/", stress_closed_port);
+                expect = 0;
+                break;
+        }
+        khttp_set_uri(ctx, uri);
+        int ret = khttp_perform(ctx);
+        if(expect == 0 ? ret == KHTTP_ERR_OK : (ret != KHTTP_ERR_OK || ctx->hp.status_code != expect)){
+            printf("%s ret %d status %d\n", uri, ret, ctx->hp.status_code);
+            fail++;
+        }
+        // Fresh contexts from all threads at once
+        if(i % 50 == 0){
+            khttp_destroy(ctx);
+            ctx = khttp_new();
+        }
+    }
+    khttp_destroy(ctx);
+    return (void *)fail;
+}
+
+int main()
+{
+    pthread_t server;
+    pthread_t client[STRESS_THREAD];
+    long fail = 0;
+    int i = 0;
+    int refused = 0;
+    char expect[64];
+    char text[16384];
+    khttp_hist total;
+    printf(">>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>%s<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<\n",__func__);
+    log_set_level(ERROR);
+    // Error lines of all threads go through the async writer
+    log_set_async(1);
+    stress_listen = stress_bind(&stress_port);
+    listen(stress_listen, 128);
+    // Bound but never listening, connect is refused
+    int closed = stress_bind(&stress_closed_port);
+    pthread_create(&server, NULL, stress_server, NULL);
+    for(i = 0; i < STRESS_THREAD; i++){
+        pthread_create(&client[i], NULL, stress_client, NULL);
+    }
+    for(i = 0; i < STRESS_THREAD; i++){
+        void *ret = NULL;
+        pthread_join(client[i], &ret);
+        fail += (long)ret;
+    }
+    khttp_pool_cleanup();
+    khttp_auth_cleanup();
+    khttp_dns_cleanup();
+    shutdown(stress_listen, SHUT_RDWR);
+    close(stress_listen);
+    close(closed);
+    pthread_join(server, NULL);
+    log_set_async(0);
+    printf("%d threads x %d requests, %ld failed\n", STRESS_THREAD, STRESS_LOOP, fail);
+    // Shards of the exited threads still hold every request
+    for(i = 0; i < STRESS_LOOP; i++) refused += i % 6 == 5;
+    refused *= STRESS_THREAD;
+    snprintf(expect, sizeof(expect), "khttp_errors_total{code=\"connect\"} %d\n", refused);
+    int len = khttp_metrics_export(text, sizeof(text));
+    khttp_metrics_phase(KHTTP_PHASE_TOTAL, &total);
+    printf("total p50 %llu p99 %llu max %llu us\n", (unsigned long long)khttp_hist_quantile(&total, 0.5),
+            (unsigned long long)khttp_hist_quantile(&total, 0.99), (unsigned long long)total.max);
+    // le is inclusive, 16us samples belong above the first bound
+    if(len <= 0 || len >= sizeof(text) || strstr(text, expect) == NULL ||
+            strstr(text, "khttp_phase_duration_seconds_bucket{phase=\"total\",le=\"0.000015\"}") == NULL ||
+            total.count != STRESS_THREAD * STRESS_LOOP - refused){
+        printf("metrics mismatch %d %llu\n%s", len, (unsigned long long)total.count, text);
+        fail++;
+    }
+    if(fail == 0){
+        printf("PASS\n");
+        return 0;
+    }
+    printf("FAIL");
+    return 1;
+}
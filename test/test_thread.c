@@ -26,7 +26,7 @@ void *test_get_digest_https()
     while(1){
     printf(">>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>%s<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<\n",__func__);
     khttp_ctx *ctx = khttp_new();
-    khttp_set_uri(ctx, "https://localhost/digest");
+    khttp_set_uri(ctx, "https://localhost:8443/digest");
     khttp_set_username_password(ctx, "bob", "secret", KHTTP_AUTH_DIGEST);
     khttp_set_method(ctx, KHTTP_GET);
     khttp_ssl_skip_auth(ctx);